@@ -0,0 +1,209 @@
+#include "shared.h"
+
+#include <windows.h>
+#include <winioctl.h>
+#include <Shlwapi.h>
+
+// Read-only throughput benchmark of a raw disk or partition.
+// Every test keeps a fixed number of unbuffered overlapped reads in
+// flight through a completion port and resubmits each completed one
+// until time is up. Latency of every read goes into HIST_BENCH.
+// Nothing is ever written to the device.
+
+#define BENCH_MS 3000 // per test
+#define BENCH_MAX_QD 32
+
+typedef struct bench_test {
+    PCWCH name;
+    DWORD block;
+    DWORD qd;
+    BOOL random;
+} bench_test;
+
+static const bench_test tests[] = {
+    {L"seq",  1 << 20, 1,  FALSE},
+    {L"seq",  1 << 20, 8,  FALSE},
+    {L"rand", 4096,    1,  TRUE},
+    {L"rand", 4096,    4,  TRUE},
+    {L"rand", 4096,    32, TRUE},
+};
+
+typedef struct bench_io {
+    OVERLAPPED ov; // must be first, completion gives it back
+    ULONGLONG start;
+    BYTE* buf;
+} bench_io;
+
+typedef struct bench {
+    HANDLE h;
+    HANDLE port;
+    ULONGLONG size;
+    ULONGLONG next; // offset of next sequential read
+    ULONGLONG rnd;
+    BYTE* buf;
+    const bench_test* t;
+    bench_io io[BENCH_MAX_QD];
+} bench;
+
+static ULONGLONG benchOffset(bench* b)
+{
+    const ULONGLONG blocks = b->size / b->t->block;
+    if (b->t->random) {
+        // xorshift64, same sequence every run
+        ULONGLONG x = b->rnd;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        b->rnd = x;
+        return x % blocks * b->t->block;
+    }
+
+    if (b->next / b->t->block >= blocks)
+        b->next = 0;
+    const ULONGLONG offset = b->next;
+    b->next += b->t->block;
+    return offset;
+}
+
+static DWORD submit(bench* b, bench_io* io)
+{
+    const ULONGLONG offset = benchOffset(b);
+    ZeroMemory(&io->ov, sizeof(io->ov));
+    io->ov.Offset = (DWORD)offset;
+    io->ov.OffsetHigh = (DWORD)(offset >> 32);
+    io->start = nowUs();
+    if (ReadFile(b->h, io->buf, b->t->block, NULL, &io->ov))
+        return 0; // completion is queued anyway
+    const DWORD code = GetLastError();
+    return code == ERROR_IO_PENDING ? 0 : code;
+}
+
+static void runTest(bench* b, json* j)
+{
+    const bench_test* t = b->t;
+    statReset(HIST_BENCH);
+    b->next = 0;
+    b->rnd = 88172645463325252ull;
+
+    DWORD error = 0;
+    DWORD inflight = 0;
+    ULONGLONG bytes = 0;
+    const ULONGLONG start = nowUs();
+    const ULONGLONG deadline = start + BENCH_MS * 1000ull;
+
+    for (DWORD i = 0; i < t->qd && !error; i++) {
+        bench_io* io = &b->io[i];
+        io->buf = b->buf + (SIZE_T)i * t->block;
+        error = submit(b, io);
+        if (!error)
+            inflight++;
+    }
+
+    while (inflight) {
+        DWORD n = 0;
+        ULONG_PTR key;
+        OVERLAPPED* ov = NULL;
+        const BOOL ok = GetQueuedCompletionStatus(b->port, &n, &key, &ov, INFINITE);
+        if (!ov)
+            break; // port is broken, nothing will complete anymore
+        bench_io* io = (bench_io*)ov;
+        if (!ok && !error)
+            error = GetLastError();
+        if (ok) {
+            statRecord(HIST_BENCH, nowUs() - io->start);
+            bytes += n;
+        }
+
+        if (!error && nowUs() < deadline) {
+            error = submit(b, io);
+            if (!error)
+                continue;
+        }
+        inflight--;
+    }
+    const ULONGLONG us = max(nowUs() - start, 1);
+    const ULONGLONG ops = statCount(HIST_BENCH);
+
+    jsonBegin(j, NULL);
+    jsonString(j, "bench", t->name);
+    jsonNumber(j, "block", t->block);
+    jsonNumber(j, "qd", t->qd);
+    jsonNumber(j, "ops", ops);
+    jsonNumber(j, "mb_per_s", bytes * 1000000 / us >> 20);
+    jsonNumber(j, "iops", ops * 1000000 / us);
+    jsonNumber(j, "p50_us", statPercentile(HIST_BENCH, 50));
+    jsonNumber(j, "p90_us", statPercentile(HIST_BENCH, 90));
+    jsonNumber(j, "p99_us", statPercentile(HIST_BENCH, 99));
+    jsonNumber(j, "max_us", statPercentile(HIST_BENCH, 100));
+    if (error)
+        jsonNumber(j, "error", error);
+    jsonEnd(j);
+}
+
+// Disk number is the trailing digits of \\.\PHYSICALDRIVE<n>
+static BOOL diskNumber(PCWCH path, ULONGLONG* n)
+{
+    PCWCH p = path + lstrlenW(path);
+    while (p > path && p[-1] >= L'0' && p[-1] <= L'9')
+        --p;
+    return *p && parseDecimal(p, n);
+}
+
+DWORD benchDisk(json* j, PCWCH path, DWORD partition, err_desc* e)
+{
+    WCHAR device[64];
+    if (partition) {
+        ULONGLONG n;
+        if (!diskNumber(path, &n))
+            return setErrorCode(e, L"Not a physical drive path", ERROR_INVALID_PARAMETER);
+        wnsprintfW(device, ARRAYSIZE(device),
+            L"\\\\?\\GLOBALROOT\\Device\\Harddisk%llu\\Partition%u", n, partition);
+        path = device;
+    }
+
+    // read only, and others may keep using the disk
+    bench b[1] = { 0 };
+    b->h = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+        OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL);
+    if (b->h == INVALID_HANDLE_VALUE)
+        return setError(e, L"Failed to open device");
+
+    DWORD code = 0;
+    GET_LENGTH_INFORMATION len;
+    DWORD n;
+    if (!DeviceIoControl(b->h, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &len, sizeof(len), &n, NULL)) {
+        code = setError(e, L"Failed to get device size");
+        goto out;
+    }
+    b->size = len.Length.QuadPart;
+
+    SIZE_T cb = 0;
+    for (DWORD i = 0; i < ARRAYSIZE(tests); i++)
+        cb = max(cb, (SIZE_T)tests[i].block * tests[i].qd);
+    // page aligned, as unbuffered I/O requires sector alignment
+    b->buf = VirtualAlloc(NULL, cb, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    b->port = CreateIoCompletionPort(b->h, NULL, 0, 1);
+    if (!b->buf || !b->port) {
+        code = setError(e, L"Failed to allocate benchmark resources");
+        goto out;
+    }
+
+    jsonBegin(j, NULL);
+    jsonString(j, "device", path);
+    jsonNumber(j, "size", b->size);
+    jsonEnd(j);
+
+    for (DWORD i = 0; i < ARRAYSIZE(tests) && !j->error; i++) {
+        b->t = &tests[i];
+        if (b->size >= b->t->block)
+            runTest(b, j);
+    }
+
+out:
+    if (b->port)
+        CloseHandle(b->port);
+    if (b->buf)
+        VirtualFree(b->buf, 0, MEM_RELEASE);
+    CloseHandle(b->h);
+    return code;
+}
@@ -0,0 +1,382 @@
+#include "shared.h"
+
+#include <windows.h>
+
+// Block cache for small metadata reads from raw disks and image files:
+// partition tables, image headers and so on. They all want the first
+// and the last few blocks, and a sleeping USB drive makes every
+// uncached read cost a spin-up.
+//
+// Blocks are keyed by device path and block number. A miss loads a run
+// of adjacent missing blocks, plus a little readahead, with one scatter
+// read straight into the slots. Readers of a block which is being
+// loaded wait for that read instead of issuing their own.
+// Blocks of a disk are dropped when its fingerprint changes or a volume
+// event names one of its letters; an event which names no known disk
+// drops everything. Blocks of an image file are dropped when its write
+// time or size changes, see cacheValidate. A loader which raced with
+// any of that throws its result away.
+//
+// Device handles are not kept between misses: an open handle may
+// prevent wsl --mount from taking the disk offline.
+
+#define CACHE_BLOCK 4096 // page, so scatter read can fill slots directly
+#define CACHE_SLOTS 256
+#define CACHE_DEVICES 48
+#define CACHE_RUN 16 // blocks per read at most
+#define CACHE_READAHEAD 4 // blocks per read at least, if they are missing
+
+enum { SLOT_EMPTY, SLOT_LOADING, SLOT_VALID };
+
+typedef struct cache_slot {
+    DWORD dev; // index in cache.dev
+    DWORD gen; // generation of device when the read was started
+    DWORD len; // valid bytes, less than block at the end of device
+    DWORD state;
+    ULONGLONG block;
+    ULONGLONG used; // for LRU
+} cache_slot;
+
+typedef struct cache_dev {
+    DWORD gen; // bumped on invalidation
+    ULONGLONG used;
+    ULONGLONG stamp; // see cacheValidate
+    WCHAR path[MAX_PATH];
+} cache_dev;
+
+typedef struct cache {
+    SRWLOCK lock;
+    CONDITION_VARIABLE loaded;
+    BYTE* data; // CACHE_SLOTS blocks, page aligned
+    ULONGLONG tick;
+    DWORD n_devs;
+    cache_dev dev[CACHE_DEVICES];
+    cache_slot slot[CACHE_SLOTS];
+} cache;
+
+static cache g_cache[1] = { { .lock = SRWLOCK_INIT, .loaded = CONDITION_VARIABLE_INIT, } };
+
+static void dropBlocks(cache* c, DWORD dev)
+{
+    c->dev[dev].gen++;
+    for (DWORD i = 0; i < CACHE_SLOTS; i++) {
+        cache_slot* s = &c->slot[i];
+        // loading ones are dropped by their loader, it sees new generation
+        if (s->dev == dev && s->state == SLOT_VALID)
+            s->state = SLOT_EMPTY;
+    }
+}
+
+static DWORD findDev(cache* c, PCWCH path)
+{
+    DWORD lru = 0;
+    for (DWORD i = 0; i < c->n_devs; i++) {
+        if (!lstrcmpiW(c->dev[i].path, path))
+            return i;
+        if (c->dev[i].used < c->dev[lru].used)
+            lru = i;
+    }
+
+    DWORD i = c->n_devs;
+    if (i < CACHE_DEVICES)
+        c->n_devs++;
+    else {
+        i = lru;
+        dropBlocks(c, i);
+    }
+    StrCpyNW(c->dev[i].path, path, ARRAYSIZE(c->dev[i].path));
+    c->dev[i].stamp = 0;
+    return i;
+}
+
+static cache_slot* findSlot(cache* c, DWORD dev, ULONGLONG block)
+{
+    for (DWORD i = 0; i < CACHE_SLOTS; i++) {
+        cache_slot* s = &c->slot[i];
+        if (s->state != SLOT_EMPTY && s->dev == dev && s->block == block)
+            return s;
+    }
+    return NULL;
+}
+
+static cache_slot* allocSlot(cache* c)
+{
+    cache_slot* lru = NULL;
+    for (DWORD i = 0; i < CACHE_SLOTS; i++) {
+        cache_slot* s = &c->slot[i];
+        if (s->state == SLOT_EMPTY)
+            return s;
+        if (s->state == SLOT_VALID && (!lru || s->used < lru->used))
+            lru = s;
+    }
+    return lru;
+}
+
+static BYTE* slotData(cache* c, const cache_slot* s)
+{
+    return c->data + (s - c->slot) * (SIZE_T)CACHE_BLOCK;
+}
+
+// One scatter read of n blocks into slots, returns bytes read.
+// Last error is set if nothing was read.
+static DWORD readRun(PCWCH path, ULONGLONG block, BYTE** bufs, DWORD n)
+{
+    HANDLE h = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+        OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+        return 0;
+
+    FILE_SEGMENT_ELEMENT seg[CACHE_RUN + 1];
+    for (DWORD i = 0; i < n; i++)
+        seg[i].Buffer = PtrToPtr64(bufs[i]);
+    seg[n].Buffer = NULL;
+
+    const ULONGLONG offset = block * CACHE_BLOCK;
+    OVERLAPPED ov = {
+        .Offset = (DWORD)offset,
+        .OffsetHigh = (DWORD)(offset >> 32),
+    };
+    DWORD got = 0;
+    const ULONGLONG start = nowUs();
+    TRACE_BEGIN("cache.read");
+    if (ReadFileScatter(h, seg, n * CACHE_BLOCK, NULL, &ov) || GetLastError() == ERROR_IO_PENDING)
+        GetOverlappedResult(h, &ov, &got, TRUE);
+    const DWORD error = got ? ERROR_SUCCESS : GetLastError();
+    TRACE_END("cache.read");
+    statRecord(HIST_CACHE_READ, nowUs() - start);
+    statAdd(STAT_CACHE_READS, 1);
+    CloseHandle(h);
+    SetLastError(got || error ? error : ERROR_HANDLE_EOF);
+    return got;
+}
+
+// Load missing blocks starting with block. Called and returns with lock held.
+// Returns FALSE with last error set if the first block can't be read at all.
+static BOOL loadRun(cache* c, DWORD dev, ULONGLONG block, DWORD want)
+{
+    cache_slot* run[CACHE_RUN];
+    BYTE* bufs[CACHE_RUN];
+    const DWORD limit = min(max(want, CACHE_READAHEAD), CACHE_RUN);
+    DWORD n = 0;
+    while (n < limit && !findSlot(c, dev, block + n)) {
+        cache_slot* s = allocSlot(c);
+        if (!s)
+            break; // everything is being loaded, unlikely with a few workers
+        s->state = SLOT_LOADING;
+        s->dev = dev;
+        s->gen = c->dev[dev].gen;
+        s->block = block + n;
+        s->len = 0;
+        bufs[n] = slotData(c, s);
+        run[n++] = s;
+    }
+    if (!n) {
+        SetLastError(ERROR_BUSY);
+        return FALSE;
+    }
+
+    WCHAR path[MAX_PATH];
+    StrCpyNW(path, c->dev[dev].path, ARRAYSIZE(path));
+
+    ReleaseSRWLockExclusive(&c->lock);
+    DWORD got = readRun(path, block, bufs, n);
+    // readahead past the end of device fails the whole read
+    if (!got && want < n)
+        got = readRun(path, block, bufs, want);
+    const DWORD error = GetLastError();
+    AcquireSRWLockExclusive(&c->lock);
+
+    for (DWORD i = 0; i < n; i++) {
+        cache_slot* s = run[i];
+        const DWORD at = i * CACHE_BLOCK;
+        s->len = got > at ? min(got - at, CACHE_BLOCK) : 0;
+        s->used = ++c->tick;
+        // invalidated while reading, or past the end of device
+        s->state = s->len && s->gen == c->dev[dev].gen ? SLOT_VALID : SLOT_EMPTY;
+    }
+    WakeAllConditionVariable(&c->loaded);
+    SetLastError(error);
+    return got != 0;
+}
+
+BOOL cacheRead(PCWCH path, ULONGLONG offset, void* buf, DWORD size)
+{
+    cache* c = g_cache;
+    BYTE* out = buf;
+    BOOL ok = TRUE;
+    DWORD error = ERROR_SUCCESS;
+
+    AcquireSRWLockExclusive(&c->lock);
+    if (!c->data)
+        c->data = VirtualAlloc(NULL, (SIZE_T)CACHE_SLOTS * CACHE_BLOCK,
+            MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!c->data) {
+        ok = FALSE;
+        error = GetLastError();
+    }
+
+    BOOL missed = FALSE; // current block wasn't there on the first look
+    while (ok && size) {
+        const ULONGLONG block = offset / CACHE_BLOCK;
+        const DWORD skip = (DWORD)(offset % CACHE_BLOCK);
+        const DWORD dev = findDev(c, path);
+        c->dev[dev].used = ++c->tick;
+
+        cache_slot* s = findSlot(c, dev, block);
+        if (s && s->state == SLOT_LOADING) {
+            // someone is reading it already
+            if (!missed)
+                statAdd(STAT_CACHE_COALESCED, 1);
+            missed = TRUE;
+            SleepConditionVariableSRW(&c->loaded, &c->lock, INFINITE, 0);
+            continue;
+        }
+        if (!s) {
+            if (!missed)
+                statAdd(STAT_CACHE_MISSES, 1);
+            missed = TRUE;
+            ok = loadRun(c, dev, block, (skip + size + CACHE_BLOCK - 1) / CACHE_BLOCK);
+            if (!ok)
+                error = GetLastError();
+            continue;
+        }
+
+        if (!missed)
+            statAdd(STAT_CACHE_HITS, 1);
+        missed = FALSE;
+        if (skip >= s->len) {
+            ok = FALSE; // past the end of device
+            error = ERROR_HANDLE_EOF;
+            break;
+        }
+        const DWORD n = min(size, s->len - skip);
+        const BYTE* src = slotData(c, s) + skip;
+        for (DWORD i = 0; i < n; i++)
+            out[i] = src[i];
+        s->used = ++c->tick;
+        out += n;
+        offset += n;
+        size -= n;
+    }
+    ReleaseSRWLockExclusive(&c->lock);
+    if (!ok)
+        SetLastError(error);
+    return ok;
+}
+
+void cacheValidate(PCWCH path, ULONGLONG stamp)
+{
+    cache* c = g_cache;
+    AcquireSRWLockExclusive(&c->lock);
+    const DWORD dev = findDev(c, path);
+    if (c->dev[dev].stamp != stamp)
+        dropBlocks(c, dev);
+    c->dev[dev].stamp = stamp;
+    ReleaseSRWLockExclusive(&c->lock);
+}
+
+void cacheInvalidate(PCWCH path)
+{
+    cache* c = g_cache;
+    AcquireSRWLockExclusive(&c->lock);
+    for (DWORD i = 0; i < c->n_devs; i++)
+        if (!path || !lstrcmpiW(c->dev[i].path, path))
+            dropBlocks(c, i);
+    ReleaseSRWLockExclusive(&c->lock);
+}
+
+#define CHECK_READERS 8
+
+typedef struct check_reader {
+    PCWCH path;
+    HANDLE go;
+    BOOL ok;
+    BYTE sector[512];
+} check_reader;
+
+static DWORD WINAPI readBootSector(LPVOID arg)
+{
+    check_reader* r = arg;
+    WaitForSingleObject(r->go, INFINITE);
+    r->ok = cacheRead(r->path, 0, r->sector, sizeof(r->sector));
+    return 0;
+}
+
+// Readers of the same block share one read, whether they came while it
+// was loading or after. Counters are global, so only deltas are checked.
+static void checkShared(check* c, PCWCH path)
+{
+    check_reader r[CHECK_READERS];
+    HANDLE threads[CHECK_READERS];
+    HANDLE go = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!expect(c, go != NULL, L"start event"))
+        return;
+
+    cacheInvalidate(NULL);
+    const LONG64 reads = statGet(STAT_CACHE_READS);
+    const LONG64 misses = statGet(STAT_CACHE_MISSES);
+    const LONG64 shared = statGet(STAT_CACHE_HITS) + statGet(STAT_CACHE_COALESCED);
+    DWORD n = 0;
+    for (; n < CHECK_READERS; n++) {
+        r[n].path = path;
+        r[n].go = go;
+        r[n].ok = FALSE;
+        threads[n] = CreateThread(NULL, 0, readBootSector, &r[n], 0, NULL);
+        if (!threads[n])
+            break;
+    }
+    SetEvent(go);
+    WaitForMultipleObjects(n, threads, TRUE, INFINITE);
+    for (DWORD i = 0; i < n; i++)
+        CloseHandle(threads[i]);
+    CloseHandle(go);
+
+    BOOL same = n == CHECK_READERS;
+    for (DWORD i = 0; i < n; i++) {
+        same &= r[i].ok && r[i].sector[510] == 0x55 && r[i].sector[511] == 0xAA;
+        for (DWORD k = 0; k < sizeof(r[i].sector); k++)
+            same &= r[i].sector[k] == r[0].sector[k];
+    }
+    expect(c, same, L"every reader gets the boot sector");
+    expectNumber(c, statGet(STAT_CACHE_READS) - reads, 1, L"concurrent readers share one read");
+    expectNumber(c, statGet(STAT_CACHE_MISSES) - misses, 1, L"one reader misses");
+    expectNumber(c, statGet(STAT_CACHE_HITS) + statGet(STAT_CACHE_COALESCED) - shared,
+        CHECK_READERS - 1, L"the rest wait for it or hit");
+}
+
+// Cache over sample images, see fixtures/make.py
+void checkCache(check* c)
+{
+    WCHAR path[MAX_PATH];
+    if (!fixturePath(c, L"gpt.img", path))
+        return;
+    checkShared(c, path);
+
+    BYTE buf[512];
+    LONG64 reads = statGet(STAT_CACHE_READS);
+    expect(c, cacheRead(path, 4096, buf, sizeof(buf)), L"readahead block");
+    expectNumber(c, statGet(STAT_CACHE_READS) - reads, 0, L"readahead block is cached");
+
+    cacheInvalidate(path);
+    reads = statGet(STAT_CACHE_READS);
+    expect(c, cacheRead(path, 0, buf, sizeof(buf)), L"read after invalidation");
+    expectNumber(c, statGet(STAT_CACHE_READS) - reads, 1, L"invalidation drops blocks");
+
+    cacheValidate(path, 1);
+    cacheRead(path, 0, buf, sizeof(buf));
+    reads = statGet(STAT_CACHE_READS);
+    cacheValidate(path, 1);
+    expect(c, cacheRead(path, 0, buf, sizeof(buf)), L"read after validation");
+    expectNumber(c, statGet(STAT_CACHE_READS) - reads, 0, L"same stamp keeps blocks");
+    cacheValidate(path, 2);
+    expect(c, cacheRead(path, 0, buf, sizeof(buf)), L"read after file change");
+    expectNumber(c, statGet(STAT_CACHE_READS) - reads, 1, L"new stamp drops blocks");
+
+    // image is 128KB: readahead from the last block runs past its end,
+    // which fails the whole read on a physical disk
+    const DWORD end = 128 << 10;
+    expect(c, cacheRead(path, end - sizeof(buf), buf, sizeof(buf)), L"last sector");
+    expect(c, !cacheRead(path, end, buf, sizeof(buf)), L"nothing past the end");
+    expectNumber(c, GetLastError(), ERROR_HANDLE_EOF, L"past the end error");
+    expect(c, !cacheRead(path, end - 256, buf, sizeof(buf)), L"read across the end");
+}
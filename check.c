@@ -0,0 +1,483 @@
+#include "shared.h"
+
+#include <windows.h>
+#include <Shlwapi.h>
+
+// Self checks of the parts which don't need a disk, WMI or wsl.exe:
+// writers, parsers and text kernels are fed known input and their
+// output is compared with what it must be. Disk readers get small
+// sample images from fixtures directory instead of disks. Every group
+// prints one JSON line with its totals, and one more per failed expectation.
+
+typedef void (*check_fn)(check* c);
+
+BOOL expect(check* c, BOOL ok, PCWCH what)
+{
+    if (ok) {
+        c->passed++;
+        return TRUE;
+    }
+
+    c->failed++;
+    jsonBegin(c->j, NULL);
+    jsonString(c->j, "check", c->group);
+    jsonString(c->j, "failed", what);
+    jsonEnd(c->j);
+    return FALSE;
+}
+
+BOOL expectNumber(check* c, ULONGLONG got, ULONGLONG want, PCWCH what)
+{
+    if (got == want)
+        return expect(c, TRUE, what);
+
+    c->failed++;
+    jsonBegin(c->j, NULL);
+    jsonString(c->j, "check", c->group);
+    jsonString(c->j, "failed", what);
+    jsonNumber(c->j, "got", got);
+    jsonNumber(c->j, "want", want);
+    jsonEnd(c->j);
+    return FALSE;
+}
+
+BOOL expectText(check* c, PCWCH got, PCWCH want, PCWCH what)
+{
+    if (got && want && !lstrcmpW(got, want))
+        return expect(c, TRUE, what);
+    if (!got && !want)
+        return expect(c, TRUE, what);
+
+    c->failed++;
+    jsonBegin(c->j, NULL);
+    jsonString(c->j, "check", c->group);
+    jsonString(c->j, "failed", what);
+    jsonString(c->j, "got", got);
+    jsonString(c->j, "want", want);
+    jsonEnd(c->j);
+    return FALSE;
+}
+
+BOOL fixturePath(check* c, PCWCH name, PWCHAR path)
+{
+    if (PathCombineW(path, c->fixtures, name) && PathFileExistsW(path))
+        return expect(c, TRUE, name);
+
+    c->failed++;
+    jsonBegin(c->j, NULL);
+    jsonString(c->j, "check", c->group);
+    jsonString(c->j, "failed", L"Fixture is missing");
+    jsonString(c->j, "path", path);
+    jsonEnd(c->j);
+    return FALSE;
+}
+
+// JSON writer output goes through a pipe and is compared byte by byte
+typedef struct json_pipe {
+    HANDLE rd;
+    json w[1];
+} json_pipe;
+
+static BOOL expectOutput(check* c, json_pipe* p, PCSTR want, PCWCH what)
+{
+    char got[1024];
+    DWORD n = 0;
+    DWORD avail = 0;
+    if (PeekNamedPipe(p->rd, NULL, 0, NULL, &avail, NULL) && avail)
+        ReadFile(p->rd, got, min(avail, sizeof(got)), &n, NULL);
+
+    const DWORD len = lstrlenA(want);
+    BOOL ok = n == len;
+    for (DWORD i = 0; ok && i < n; ++i)
+        ok = got[i] == want[i];
+    if (ok)
+        return expect(c, TRUE, what);
+
+    WCHAR text[ARRAYSIZE(got) + 1];
+    const int cch = MultiByteToWideChar(CP_UTF8, 0, got, n, text, ARRAYSIZE(text) - 1);
+    text[max(cch, 0)] = 0;
+    return expectText(c, text, NULL, what);
+}
+
+static void checkJson(check* c)
+{
+    json_pipe p[1] = { 0 };
+    if (!expect(c, CreatePipe(&p->rd, &p->w->out, NULL, 1 << 16), L"CreatePipe"))
+        return;
+    json* w = p->w;
+
+    jsonBegin(w, NULL);
+    jsonString(w, "s", L"a\"b\\c\n\r\t\x01/");
+    jsonEnd(w);
+    expectOutput(c, p, "{\"s\":\"a\\\"b\\\\c\\n\\r\\t\\u0001/\"}\n", L"escapes");
+
+    // e acute, euro sign, U+1F600 as surrogate pair, lone high surrogate
+    jsonBegin(w, NULL);
+    jsonString(w, "u", L"\x00E9\x20AC\xD83D\xDE00\xD800!");
+    jsonEnd(w);
+    expectOutput(c, p, "{\"u\":\"\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80\xEF\xBF\xBD!\"}\n",
+        L"utf-8 and surrogates");
+
+    jsonBegin(w, NULL);
+    jsonNumber(w, "zero", 0);
+    jsonNumber(w, "max", ~0ull);
+    jsonString(w, "null", NULL);
+    jsonBool(w, "t", TRUE);
+    jsonBool(w, "f", FALSE);
+    jsonEnd(w);
+    expectOutput(c, p,
+        "{\"zero\":0,\"max\":18446744073709551615,\"null\":null,\"t\":true,\"f\":false}\n",
+        L"numbers, null and booleans");
+
+    jsonBegin(w, NULL);
+    jsonBeginArray(w, "a");
+    jsonNumber(w, NULL, 1);
+    jsonNumber(w, NULL, 2);
+    jsonBegin(w, NULL);
+    jsonBool(w, "b", TRUE);
+    jsonEnd(w);
+    jsonBeginArray(w, NULL);
+    jsonEndArray(w);
+    jsonEndArray(w);
+    jsonString(w, "c", L"");
+    jsonEnd(w);
+    expectOutput(c, p, "{\"a\":[1,2,{\"b\":true},[]],\"c\":\"\"}\n", L"nesting");
+
+    // records are separate lines, the second starts without a comma
+    jsonBeginArray(w, NULL);
+    jsonEndArray(w);
+    jsonBegin(w, NULL);
+    jsonEnd(w);
+    expectOutput(c, p, "[]\n{}\n", L"record per line");
+
+    // line longer than the buffer is flushed in pieces
+    WCHAR x[700];
+    char want[ARRAYSIZE(x) + 16] = "{\"x\":\"";
+    DWORD n = lstrlenA(want);
+    for (DWORD i = 0; i + 1 < ARRAYSIZE(x); ++i) {
+        x[i] = L'a' + i % 26;
+        want[n++] = (char)x[i];
+    }
+    x[ARRAYSIZE(x) - 1] = 0;
+    want[n++] = '"';
+    want[n++] = '}';
+    want[n++] = '\n';
+    want[n] = 0;
+    jsonBegin(w, NULL);
+    jsonString(w, "x", x);
+    jsonEnd(w);
+    expectOutput(c, p, want, L"line longer than buffer");
+    expectNumber(c, w->error, 0, L"no write error");
+
+    // reader is gone: error is kept and nothing else is written
+    CloseHandle(p->rd);
+    jsonBegin(w, NULL);
+    jsonNumber(w, "n", 1);
+    jsonEnd(w);
+    expect(c, w->error != 0, L"write error is reported");
+    expectNumber(c, w->depth, 0, L"depth after error");
+    CloseHandle(w->out);
+}
+
+// Text is placed right in front of a page which can't be read, so a
+// kernel which reads past the terminating zero crashes the check
+typedef struct guarded {
+    BYTE* base;
+    PWCHAR end; // first character of the guard page
+} guarded;
+
+static BOOL guardPage(check* c, guarded* g)
+{
+    g->base = VirtualAlloc(NULL, 2 * 4096, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    DWORD old;
+    if (!expect(c, g->base && VirtualProtect(g->base + 4096, 4096, PAGE_NOACCESS, &old),
+        L"guard page"))
+        return FALSE;
+    g->end = (PWCHAR)(g->base + 4096);
+    return TRUE;
+}
+
+static void freeGuard(guarded* g)
+{
+    if (g->base)
+        VirtualFree(g->base, 0, MEM_RELEASE);
+}
+
+// Put s gap characters before the guard page
+static PWCHAR guardText(guarded* g, PCWCH s, DWORD gap)
+{
+    PWCHAR p = g->end - gap - lstrlenW(s) - 1;
+    for (DWORD i = 0; (p[i] = s[i]) != 0; ++i)
+        ;
+    return p;
+}
+
+static BOOL sameBytes(const char* got, DWORD n, PCSTR want)
+{
+    DWORD i = 0;
+    while (i < n && want[i] && got[i] == want[i])
+        ++i;
+    return i == n && !want[i];
+}
+
+// Every stop character at every position and alignment, with every kernel
+static void checkStops(check* c, guarded* g)
+{
+    static const PCWCH levels[] = { L"scalar", L"SSE2", L"AVX2" };
+    static const WCHAR line[] = { L'\r', L'\n', 0 };
+    static const WCHAR field[] = { L'\t', L' ', L'\n', 0 };
+
+    const DWORD top = limitTextKernels(0);
+    for (DWORD level = 0; level <= top; ++level) {
+        limitTextKernels(level);
+        DWORD bad = 0;
+        for (DWORD len = 0; len < 80; ++len) {
+            // no stop but the terminating zero
+            PWCHAR s = g->end - len - 1;
+            for (DWORD i = 0; i < len; ++i)
+                s[i] = L'a' + i % 26;
+            s[len] = 0;
+            bad += findLineEnd(s) != s + len;
+            bad += findFieldEnd(s) != s + len;
+
+            for (DWORD k = 0; k < len; ++k) {
+                for (DWORD x = 0; x < ARRAYSIZE(line); ++x) {
+                    s[k] = line[x];
+                    bad += findLineEnd(s) != s + k;
+                    bad += findFieldEnd(s) != s + (line[x] == L'\r' ? len : k);
+                }
+                for (DWORD x = 0; x < ARRAYSIZE(field); ++x) {
+                    s[k] = field[x];
+                    bad += findFieldEnd(s) != s + k;
+                }
+                s[k] = L'a' + k % 26;
+            }
+        }
+        WCHAR what[64];
+        wnsprintfW(what, ARRAYSIZE(what), L"line and field ends, %s", levels[level]);
+        expectNumber(c, bad, 0, what);
+    }
+    limitTextKernels(top);
+
+    static const WCHAR breaks[] = L"\r\n\n\rx";
+    expectNumber(c, skipLineBreaks(breaks) - breaks, 4, L"skip line breaks");
+}
+
+static void checkTranscode(check* c, guarded* g)
+{
+    char out[256];
+    WCHAR wide[128];
+
+    // ASCII runs of every length around the vector width
+    DWORD bad = 0;
+    for (DWORD len = 0; len < 40; ++len) {
+        PWCHAR s = g->end - len;
+        for (DWORD i = 0; i < len; ++i)
+            s[i] = L' ' + i;
+        bad += utf16ToUtf8(s, len, out, sizeof(out)) != len;
+        for (DWORD i = 0; i < len; ++i)
+            bad += out[i] != ' ' + (int)i;
+        bad += utf8ToUtf16(out, len, wide, ARRAYSIZE(wide)) != len;
+        for (DWORD i = 0; i < len; ++i)
+            bad += wide[i] != s[i];
+    }
+    expectNumber(c, bad, 0, L"ASCII round trip");
+
+    // e acute, euro sign, U+1F600, lone low and high surrogates after ASCII run
+    static const WCHAR mixed[] = L"abcdefghij\x00E9\x20AC\xD83D\xDE00\xDC00x\xD800";
+    DWORD n = utf16ToUtf8(mixed, ARRAYSIZE(mixed) - 1, out, sizeof(out));
+    expect(c, sameBytes(out, n,
+        "abcdefghij\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80\xEF\xBF\xBDx\xEF\xBF\xBD"),
+        L"utf-16 to utf-8");
+
+    // code point which doesn't fit is not split
+    n = utf16ToUtf8(L"a\x20AC", 2, out, 3);
+    expectNumber(c, n, 1, L"utf-8 output is full");
+
+    n = utf8ToUtf16("abcdefghijklmnopq\xC3\xA9\xF0\x9F\x98\x80", 23, wide, ARRAYSIZE(wide));
+    expectNumber(c, n, 20, L"utf-8 to utf-16 length");
+    expect(c, n == 20 && wide[16] == L'q' && wide[17] == 0x00E9 &&
+        wide[18] == 0xD83D && wide[19] == 0xDE00, L"utf-8 to utf-16");
+
+    // stray continuation, overlong, encoded surrogate, above U+10FFFF,
+    // invalid lead byte, then a sequence cut short by the end of input
+    static const char invalid[] = "\x80\xC0\xAF\xED\xA0\x80\xF4\x90\x80\x80\xFF\xE2\x82";
+    n = utf8ToUtf16(invalid, sizeof(invalid) - 1, wide, ARRAYSIZE(wide));
+    bad = n != 7;
+    for (DWORD i = 0; i < n; ++i)
+        bad += wide[i] != 0xFFFD;
+    expectNumber(c, bad, 0, L"invalid utf-8 is replaced");
+
+    n = utf8ToUtf16("a\xF0\x9F\x98\x80", 5, wide, 2);
+    expectNumber(c, n, 1, L"utf-16 output is full");
+}
+
+static void checkDecimal(check* c, guarded* g)
+{
+    static const struct {
+        PCWCH s;
+        BOOL ok;
+        ULONGLONG v;
+    } cases[] = {
+        {L"", TRUE, 0},
+        {L"0", TRUE, 0},
+        {L"7", TRUE, 7},
+        {L"12345678", TRUE, 12345678},
+        {L"123456789", TRUE, 123456789},
+        {L"000000000000000000042", TRUE, 42},
+        {L"18446744073709551615", TRUE, 18446744073709551615ull},
+        {L"1234567/", FALSE, 0}, // character before '0'
+        {L"123456789:", FALSE, 0}, // character after '9'
+        {L"12 ", FALSE, 0},
+        {L"-1", FALSE, 0},
+        {L"1\x0661", FALSE, 0}, // Arabic-Indic digit one
+    };
+
+    // in the middle of a page, then at every distance from its end
+    DWORD bad = 0;
+    for (DWORD i = 0; i < ARRAYSIZE(cases); ++i) {
+        ULONGLONG v = 1;
+        WCHAR what[64];
+        wnsprintfW(what, ARRAYSIZE(what), L"parse \"%s\"", cases[i].s);
+        expect(c, parseDecimal(cases[i].s, &v) == cases[i].ok && v == cases[i].v, what);
+
+        for (DWORD gap = 0; gap < 40; ++gap) {
+            v = 1;
+            bad += parseDecimal(guardText(g, cases[i].s, gap), &v) != cases[i].ok ||
+                v != cases[i].v;
+        }
+    }
+    expectNumber(c, bad, 0, L"parse decimal near end of page");
+    expectNumber(c, wtou64(L"x1"), 0, L"wtou64 of invalid text");
+}
+
+static void checkUsage(check* c)
+{
+    fs_usage u[4];
+    static const WCHAR df[] =
+        L"Filesystem     1024-blocks      Used Available Capacity Mounted on\n"
+        L"/dev/sdc        1055762868  12345678 989730806       2% /\n"
+        L"/dev/sdd1          1046512    524288    522224      51% /mnt/wsl/PHYSICALDRIVE2p1\r\n"
+        L"none               4096000         0   4096000       0% /mnt/wsl\n"
+        L"/dev/sde2\t976762584\t1\t976762583\t1%\t/mnt/wsl/backupp2\n"
+        L"/dev/sdf1                -         -         -        - /mnt/wsl/PHYSICALDRIVE3p1\n"
+        L"/dev/sdg1               16         8         8      50% /mnt/wsl/PHYSICALDRIVE123456789p1";
+
+    const DWORD n = parseUsage(df, u, ARRAYSIZE(u));
+    if (!expectNumber(c, n, 3, L"df lines under /mnt/wsl"))
+        return;
+    expectText(c, u[0].name, L"PHYSICALDRIVE2p1", L"mount point name");
+    expectNumber(c, u[0].size, 1046512ull << 10, L"size in bytes");
+    expectNumber(c, u[0].used, 524288ull << 10, L"used in bytes");
+    expectNumber(c, u[0].avail, 522224ull << 10, L"available in bytes");
+    expectText(c, u[1].name, L"backupp2", L"tab separated line");
+    expectNumber(c, u[1].avail, 976762583ull << 10, L"large filesystem");
+    // longer names are cut to MAX_DRIVE_PATH - 1
+    expectText(c, u[2].name, L"PHYSICALDRIVE123456789p", L"long name is cut");
+
+    expectNumber(c, parseUsage(df, u, 1), 1, L"stops at max");
+    expectNumber(c, parseUsage(L"", u, ARRAYSIZE(u)), 0, L"no output");
+    expectNumber(c, parseUsage(L"Filesystem 1024-blocks Used Available Capacity Mounted on",
+        u, ARRAYSIZE(u)), 0, L"header only");
+
+    // output which filled the buffer ends in the middle of a mount point
+    WCHAR cut[] = L"/dev/sdd1 1046512 524288 522224 51% /mnt/wsl/PHYSICALDRIVE2p1\r\n"
+        L"/dev/sdd12 16 8 8 50% /mnt/wsl/PHYSICALDRIVE2p1";
+    trimPartialLine(cut, ARRAYSIZE(cut) - 1);
+    expectNumber(c, parseUsage(cut, u, ARRAYSIZE(u)), 1, L"cut line is dropped");
+    WCHAR line[] = L"/dev/sdd1 1046512 524288 522224";
+    trimPartialLine(line, ARRAYSIZE(line) - 1);
+    expectText(c, line, L"", L"single cut line is dropped");
+}
+
+static void checkParsers(check* c)
+{
+    checkUsage(c);
+
+    WCHAR text[32];
+    // MB is 1000 KiB and GB is 1000 MiB, as in the menu
+    static const struct {
+        ULONGLONG size;
+        PCWCH text;
+    } sizes[] = {
+        {0, L"0MB"},
+        {512ull << 10, L"0.51MB"},
+        {3ull << 19, L"1.53MB"},
+        {1000ull << 20, L"1024MB"},
+        {1001ull << 20, L"1GB"},
+        {(3ull << 30) / 2, L"1.53GB"},
+        {1000204886016ull, L"953GB"},
+        {~0ull, L"17592186044GB"},
+    };
+    for (DWORD i = 0; i < ARRAYSIZE(sizes); ++i) {
+        formatSize(sizes[i].size, text, ARRAYSIZE(text));
+        expectText(c, text, sizes[i].text, L"formatSize");
+    }
+    formatSize(1000204886016ull, text, 3);
+    expectText(c, text, L"95", L"formatSize cut to buffer");
+
+    static const WCHAR list[] =
+        L"  NAME            STATE           VERSION\r\n"
+        L"  docker-desktop  Stopped         2\r\n"
+        L"* Ubuntu-22.04    Running         2\r\n";
+    expect(c, parseDistroList(list, text, ARRAYSIZE(text)), L"default distro is found");
+    expectText(c, text, L"Ubuntu-22.04", L"default distro");
+    expect(c, !parseDistroList(L"  NAME STATE VERSION\r\n  Debian Stopped 2\r\n",
+        text, ARRAYSIZE(text)), L"no default distro");
+
+    part_letter link = { 0 };
+    expect(c, parseLetterLink(L"\\\\PC\\root\\cimv2:Win32_DiskPartition.DeviceID=\"Disk #12, Partition #3\"",
+        L"\\\\PC\\root\\cimv2:Win32_LogicalDisk.DeviceID=\"F:\"", &link) &&
+        link.disk == 12 && link.part == 3 && link.letter == L'F', L"drive letter link");
+    expect(c, !parseLetterLink(L"Win32_DiskPartition.DeviceID=\"Disk #1\"",
+        L"Win32_LogicalDisk.DeviceID=\"F:\"", &link), L"link without partition");
+}
+
+static void checkText(check* c)
+{
+    guarded g[1] = { 0 };
+    if (!guardPage(c, g))
+        return;
+    checkStops(c, g);
+    checkTranscode(c, g);
+    checkDecimal(c, g);
+    freeGuard(g);
+}
+
+BOOL runChecks(json* j, PCWCH group, PCWCH fixtures, DWORD* failed)
+{
+    static const struct {
+        PCWCH name;
+        check_fn fn;
+    } groups[] = {
+        {L"json", checkJson},
+        {L"trace", checkTrace},
+        {L"stats", checkStats},
+        {L"text", checkText},
+        {L"parsers", checkParsers},
+        {L"iostat", checkIostat},
+        {L"mounts", checkMounts},
+        {L"layout", checkLayout},
+        {L"cache", checkCache},
+        {L"images", checkImages},
+        {L"pool", checkPool},
+    };
+
+    BOOL found = FALSE;
+    *failed = 0;
+    for (DWORD i = 0; i < ARRAYSIZE(groups); ++i) {
+        if (group && lstrcmpiW(group, groups[i].name))
+            continue;
+
+        check c[1] = { {.j = j, .group = groups[i].name, .fixtures = fixtures} };
+        groups[i].fn(c);
+        jsonBegin(j, NULL);
+        jsonString(j, "check", c->group);
+        jsonNumber(j, "passed", c->passed);
+        jsonNumber(j, "failed", c->failed);
+        jsonEnd(j);
+        *failed += c->failed;
+        found = TRUE;
+    }
+    return found;
+}
@@ -0,0 +1,606 @@
+#include "shared.h"
+
+#include <windows.h>
+#include <objbase.h>
+#include <shellapi.h>
+#include <Shlwapi.h>
+
+// Headless mode for scripts:
+//   wsldskmnt list                    print all disks
+//   wsldskmnt mount <disk> [part]     wsl --mount <disk> --bare, or mount partition
+//   wsldskmnt unmount [disk]          wsl --unmount <disk>, or all disks
+//   wsldskmnt watch                   print disk arrival/removal as it happens
+//   wsldskmnt bench-refresh [rounds] [disks] [slow_ms]
+//                                     measure change event to menu ready latency
+//                                     with synthetic disks instead of WMI
+//   wsldskmnt bench-disk <disk> [part] read-only throughput and latency test,
+//                                     needs administrator rights
+//   wsldskmnt bench-core [disks]      core.c helpers over synthetic layouts
+//                                     of 1 to 10000 disks
+//   wsldskmnt bench-rules [rounds]    auto-mount rule matching cost for
+//                                     rulesets of 16 to 256 rules
+//   wsldskmnt bench-snapshot [readers] [rounds] [interval_us]
+//                                     reader threads against snapshot
+//                                     publisher, fails on torn copies
+//   wsldskmnt bench-pool [tasks]      task pool throughput on 1 to all
+//                                     workers
+//   wsldskmnt fingerprint <disk|image>...
+//                                     partition table fingerprint
+//   wsldskmnt simulate [hours] [disks] [seed]
+//                                     tray event loop on virtual clock with
+//                                     synthetic disks and fake wsl.exe
+//   wsldskmnt image <file>...         format, block map and partitions of
+//                                     VHD, VHDX or raw image, not attached
+//   wsldskmnt check [group] [fixtures]
+//                                     self checks of writers, parsers, text
+//                                     kernels and disk readers against sample
+//                                     images, exit code 1 on failure
+// <disk> is disk index, device path or image file, [part] is partition
+// number as wsl.exe expects it.
+// Every record is a single JSON line written to stdout.
+
+typedef int (*verb_cb)(state* st, json* j, int argc, PWSTR* argv);
+
+static HANDLE openStdout(void)
+{
+    HANDLE h = GetStdHandle(STD_OUTPUT_HANDLE);
+    if (h && h != INVALID_HANDLE_VALUE)
+        return h;
+
+    // Program is linked for GUI subsystem, so it only has stdout
+    // when it was redirected. Otherwise borrow parent's console.
+    if (!AttachConsole(ATTACH_PARENT_PROCESS))
+        return INVALID_HANDLE_VALUE;
+    return CreateFileW(L"CONOUT$", GENERIC_WRITE, FILE_SHARE_WRITE, NULL,
+        OPEN_EXISTING, 0, NULL);
+}
+
+static int printError(json* j, const err_desc* e)
+{
+    jsonBegin(j, NULL);
+    jsonString(j, "error", e->title);
+    jsonString(j, "text", e->text);
+    jsonNumber(j, "code", e->error);
+    jsonEnd(j);
+    return 1;
+}
+
+static int printUsage(json* j, PCWCH text)
+{
+    jsonBegin(j, NULL);
+    jsonString(j, "error", L"Invalid arguments");
+    jsonString(j, "text", text);
+    jsonEnd(j);
+    return 2;
+}
+
+static void printDisk(json* j, PCWCH event, const disk_info* disk)
+{
+    jsonBegin(j, NULL);
+    if (event)
+        jsonString(j, "event", event);
+    jsonNumber(j, "index", disk->index);
+    jsonString(j, "path", disk->path);
+    jsonString(j, "image", disk->image[0] ? disk->image : NULL);
+    jsonString(j, "model", disk->model);
+    jsonString(j, "serial", disk->serial);
+    jsonNumber(j, "size", disk->size);
+
+    const err_desc* e = disk->e->error ? disk->e : disk->e_parts;
+    if (e->error) {
+        jsonString(j, "error", e->text);
+    }
+    else {
+        jsonBeginArray(j, "parts");
+        for (DWORD i = 0; i < disk->n_parts; i++) {
+            const part_info* part = &disk->part[i];
+            const WCHAR letter[2] = { part->letter, 0 };
+            jsonBegin(j, NULL);
+            jsonNumber(j, "index", part->index);
+            jsonNumber(j, "partition", part->index + 1);
+            jsonNumber(j, "size", part->size);
+            jsonString(j, "letter", part->letter ? letter : NULL);
+            jsonString(j, "type", part->type);
+            jsonEnd(j);
+        }
+        jsonEndArray(j);
+    }
+    jsonEnd(j);
+}
+
+static DWORD startDisks(state* st)
+{
+    if (st->services)
+        return 0;
+
+    switch (CoInitializeEx(NULL, COINIT_MULTITHREADED)) {
+    case S_OK:
+    case S_FALSE:
+        break;
+    default:
+        return GetLastError();
+    }
+
+    HRESULT hr = initDisks(st);
+    if (FAILED(hr))
+        return hr;
+    return backendList(st);
+}
+
+static BOOL isPath(PCWCH s)
+{
+    return s[0] == L'\\' || (s[0] && s[1] == L':');
+}
+
+// \\.\PHYSICALDRIVE<n>, anything else is an image file
+static BOOL isDevice(PCWCH s)
+{
+    return !StrCmpNW(s, L"\\\\.\\", 4);
+}
+
+// Resolve disk argument to device path or image file. Index requires enumeration.
+static PCWCH findDisk(state* st, json* j, PCWCH arg)
+{
+    if (isPath(arg))
+        return arg;
+
+    int index = 0;
+    if (!StrToIntExW(arg, STIF_DEFAULT, &index) || index < 0) {
+        printUsage(j, arg);
+        return NULL;
+    }
+
+    if (startDisks(st)) {
+        printError(j, st->e);
+        return NULL;
+    }
+    for (DWORD i = 0; i < st->n_disks; i++) {
+        const disk_info* disk = getDisk(st, i);
+        if (disk->index == (DWORD)index)
+            return diskDevice(disk);
+    }
+    printUsage(j, L"No such disk");
+    return NULL;
+}
+
+static int runWsl(json* j, PCWCH verb, PCWCH path, PWCHAR args, BOOL elevate)
+{
+    // Console of wsl.exe must not be shared, it would corrupt our output
+    SHELLEXECUTEINFO sei = {
+        .cbSize = sizeof(sei),
+        .fMask = SEE_MASK_NOCLOSEPROCESS | SEE_MASK_NO_CONSOLE | SEE_MASK_FLAG_NO_UI,
+        .lpVerb = elevate ? L"runas" : NULL,
+        .lpFile = WSL_PATH,
+        .lpParameters = args,
+        .nShow = SW_HIDE,
+    };
+    if (!ShellExecuteExW(&sei)) {
+        err_desc e[1] = { 0 };
+        setError(e, L"Failed to start wsl.exe");
+        printError(j, e);
+        resetErr(e);
+        return 1;
+    }
+
+    DWORD exitCode = 1;
+    WaitForSingleObject(sei.hProcess, INFINITE);
+    GetExitCodeProcess(sei.hProcess, &exitCode);
+    CloseHandle(sei.hProcess);
+
+    jsonBegin(j, NULL);
+    jsonString(j, "command", verb);
+    jsonString(j, "path", path);
+    jsonNumber(j, "exit", exitCode);
+    jsonEnd(j);
+    return exitCode ? 1 : 0;
+}
+
+static int cmdList(state* st, json* j, int argc, PWSTR* argv)
+{
+    UNREFERENCED_PARAMETER(argv);
+    if (argc)
+        return printUsage(j, L"list takes no arguments");
+
+    if (startDisks(st))
+        return printError(j, st->e);
+
+    for (DWORD i = 0; i < st->n_disks; i++)
+        printDisk(j, NULL, getDisk(st, i));
+    return 0;
+}
+
+static int cmdMount(state* st, json* j, int argc, PWSTR* argv)
+{
+    if (argc < 1 || argc > 2)
+        return printUsage(j, L"mount <disk> [partition]");
+
+    PCWCH path = findDisk(st, j, argv[0]);
+    if (!path)
+        return 1;
+
+    WCHAR cmd[MAX_PATH + 96];
+    PCWCH vhd = isDevice(path) ? L"" : L"--vhd ";
+    if (argc == 1) {
+        wnsprintfW(cmd, ARRAYSIZE(cmd), L"--mount %s\"%s\" --bare", vhd, path);
+    }
+    else {
+        int p = 0;
+        if (!StrToIntExW(argv[1], STIF_DEFAULT, &p) || p <= 0)
+            return printUsage(j, argv[1]);
+        if (isDevice(path))
+            wnsprintfW(cmd, ARRAYSIZE(cmd), L"--mount \"%s\" --partition %u", path, p);
+        else {
+            // same mount point as the tray gives it, so it shows usage too
+            WCHAR image[MAX_DRIVE_PATH], name[MAX_DRIVE_PATH];
+            imageMountName(st, path, image);
+            partMountName(image, p, name, ARRAYSIZE(name));
+            wnsprintfW(cmd, ARRAYSIZE(cmd), L"--mount --vhd \"%s\" --partition %u --name %s",
+                path, p, name);
+        }
+    }
+    return runWsl(j, L"mount", path, cmd, TRUE);
+}
+
+static int cmdUnmount(state* st, json* j, int argc, PWSTR* argv)
+{
+    if (argc > 1)
+        return printUsage(j, L"unmount [disk]");
+
+    WCHAR cmd[MAX_PATH + 32] = L"--unmount";
+    PCWCH path = NULL;
+    if (argc) {
+        path = findDisk(st, j, argv[0]);
+        if (!path)
+            return 1;
+        wnsprintfW(cmd, ARRAYSIZE(cmd), L"--unmount \"%s\"", path);
+    }
+    return runWsl(j, L"unmount", path, cmd, FALSE);
+}
+
+static BOOL hasDisk(const ULONG* ids, DWORD n, ULONG id)
+{
+    for (DWORD i = 0; i < n; i++)
+        if (ids[i] == id)
+            return TRUE;
+    return FALSE;
+}
+
+static int cmdWatch(state* st, json* j, int argc, PWSTR* argv)
+{
+    UNREFERENCED_PARAMETER(argv);
+    if (argc)
+        return printUsage(j, L"watch takes no arguments");
+
+    if (startDisks(st))
+        return printError(j, st->e);
+    if (!st->events)
+        return printError(j, st->e);
+
+    ULONG ids[MAX_DISKS];
+    WCHAR paths[MAX_DISKS][MAX_DRIVE_PATH];
+    DWORD n = 0;
+    for (DWORD i = 0; i < st->n_disks; i++)
+        printDisk(j, L"present", getDisk(st, i));
+
+    while (!j->error) {
+        // remember what was there to report removed disks
+        n = st->n_disks;
+        for (DWORD i = 0; i < n; i++) {
+            const disk_info* disk = getDisk(st, i);
+            ids[i] = diskId(disk);
+            StrCpyNW(paths[i], disk->path, MAX_DRIVE_PATH);
+        }
+
+        while (!pollDisks(st))
+            Sleep(DISK_POLL_MS);
+
+        resetDisks(st);
+        backendList(st);
+        if (st->e->error)
+            printError(j, st->e);
+
+        ULONG now[MAX_DISKS];
+        for (DWORD i = 0; i < st->n_disks; i++)
+            now[i] = diskId(getDisk(st, i));
+
+        for (DWORD i = 0; i < n; i++) {
+            if (hasDisk(now, st->n_disks, ids[i]))
+                continue;
+            jsonBegin(j, NULL);
+            jsonString(j, "event", L"removed");
+            jsonString(j, "path", paths[i]);
+            jsonEnd(j);
+        }
+        for (DWORD i = 0; i < st->n_disks; i++)
+            if (!hasDisk(ids, n, now[i]))
+                printDisk(j, L"added", getDisk(st, i));
+    }
+    return 0;
+}
+
+static BOOL parseCount(PCWCH arg, DWORD limit, DWORD* n)
+{
+    int v = 0;
+    if (!StrToIntExW(arg, STIF_DEFAULT, &v) || v <= 0 || (DWORD)v > limit)
+        return FALSE;
+    *n = v;
+    return TRUE;
+}
+
+static int cmdBenchRefresh(state* st, json* j, int argc, PWSTR* argv)
+{
+    DWORD rounds = 1000;
+    DWORD disks = 8;
+    DWORD slow_ms = 0;
+    if (argc > 3)
+        return printUsage(j, L"bench-refresh [rounds] [disks] [slow_ms]");
+    if (argc > 0 && !parseCount(argv[0], MAXLONG, &rounds))
+        return printUsage(j, argv[0]);
+    if (argc > 1 && !parseCount(argv[1], MAX_DISKS, &disks))
+        return printUsage(j, argv[1]);
+    if (argc > 2 && !parseCount(argv[2], MAXLONG, &slow_ms))
+        return printUsage(j, argv[2]);
+
+    // real menu is built, it's just never shown
+    st->menu = CreatePopupMenu();
+    if (!st->menu) {
+        err_desc e[1] = { 0 };
+        setError(e, L"CreatePopupMenu failed");
+        printError(j, e);
+        resetErr(e);
+        return 1;
+    }
+
+    synthStart(st, disks, slow_ms, 0);
+    refreshDisks(st);
+
+    const ULONGLONG start = nowUs();
+    for (DWORD r = 0; r < rounds; r++) {
+        // bursts of 1..4 events, like a disk with several volumes
+        synthInject(st, 1 + r % 4);
+        if (backendPoll(st))
+            refreshDisks(st);
+    }
+    const ULONGLONG elapsed = nowUs() - start;
+
+    jsonBegin(j, NULL);
+    jsonString(j, "bench", L"refresh");
+    jsonNumber(j, "rounds", rounds);
+    jsonNumber(j, "disks", disks);
+    jsonNumber(j, "slow_ms", slow_ms);
+    jsonNumber(j, "parts_timeout", statGet(STAT_PARTS_TIMEOUT));
+    jsonNumber(j, "elapsed_us", elapsed);
+    jsonNumber(j, "p50_us", statPercentile(HIST_EVENT_TO_MENU, 50));
+    jsonNumber(j, "p90_us", statPercentile(HIST_EVENT_TO_MENU, 90));
+    jsonNumber(j, "p99_us", statPercentile(HIST_EVENT_TO_MENU, 99));
+    jsonNumber(j, "max_us", statPercentile(HIST_EVENT_TO_MENU, 100));
+    jsonEnd(j);
+
+    DestroyMenu(st->menu);
+    st->menu = NULL;
+    st->backend = NULL;
+    return 0;
+}
+
+BOOL parseBenchArgs(int argc, PWSTR* argv, DWORD* partition)
+{
+    *partition = 0;
+    if (argc < 1 || argc > 2)
+        return FALSE;
+    return argc < 2 || parseCount(argv[1], MAXLONG, partition);
+}
+
+static int cmdBenchDisk(state* st, json* j, int argc, PWSTR* argv)
+{
+    DWORD part;
+    if (!parseBenchArgs(argc, argv, &part))
+        return printUsage(j, L"bench-disk <disk> [partition]");
+
+    PCWCH path = findDisk(st, j, argv[0]);
+    if (!path)
+        return 1;
+
+    err_desc e[1] = { 0 };
+    int code = 0;
+    if (benchDisk(j, path, part, e))
+        code = printError(j, e);
+    resetErr(e);
+    return code;
+}
+
+static int cmdBenchCore(state* st, json* j, int argc, PWSTR* argv)
+{
+    UNREFERENCED_PARAMETER(st);
+    DWORD disks = CORE_BENCH_DISKS;
+    if (argc > 1)
+        return printUsage(j, L"bench-core [disks]");
+    if (argc > 0 && !parseCount(argv[0], CORE_BENCH_DISKS, &disks))
+        return printUsage(j, argv[0]);
+
+    err_desc e[1] = { 0 };
+    int code = 0;
+    if (benchCore(j, disks, e))
+        code = printError(j, e);
+    resetErr(e);
+    return code;
+}
+
+static int cmdBenchRules(state* st, json* j, int argc, PWSTR* argv)
+{
+    UNREFERENCED_PARAMETER(st);
+    DWORD rounds = 10000;
+    if (argc > 1)
+        return printUsage(j, L"bench-rules [rounds]");
+    if (argc > 0 && !parseCount(argv[0], MAXLONG, &rounds))
+        return printUsage(j, argv[0]);
+
+    err_desc e[1] = { 0 };
+    int code = 0;
+    if (benchRules(j, rounds, e))
+        code = printError(j, e);
+    resetErr(e);
+    return code;
+}
+
+static int cmdBenchSnapshot(state* st, json* j, int argc, PWSTR* argv)
+{
+    UNREFERENCED_PARAMETER(st);
+    DWORD readers = 8;
+    DWORD rounds = 10000;
+    DWORD interval_us = 100;
+    if (argc > 3)
+        return printUsage(j, L"bench-snapshot [readers] [rounds] [interval_us]");
+    if (argc > 0 && !parseCount(argv[0], MAXIMUM_WAIT_OBJECTS, &readers))
+        return printUsage(j, argv[0]);
+    if (argc > 1 && !parseCount(argv[1], MAXLONG, &rounds))
+        return printUsage(j, argv[1]);
+    if (argc > 2 && !parseCount(argv[2], MAXLONG, &interval_us))
+        return printUsage(j, argv[2]);
+
+    err_desc e[1] = { 0 };
+    int code = 0;
+    if (benchSnapshot(j, readers, rounds, interval_us, e))
+        code = printError(j, e);
+    resetErr(e);
+    return code;
+}
+
+static int cmdBenchPool(state* st, json* j, int argc, PWSTR* argv)
+{
+    UNREFERENCED_PARAMETER(st);
+    DWORD tasks = 100000;
+    if (argc > 1)
+        return printUsage(j, L"bench-pool [tasks]");
+    if (argc > 0 && !parseCount(argv[0], 10000000, &tasks))
+        return printUsage(j, argv[0]);
+
+    err_desc e[1] = { 0 };
+    int code = 0;
+    if (benchPool(j, tasks, e))
+        code = printError(j, e);
+    resetErr(e);
+    return code;
+}
+
+static int cmdFingerprint(state* st, json* j, int argc, PWSTR* argv)
+{
+    if (argc < 1)
+        return printUsage(j, L"fingerprint <disk|image>...");
+
+    int code = 0;
+    for (int i = 0; i < argc; i++) {
+        // anything but disk index is opened as is, so image files work too
+        int index;
+        PCWCH path = argv[i];
+        if (StrToIntExW(path, STIF_DEFAULT, &index)) {
+            path = findDisk(st, j, path);
+            if (!path)
+                return 1;
+        }
+
+        const ULONGLONG fp = diskFingerprint(path, 0, TRUE);
+        jsonBegin(j, NULL);
+        jsonString(j, "path", path);
+        if (fp)
+            jsonNumber(j, "fingerprint", fp);
+        else
+            jsonString(j, "error", L"No readable partition table");
+        // same path twice shows the block cache at work
+        jsonNumber(j, "cache_hits", statGet(STAT_CACHE_HITS));
+        jsonNumber(j, "cache_misses", statGet(STAT_CACHE_MISSES));
+        jsonNumber(j, "cache_reads", statGet(STAT_CACHE_READS));
+        jsonEnd(j);
+        if (!fp)
+            code = 1;
+    }
+    return code;
+}
+
+static int cmdImage(state* st, json* j, int argc, PWSTR* argv)
+{
+    UNREFERENCED_PARAMETER(st);
+    if (argc < 1)
+        return printUsage(j, L"image <file>...");
+
+    int code = 0;
+    for (int i = 0; i < argc; i++) {
+        err_desc e[1] = { 0 };
+        if (inspectImage(j, argv[i], e))
+            code = printError(j, e);
+        resetErr(e);
+    }
+    return code;
+}
+
+static int cmdSimulate(state* st, json* j, int argc, PWSTR* argv)
+{
+    DWORD hours = 8;
+    DWORD disks = 8;
+    DWORD seed = 1;
+    if (argc > 3)
+        return printUsage(j, L"simulate [hours] [disks] [seed]");
+    if (argc > 0 && !parseCount(argv[0], 24 * 365, &hours))
+        return printUsage(j, argv[0]);
+    if (argc > 1 && !parseCount(argv[1], MAX_DISKS, &disks))
+        return printUsage(j, argv[1]);
+    if (argc > 2 && !parseCount(argv[2], MAXLONG, &seed))
+        return printUsage(j, argv[2]);
+
+    err_desc e[1] = { 0 };
+    int code = 0;
+    if (runSimulation(st, j, hours, disks, seed, e))
+        code = printError(j, e);
+    resetErr(e);
+    return code;
+}
+
+static int cmdCheck(state* st, json* j, int argc, PWSTR* argv)
+{
+    UNREFERENCED_PARAMETER(st);
+    if (argc > 2)
+        return printUsage(j, L"check [group] [fixtures]");
+
+    // "all" lets fixtures directory be given for every group
+    PCWCH group = argc > 0 && lstrcmpiW(argv[0], L"all") ? argv[0] : NULL;
+    DWORD failed;
+    if (!runChecks(j, group, argc > 1 ? argv[1] : L"fixtures", &failed))
+        return printUsage(j, argv[0]);
+    return failed ? 1 : 0;
+}
+
+int runCli(state* st, int argc, PWSTR* argv)
+{
+    static const struct {
+        PCWCH name;
+        verb_cb cb;
+    } verbs[] = {
+        {L"list",       cmdList},
+        {L"mount",      cmdMount},
+        {L"unmount",    cmdUnmount},
+        {L"watch",      cmdWatch},
+        {L"bench-refresh", cmdBenchRefresh},
+        {L"bench-disk", cmdBenchDisk},
+        {L"bench-core", cmdBenchCore},
+        {L"bench-rules", cmdBenchRules},
+        {L"bench-snapshot", cmdBenchSnapshot},
+        {L"bench-pool", cmdBenchPool},
+        {L"fingerprint", cmdFingerprint},
+        {L"simulate",   cmdSimulate},
+        {L"image",      cmdImage},
+        {L"check",      cmdCheck},
+    };
+
+    json j[1] = { {.out = openStdout(), } };
+    verb_cb cb = NULL;
+    for (DWORD i = 0; i < ARRAYSIZE(verbs); i++)
+        if (!lstrcmpiW(argv[0], verbs[i].name))
+            cb = verbs[i].cb;
+
+    if (!cb)
+        return printUsage(j, L"list | mount <disk> [partition] | unmount [disk] | watch | bench-refresh | bench-disk <disk> [partition] | bench-core [disks] | bench-rules [rounds] | bench-snapshot [readers] [rounds] [interval_us] | bench-pool [tasks] | fingerprint <disk|image>... | simulate [hours] [disks] [seed] | image <file>... | check [group] [fixtures]");
+
+    const int code = cb(st, j, argc - 1, argv + 1);
+    resetDisks(st);
+    deinitDisks(st);
+    return code;
+}
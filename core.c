@@ -0,0 +1,912 @@
+#include "core.h"
+
+// Platform-neutral helpers.
+// Nothing here calls system APIs, only plain data in and out, and only
+// core.h is included so it builds outside of Windows too.
+
+void trimToLine(PWCHAR s)
+{
+    s[findLineEnd(s) - s] = 0;
+}
+
+void trimPartialLine(PWCHAR s, DWORD n)
+{
+    while (n && s[n - 1] != L'\n' && s[n - 1] != L'\r')
+        n--;
+    s[n] = 0;
+}
+
+ULONGLONG wtou64(const WCHAR* s)
+{
+    ULONGLONG r;
+    parseDecimal(s, &r);
+    return r;
+}
+
+static void swapDisks(disk_info* l, disk_info* r)
+{
+    disk_info t[1];
+    *t = *l;
+    *l = *r;
+    *r = *t;
+}
+
+void sortDisks(disk_info* disk, DWORD n)
+{
+    // Disks mostly come already sorted, so insertion sort does no swaps at all
+    for (DWORD x = 1; x < n; x++)
+        for (DWORD y = x; y > 0 && disk[y - 1].index > disk[y].index; y--)
+            swapDisks(&disk[y - 1], &disk[y]);
+}
+
+static BOOL isKnown(ULONG id, const ULONG* known, DWORD n_known)
+{
+    for (DWORD i = 0; i < n_known; i++)
+        if (known[i] == id)
+            return TRUE;
+    return FALSE;
+}
+
+DWORD loadOrder(const disk_info* disk, const ULONG* ids, DWORD n,
+    const ULONG* known, DWORD n_known, DWORD* order)
+{
+    // rank 3: new removable, 2: new, 1: removable, 0: the rest
+    DWORD rank[MAX_DISKS];
+    for (DWORD i = 0; i < n; i++)
+        rank[i] = (isKnown(ids[i], known, n_known) ? 0 : 2) + (disk[i].removable ? 1 : 0);
+
+    DWORD k = 0;
+    DWORD urgent = 0;
+    for (DWORD r = 4; r-- > 0;) {
+        for (DWORD i = 0; i < n; i++)
+            if (rank[i] == r)
+                order[k++] = i;
+        if (r == 1)
+            urgent = k;
+    }
+    return urgent;
+}
+
+BOOL parseDistroList(const WCHAR* text, PWCHAR dist, DWORD cch)
+{
+    // Default distribution is marked with "* " in output of wsl --list -v
+    for (;;) {
+        switch (*text) {
+        case 0:
+            return FALSE;
+
+        case L'*': // found
+            // skip "* "
+            ++text;
+            if (*text)
+                ++text;
+            // copy name of the distro
+            const PCWCH end = findFieldEnd(text);
+            DWORD n = 0;
+            while (text < end && *text != L'\r' && n + 1 < cch)
+                dist[n++] = *text++;
+            dist[n] = 0;
+            return n != 0;
+
+        default:
+            // goto next line
+            text = skipLineBreaks(findLineEnd(text));
+        }
+    }
+}
+
+static PCWCH skipBlanks(PCWCH s)
+{
+    while (*s == L' ' || *s == L'\t')
+        ++s;
+    return s;
+}
+
+// Copy next field of the line, returns position after it
+static PCWCH nextField(PCWCH s, PWCHAR field, DWORD cch)
+{
+    s = skipBlanks(s);
+    const PCWCH end = findFieldEnd(s);
+    DWORD n = 0;
+    while (s < end && *s != L'\r' && n + 1 < cch)
+        field[n++] = *s++;
+    field[n] = 0;
+    return end;
+}
+
+DWORD parseUsage(const WCHAR* text, fs_usage* usage, DWORD max)
+{
+    // Filesystem 1024-blocks Used Available Capacity Mounted on
+    static const WCHAR prefix[] = L"/mnt/wsl/";
+    DWORD n = 0;
+    for (; *text && n < max; text = skipLineBreaks(findLineEnd(text))) {
+        WCHAR field[4][64];
+        PCWCH p = text;
+        for (DWORD f = 0; f < 4; f++)
+            p = nextField(p, field[f], ARRAYSIZE(field[f]));
+        // capacity, then mount point
+        p = nextField(p, field[0], ARRAYSIZE(field[0]));
+        p = nextField(p, field[0], ARRAYSIZE(field[0]));
+
+        DWORD k = 0;
+        while (prefix[k] && prefix[k] == field[0][k])
+            k++;
+        if (prefix[k] || !field[0][k])
+            continue; // header or something not ours
+
+        fs_usage* u = &usage[n];
+        ULONGLONG blocks, used, avail;
+        if (!parseDecimal(field[1], &blocks) || !parseDecimal(field[2], &used) ||
+            !parseDecimal(field[3], &avail))
+            continue;
+        DWORD c = 0;
+        for (; field[0][k + c] && c + 1 < MAX_DRIVE_PATH; c++)
+            u->name[c] = field[0][k + c];
+        u->name[c] = 0;
+        u->size = blocks << 10;
+        u->used = used << 10;
+        u->avail = avail << 10;
+        n++;
+    }
+    return n;
+}
+
+static PWCHAR putNumber(PWCHAR p, PWCHAR end, ULONGLONG v)
+{
+    WCHAR digits[24];
+    int n = 0;
+    do {
+        digits[n++] = (WCHAR)(L'0' + v % 10);
+        v /= 10;
+    } while (v);
+
+    while (n && p < end)
+        *p++ = digits[--n];
+    return p;
+}
+
+static PWCHAR putText(PWCHAR p, PWCHAR end, PCWCH s)
+{
+    while (*s && p < end)
+        *p++ = *s++;
+    return p;
+}
+
+void formatSize(ULONGLONG size, PWCHAR text, DWORD cch)
+{
+    if (!cch)
+        return;
+
+    const WCHAR* suffix = L"MB";
+    ULONGLONG hi = size >> 10;
+    if (hi > (1000 << 10)) {
+        suffix = L"GB";
+        hi >>= 10;
+    }
+    DWORD lo = hi % 1000;
+    hi /= 1000;
+
+    PWCHAR p = text;
+    PWCHAR end = text + cch - 1;
+    p = putNumber(p, end, hi);
+    if (hi < 10 && lo > 100) {
+        p = putText(p, end, L".");
+        p = putNumber(p, end, lo / 10);
+    }
+    p = putText(p, end, suffix);
+    *p = 0;
+}
+
+ULONGLONG hashBytes(ULONGLONG h, const void* data, DWORD n)
+{
+    // FNV-1a, 64 bit
+    const BYTE* p = data;
+    for (DWORD i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static ULONG le32(const BYTE* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((ULONG)p[3] << 24);
+}
+
+static BOOL hasBootSignature(const BYTE* sector)
+{
+    return sector[510] == 0x55 && sector[511] == 0xAA;
+}
+
+static BOOL isGptHeader(const BYTE* p)
+{
+    static const char sig[] = "EFI PART";
+    for (DWORD i = 0; i < 8; i++)
+        if (p[i] != (BYTE)sig[i])
+            return FALSE;
+    return TRUE;
+}
+
+static BOOL isExtended(BYTE type)
+{
+    return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+// MBR which only reserves the disk for GPT
+static BOOL isProtective(const BYTE* mbr)
+{
+    BOOL protective = FALSE;
+    for (DWORD i = 0; i < 4; i++)
+        protective |= mbr[446 + i * 16 + 4] == 0xEE;
+    return protective;
+}
+
+// Read sector of MBR chain, sector is at most TABLE_BLOCK
+static const BYTE* readSector(read_fn read, void* ctx, DWORD sector, BYTE* block, ULONGLONG lba)
+{
+    const ULONGLONG offset = lba * sector;
+    const ULONGLONG base = offset & ~(ULONGLONG)(TABLE_BLOCK - 1);
+    if (!read(ctx, base, block, TABLE_BLOCK))
+        return NULL;
+    return block + (offset - base);
+}
+
+// Logical partitions form a list of EBRs, each one links the next
+static ULONGLONG hashEbrChain(read_fn read, void* ctx, DWORD sector, BYTE* block, ULONG start, ULONGLONG h)
+{
+    ULONG next = start;
+    for (DWORD hops = 0; hops < MAX_PARTS * 8; hops++) {
+        const BYTE* ebr = readSector(read, ctx, sector, block, next);
+        if (!ebr || !hasBootSignature(ebr))
+            break;
+        // first entry is the partition, second one is link to the next EBR
+        h = hashBytes(h, ebr + 446, 32);
+        const BYTE* link = ebr + 446 + 16;
+        const ULONG rel = le32(link + 8);
+        if (!isExtended(link[4]) || !rel)
+            break;
+        next = start + rel;
+    }
+    return h;
+}
+
+ULONGLONG tableFingerprint(read_fn read, void* ctx, DWORD sector, BYTE* block)
+{
+    if (!read(ctx, 0, block, TABLE_BLOCK) || !hasBootSignature(block))
+        return 0;
+
+    ULONGLONG h = 14695981039346656037ull;
+    if (isProtective(block)) {
+        // header is in LBA 1, which is at 512 or 4096 depending on sector size
+        const BYTE* hdr = block + 512;
+        if (!isGptHeader(hdr)) {
+            if (!read(ctx, 4096, block, TABLE_BLOCK) || !isGptHeader(block))
+                return 0;
+            hdr = block;
+        }
+        // CRC of header, and CRC of partition entries it keeps itself
+        h = hashBytes(h, hdr + 16, 4);
+        h = hashBytes(h, hdr + 88, 4);
+        return h | 1;
+    }
+
+    // disk signature and the primary table
+    h = hashBytes(h, block + 440, 4);
+    h = hashBytes(h, block + 446, 64);
+    ULONG ext[4];
+    DWORD n_ext = 0;
+    for (DWORD i = 0; i < 4; i++) {
+        const BYTE* e = block + 446 + i * 16;
+        if (isExtended(e[4]))
+            ext[n_ext++] = le32(e + 8);
+    }
+    // block is reused for reading EBRs
+    for (DWORD i = 0; i < n_ext; i++)
+        h = hashEbrChain(read, ctx, sector, block, ext[i], h);
+    return h | 1;
+}
+
+static ULONG be32(const BYTE* p)
+{
+    return ((ULONG)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static ULONGLONG be64(const BYTE* p)
+{
+    return ((ULONGLONG)be32(p) << 32) | be32(p + 4);
+}
+
+static ULONGLONG le64(const BYTE* p)
+{
+    return ((ULONGLONG)le32(p + 4) << 32) | le32(p);
+}
+
+static WORD le16(const BYTE* p)
+{
+    return (WORD)(p[0] | (p[1] << 8));
+}
+
+static BOOL hasSignature(const BYTE* p, const char* sig)
+{
+    for (; *sig; ++sig, ++p)
+        if (*p != (BYTE)*sig)
+            return FALSE;
+    return TRUE;
+}
+
+static BOOL sameGuid(const BYTE* a, const BYTE* b)
+{
+    for (DWORD i = 0; i < 16; i++)
+        if (a[i] != b[i])
+            return FALSE;
+    return TRUE;
+}
+
+static void zeroBytes(BYTE* p, DWORD n)
+{
+    for (DWORD i = 0; i < n; i++)
+        p[i] = 0;
+}
+
+// VHD footer, big endian: cookie, features, version, data offset (16),
+// timestamp, creator, original size, current size (48), geometry,
+// disk type (60), checksum (64), id, saved state
+#define VHD_FOOTER 512
+// Dynamic disk header: cookie, data offset, table offset (16), version,
+// max table entries (28), block size (32), checksum (36), parent...
+#define VHD_HEADER 1024
+
+enum { VHD_FIXED = 2, VHD_DYNAMIC = 3, VHD_DIFFERENCING = 4 };
+
+static BOOL vhdChecksum(const BYTE* p, DWORD n, DWORD at)
+{
+    // one's complement of byte sum, checksum field itself is skipped
+    ULONG sum = 0;
+    for (DWORD i = 0; i < n; i++)
+        if (i < at || i >= at + 4)
+            sum += p[i];
+    return ~sum == be32(p + at);
+}
+
+static PCWCH openVhd(image_reader* r, const BYTE* footer)
+{
+    image_map* m = &r->map;
+    if (!vhdChecksum(footer, VHD_FOOTER, 64))
+        return L"VHD footer is corrupted";
+
+    m->size = be64(footer + 48);
+    switch (be32(footer + 60)) {
+    case VHD_FIXED:
+        m->format = IMAGE_VHD_FIXED;
+        return m->size <= r->file_size - VHD_FOOTER ? NULL : L"VHD file is truncated";
+    case VHD_DYNAMIC:
+        break;
+    case VHD_DIFFERENCING:
+        return L"Differencing images are not supported";
+    default:
+        return L"Unknown VHD disk type";
+    }
+
+    BYTE hdr[VHD_HEADER];
+    if (!r->read(r->ctx, be64(footer + 16), hdr, sizeof(hdr)) ||
+        !hasSignature(hdr, "cxsparse") || !vhdChecksum(hdr, sizeof(hdr), 36))
+        return L"VHD dynamic disk header is corrupted";
+
+    m->format = IMAGE_VHD_DYNAMIC;
+    m->bat = be64(hdr + 16);
+    m->n_blocks = be32(hdr + 28);
+    m->block = be32(hdr + 32);
+    // every block starts with bitmap of its sectors, padded to a sector
+    m->bitmap = (m->block / 512 / 8 + 511) & ~511u;
+    if (!m->block || m->block % 512 || (ULONGLONG)m->n_blocks * m->block < m->size)
+        return L"VHD block table is corrupted";
+    return NULL;
+}
+
+// VHDX structures are little endian and protected by CRC-32C
+#define VHDX_ALIGN 65536
+#define VHDX_HEADER 4096
+#define VHDX_MAX_ENTRIES 2047
+
+// GUIDs are stored as Data1, Data2, Data3 little endian, then Data4 bytes
+static const BYTE VHDX_BAT[16] = { // 2DC27766-F623-4200-9D64-115E9BFD4A08
+    0x66, 0x77, 0xC2, 0x2D, 0x23, 0xF6, 0x00, 0x42, 0x9D, 0x64, 0x11, 0x5E, 0x9B, 0xFD, 0x4A, 0x08 };
+static const BYTE VHDX_METADATA[16] = { // 8B7CA206-4790-4B9A-B8FE-575F050F886E
+    0x06, 0xA2, 0x7C, 0x8B, 0x90, 0x47, 0x9A, 0x4B, 0xB8, 0xFE, 0x57, 0x5F, 0x05, 0x0F, 0x88, 0x6E };
+static const BYTE VHDX_FILE_PARAMETERS[16] = { // CAA16737-FA36-4D43-B3B6-33F0AA44E76B
+    0x37, 0x67, 0xA1, 0xCA, 0x36, 0xFA, 0x43, 0x4D, 0xB3, 0xB6, 0x33, 0xF0, 0xAA, 0x44, 0xE7, 0x6B };
+static const BYTE VHDX_DISK_SIZE[16] = { // 2FA54224-CD1B-4876-B211-5DBED83BF4B8
+    0x24, 0x42, 0xA5, 0x2F, 0x1B, 0xCD, 0x76, 0x48, 0xB2, 0x11, 0x5D, 0xBE, 0xD8, 0x3B, 0xF4, 0xB8 };
+static const BYTE VHDX_SECTOR_SIZE[16] = { // 8141BF1D-A96F-4709-BA47-F233A8FAAB5F
+    0x1D, 0xBF, 0x41, 0x81, 0x6F, 0xA9, 0x09, 0x47, 0xBA, 0x47, 0xF2, 0x33, 0xA8, 0xFA, 0xAB, 0x5F };
+
+enum {
+    VHDX_BLOCK_FULLY_PRESENT = 6,
+    VHDX_BLOCK_PARTIALLY_PRESENT = 7, // differencing images only
+};
+
+static ULONG crc32c(ULONG crc, const BYTE* p, DWORD n)
+{
+    for (DWORD i = 0; i < n; i++) {
+        crc ^= p[i];
+        for (DWORD k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+    }
+    return crc;
+}
+
+// CRC of a structure in the file, stored at its offset 4 and counted as zeros
+static BOOL vhdxChecksum(const image_reader* r, ULONGLONG offset, DWORD size)
+{
+    BYTE buf[512];
+    ULONG crc = ~0u;
+    ULONG stored = 0;
+    for (DWORD done = 0; done < size; done += sizeof(buf)) {
+        if (!r->read(r->ctx, offset + done, buf, sizeof(buf)))
+            return FALSE;
+        if (!done) {
+            stored = le32(buf + 4);
+            zeroBytes(buf + 4, 4);
+        }
+        crc = crc32c(crc, buf, sizeof(buf));
+    }
+    return ~crc == stored;
+}
+
+// Two headers follow file identifier, the one with larger sequence number is current
+static PCWCH checkVhdxHeader(const image_reader* r)
+{
+    BYTE hdr[80];
+    ULONGLONG seq = 0;
+    BOOL found = FALSE;
+    for (DWORD i = 1; i <= 2; i++) {
+        BYTE h[sizeof(hdr)];
+        const ULONGLONG at = i * (ULONGLONG)VHDX_ALIGN;
+        if (!r->read(r->ctx, at, h, sizeof(h)) || !hasSignature(h, "head") ||
+            !vhdxChecksum(r, at, VHDX_HEADER))
+            continue;
+        if (found && le64(h + 8) <= seq)
+            continue;
+        found = TRUE;
+        seq = le64(h + 8);
+        for (DWORD k = 0; k < sizeof(hdr); k++)
+            hdr[k] = h[k];
+    }
+    if (!found)
+        return L"VHDX header is corrupted";
+    if (le16(hdr + 66) != 1)
+        return L"Unsupported VHDX version";
+    // log GUID is set until the log is replayed, data may be stale until then
+    for (DWORD k = 48; k < 64; k++)
+        if (hdr[k])
+            return L"VHDX log was not replayed, attach the image once";
+    return NULL;
+}
+
+static PCWCH readVhdxMetadata(image_reader* r, ULONGLONG meta)
+{
+    image_map* m = &r->map;
+    BYTE hdr[32];
+    if (!r->read(r->ctx, meta, hdr, sizeof(hdr)) || !hasSignature(hdr, "metadata") ||
+        le16(hdr + 10) > VHDX_MAX_ENTRIES)
+        return L"VHDX metadata is corrupted";
+
+    // other items, e.g. physical sector size, don't matter for reading
+    DWORD found = 0;
+    BOOL parent = FALSE;
+    for (DWORD i = 0; i < le16(hdr + 10); i++) {
+        BYTE e[32];
+        BYTE v[8];
+        if (!r->read(r->ctx, meta + 32 + i * 32, e, sizeof(e)))
+            return L"VHDX metadata is corrupted";
+        const ULONGLONG at = meta + le32(e + 16);
+        const ULONG len = le32(e + 20);
+        if (!sameGuid(e, VHDX_FILE_PARAMETERS) && !sameGuid(e, VHDX_DISK_SIZE) &&
+            !sameGuid(e, VHDX_SECTOR_SIZE))
+            continue;
+        if (len < 4 || !r->read(r->ctx, at, v, min(len, sizeof(v))))
+            return L"VHDX metadata is corrupted";
+
+        if (sameGuid(e, VHDX_FILE_PARAMETERS) && len >= 8) {
+            m->block = le32(v);
+            parent = (le32(v + 4) & 2) != 0; // HasParent
+            found |= 1;
+        }
+        else if (sameGuid(e, VHDX_DISK_SIZE) && len >= 8) {
+            m->size = le64(v);
+            found |= 2;
+        }
+        else if (sameGuid(e, VHDX_SECTOR_SIZE)) {
+            m->sector = le32(v);
+            found |= 4;
+        }
+    }
+    if (parent)
+        return L"Differencing images are not supported";
+    if (found != 7)
+        return L"VHDX metadata is incomplete";
+
+    // block is a power of two between 1MB and 256MB
+    if (m->block < (1u << 20) || m->block > (1u << 28) || (m->block & (m->block - 1)) ||
+        (m->sector != 512 && m->sector != 4096))
+        return L"VHDX metadata is corrupted";
+    return NULL;
+}
+
+static PCWCH openVhdx(image_reader* r)
+{
+    image_map* m = &r->map;
+    PCWCH why = checkVhdxHeader(r);
+    if (why)
+        return why;
+
+    // region table and its copy
+    ULONGLONG regions = 3 * (ULONGLONG)VHDX_ALIGN;
+    if (!vhdxChecksum(r, regions, VHDX_ALIGN)) {
+        regions += VHDX_ALIGN;
+        if (!vhdxChecksum(r, regions, VHDX_ALIGN))
+            return L"VHDX region table is corrupted";
+    }
+    BYTE hdr[16];
+    if (!r->read(r->ctx, regions, hdr, sizeof(hdr)) || !hasSignature(hdr, "regi") ||
+        le32(hdr + 8) > VHDX_MAX_ENTRIES)
+        return L"VHDX region table is corrupted";
+
+    ULONGLONG meta = 0;
+    ULONG bat_len = 0;
+    for (DWORD i = 0; i < le32(hdr + 8); i++) {
+        BYTE e[32];
+        if (!r->read(r->ctx, regions + 16 + i * 32, e, sizeof(e)))
+            return L"VHDX region table is corrupted";
+        if (sameGuid(e, VHDX_BAT)) {
+            m->bat = le64(e + 16);
+            bat_len = le32(e + 24);
+        }
+        else if (sameGuid(e, VHDX_METADATA))
+            meta = le64(e + 16);
+        else if (le32(e + 28) & 1)
+            return L"Unsupported VHDX region";
+    }
+    if (!m->bat || !meta)
+        return L"VHDX region table is corrupted";
+
+    why = readVhdxMetadata(r, meta);
+    if (why)
+        return why;
+
+    // BAT interleaves payload blocks with a sector bitmap entry per chunk
+    m->format = IMAGE_VHDX;
+    m->chunk = (DWORD)(((ULONGLONG)m->sector << 23) / m->block);
+    const ULONGLONG blocks = (m->size + m->block - 1) / m->block;
+    if (!blocks || blocks > MAXDWORD)
+        return L"VHDX metadata is corrupted";
+    m->n_blocks = (DWORD)blocks;
+    if ((blocks + (blocks - 1) / m->chunk) * 8 > bat_len)
+        return L"VHDX block table is corrupted";
+    return NULL;
+}
+
+PCWCH openImage(image_reader* r)
+{
+    image_map* m = &r->map;
+    zeroBytes((BYTE*)m, sizeof(*m));
+    m->format = IMAGE_RAW;
+    m->size = r->file_size;
+    m->sector = 512;
+
+    BYTE sig[8];
+    if (r->file_size >= 5 * (ULONGLONG)VHDX_ALIGN && r->read(r->ctx, 0, sig, sizeof(sig)) &&
+        hasSignature(sig, "vhdxfile"))
+        return openVhdx(r);
+
+    BYTE footer[VHD_FOOTER];
+    if (r->file_size >= VHD_FOOTER &&
+        r->read(r->ctx, r->file_size - VHD_FOOTER, footer, sizeof(footer)) &&
+        hasSignature(footer, "conectix"))
+        return openVhd(r, footer);
+
+    // anything else is taken for a raw disk
+    return NULL;
+}
+
+// File offset of payload block, 0 if it was never written
+static BOOL findBlock(const image_reader* r, DWORD b, ULONGLONG* at)
+{
+    const image_map* m = &r->map;
+    BYTE e[8];
+    *at = 0;
+    if (m->format == IMAGE_VHD_DYNAMIC) {
+        if (!r->read(r->ctx, m->bat + b * 4ull, e, 4))
+            return FALSE;
+        // sector of the block bitmap, data follows it
+        if (be32(e) != MAXDWORD)
+            *at = be32(e) * 512ull;
+        return TRUE;
+    }
+
+    if (!r->read(r->ctx, m->bat + (b + (ULONGLONG)(b / m->chunk)) * 8, e, 8))
+        return FALSE;
+    // state in low 3 bits, offset in megabytes in high 44 bits
+    const DWORD state = e[0] & 7;
+    if (state == VHDX_BLOCK_FULLY_PRESENT || state == VHDX_BLOCK_PARTIALLY_PRESENT)
+        *at = le64(e) >> 20 << 20;
+    return TRUE;
+}
+
+// Dynamic VHD keeps a bit per sector, sectors which were never written read as zeros
+static BOOL readVhdSectors(const image_reader* r, ULONGLONG at, DWORD skip, BYTE* out, DWORD n)
+{
+    while (n) {
+        const DWORD sector = skip / 512;
+        const DWORD len = min(n, 512 - skip % 512);
+        BYTE bits;
+        if (!r->read(r->ctx, at + sector / 8, &bits, 1))
+            return FALSE;
+        if (bits & (0x80 >> (sector % 8))) {
+            if (!r->read(r->ctx, at + r->map.bitmap + skip, out, len))
+                return FALSE;
+        }
+        else
+            zeroBytes(out, len);
+        skip += len;
+        out += len;
+        n -= len;
+    }
+    return TRUE;
+}
+
+BOOL readImage(void* ctx, ULONGLONG offset, void* buf, DWORD size)
+{
+    const image_reader* r = ctx;
+    const image_map* m = &r->map;
+    if (offset > m->size || size > m->size - offset)
+        return FALSE;
+    if (m->format == IMAGE_RAW || m->format == IMAGE_VHD_FIXED)
+        return r->read(r->ctx, offset, buf, size);
+
+    BYTE* out = buf;
+    while (size) {
+        const DWORD b = (DWORD)(offset / m->block);
+        const DWORD skip = (DWORD)(offset % m->block);
+        const DWORD n = min(size, m->block - skip);
+        ULONGLONG at;
+        if (b >= m->n_blocks || !findBlock(r, b, &at))
+            return FALSE;
+
+        if (!at)
+            zeroBytes(out, n);
+        else if (m->format == IMAGE_VHD_DYNAMIC) {
+            if (!readVhdSectors(r, at, skip, out, n))
+                return FALSE;
+        }
+        else if (!r->read(r->ctx, at + skip, out, n))
+            return FALSE;
+
+        out += n;
+        offset += n;
+        size -= n;
+    }
+    return TRUE;
+}
+
+ULONGLONG imageAllocated(const image_reader* r, DWORD* blocks)
+{
+    const image_map* m = &r->map;
+    if (m->format == IMAGE_RAW || m->format == IMAGE_VHD_FIXED) {
+        *blocks = 0;
+        return m->size;
+    }
+
+    ULONGLONG allocated = 0;
+    *blocks = 0;
+    for (DWORD b = 0; b < m->n_blocks; b++) {
+        ULONGLONG at;
+        if (!findBlock(r, b, &at))
+            break;
+        if (at) {
+            allocated += m->block;
+            ++*blocks;
+        }
+    }
+    return allocated;
+}
+
+static void setPart(part_info* part, DWORD index, ULONGLONG size, PCWCH type)
+{
+    part->index = index;
+    part->size = size;
+    part->letter = 0;
+    DWORD i = 0;
+    for (; type[i] && i + 1 < MAX_PART_TYPE; i++)
+        part->type[i] = type[i];
+    part->type[i] = 0;
+}
+
+// Names close to what Windows reports for attached disks, rules match them
+static PCWCH mbrType(BYTE type)
+{
+    switch (type) {
+    case 0x01:
+    case 0x04:
+    case 0x06:
+    case 0x0B:
+    case 0x0C:
+    case 0x0E:
+        return L"FAT";
+    case 0x07:
+        return L"Installable File System";
+    case 0x82:
+        return L"Linux Swap";
+    case 0x83:
+        return L"Linux Native";
+    case 0x8E:
+        return L"Linux LVM";
+    case 0xEF:
+        return L"EFI System";
+    default:
+        return L"Unknown";
+    }
+}
+
+static PCWCH gptType(const BYTE* guid)
+{
+    static const struct {
+        BYTE guid[16];
+        PCWCH name;
+    } types[] = {
+        // C12A7328-F81F-11D2-BA4B-00A0C93EC93B
+        { { 0x28, 0x73, 0x2A, 0xC1, 0x1F, 0xF8, 0xD2, 0x11, 0xBA, 0x4B, 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B },
+            L"GPT: System" },
+        // E3C9E316-0B5C-4DB8-817D-F92DF00215AE
+        { { 0x16, 0xE3, 0xC9, 0xE3, 0x5C, 0x0B, 0xB8, 0x4D, 0x81, 0x7D, 0xF9, 0x2D, 0xF0, 0x02, 0x15, 0xAE },
+            L"GPT: Reserved" },
+        // EBD0A0A2-B9E5-4433-87C0-68B6B72699C7
+        { { 0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44, 0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7 },
+            L"GPT: Basic Data" },
+        // 0FC63DAF-8483-4772-8E79-3D69D8477DE4
+        { { 0xAF, 0x3D, 0xC6, 0x0F, 0x83, 0x84, 0x72, 0x47, 0x8E, 0x79, 0x3D, 0x69, 0xD8, 0x47, 0x7D, 0xE4 },
+            L"GPT: Linux Filesystem" },
+        // 0657FD6D-A4AB-43C4-84E5-0933C84B4F4F
+        { { 0x6D, 0xFD, 0x57, 0x06, 0xAB, 0xA4, 0xC4, 0x43, 0x84, 0xE5, 0x09, 0x33, 0xC8, 0x4B, 0x4F, 0x4F },
+            L"GPT: Linux Swap" },
+        // E6D6D379-F507-44C2-A23C-238F2A3DF928
+        { { 0x79, 0xD3, 0xD6, 0xE6, 0x07, 0xF5, 0xC2, 0x44, 0xA2, 0x3C, 0x23, 0x8F, 0x2A, 0x3D, 0xF9, 0x28 },
+            L"GPT: Linux LVM" },
+    };
+    for (DWORD i = 0; i < ARRAYSIZE(types); i++)
+        if (sameGuid(guid, types[i].guid))
+            return types[i].name;
+    return L"GPT: Unknown";
+}
+
+static DWORD parseGpt(read_fn read, void* ctx, BYTE* block, part_info* part, DWORD max)
+{
+    // header is in LBA 1, which is at 512 or 4096 depending on sector size
+    ULONG sector = 512;
+    const BYTE* hdr = block + 512;
+    if (!isGptHeader(hdr)) {
+        if (!read(ctx, 4096, block, TABLE_BLOCK) || !isGptHeader(block))
+            return 0;
+        hdr = block;
+        sector = 4096;
+    }
+    const ULONGLONG first = le64(hdr + 72) * sector;
+    const ULONG count = le32(hdr + 80);
+    const ULONG size = le32(hdr + 84);
+    if (size < 128 || size > TABLE_BLOCK || TABLE_BLOCK % size || count > 1024)
+        return 0;
+
+    // block is reused for entries, number of partition is its entry number
+    DWORD n = 0;
+    ULONGLONG loaded = ~0ull;
+    for (ULONG i = 0; i < count && n < max; i++) {
+        const ULONGLONG at = first + (ULONGLONG)i * size;
+        const ULONGLONG base = at & ~(ULONGLONG)(TABLE_BLOCK - 1);
+        if (base != loaded) {
+            if (!read(ctx, base, block, TABLE_BLOCK))
+                break;
+            loaded = base;
+        }
+        static const BYTE unused[16] = { 0 };
+        const BYTE* e = block + (at - base);
+        if (sameGuid(e, unused))
+            continue;
+        const ULONGLONG lo = le64(e + 32);
+        const ULONGLONG hi = le64(e + 40);
+        setPart(&part[n++], i, hi >= lo ? (hi - lo + 1) * sector : 0, gptType(e));
+    }
+    return n;
+}
+
+// Logical partitions are numbered from 5 in chain order, same as Linux does
+static DWORD parseEbrChain(read_fn read, void* ctx, DWORD sector, BYTE* block, ULONG start,
+    DWORD* number, part_info* part, DWORD n, DWORD max)
+{
+    ULONG next = start;
+    for (DWORD hops = 0; hops < MAX_PARTS * 8 && n < max; hops++) {
+        const BYTE* ebr = readSector(read, ctx, sector, block, next);
+        if (!ebr || !hasBootSignature(ebr))
+            break;
+        const BYTE* e = ebr + 446;
+        if (e[4] && !isExtended(e[4]))
+            setPart(&part[n++], 4 + (*number)++, (ULONGLONG)le32(e + 12) * sector, mbrType(e[4]));
+        const BYTE* link = e + 16;
+        const ULONG rel = le32(link + 8);
+        if (!isExtended(link[4]) || !rel)
+            break;
+        next = start + rel;
+    }
+    return n;
+}
+
+static DWORD parseMbr(read_fn read, void* ctx, DWORD sector, BYTE* block, part_info* part, DWORD max)
+{
+    // boot sector of a bare filesystem has code where the table would be
+    BYTE table[64];
+    for (DWORD i = 0; i < sizeof(table); i++)
+        table[i] = block[446 + i];
+    for (DWORD i = 0; i < 4; i++)
+        if (table[i * 16] & 0x7F)
+            return 0;
+
+    DWORD n = 0;
+    for (DWORD i = 0; i < 4 && n < max; i++) {
+        const BYTE* e = table + i * 16;
+        if (e[4] && !isExtended(e[4]))
+            setPart(&part[n++], i, (ULONGLONG)le32(e + 12) * sector, mbrType(e[4]));
+    }
+    // block is reused for reading EBRs
+    DWORD number = 0;
+    for (DWORD i = 0; i < 4; i++) {
+        const BYTE* e = table + i * 16;
+        if (isExtended(e[4]))
+            n = parseEbrChain(read, ctx, sector, block, le32(e + 8), &number, part, n, max);
+    }
+    return n;
+}
+
+DWORD parseTable(read_fn read, void* ctx, DWORD sector, BYTE* block, part_info* part, DWORD max)
+{
+    if (!read(ctx, 0, block, TABLE_BLOCK) || !hasBootSignature(block))
+        return 0;
+    // GPT header tells its sector size by where it is
+    if (isProtective(block))
+        return parseGpt(read, ctx, block, part, max);
+    return parseMbr(read, ctx, sector, block, part, max);
+}
+
+// Position right after key in s, NULL if there is no key
+static PCWCH findAfter(PCWCH s, PCWCH key)
+{
+    for (; *s; ++s) {
+        DWORD i = 0;
+        while (key[i] && s[i] == key[i])
+            i++;
+        if (!key[i])
+            return s + i;
+    }
+    return NULL;
+}
+
+static PCWCH parseNumber(PCWCH s, DWORD* v)
+{
+    if (!s || *s < L'0' || *s > L'9')
+        return NULL;
+    *v = 0;
+    for (; *s >= L'0' && *s <= L'9'; ++s)
+        *v = *v * 10 + (*s - L'0');
+    return s;
+}
+
+BOOL parseLetterLink(PCWCH partition, PCWCH logical, part_letter* link)
+{
+    // Win32_DiskPartition.DeviceID="Disk #1, Partition #0"
+    // Win32_LogicalDisk.DeviceID="E:"
+    PCWCH s = parseNumber(findAfter(partition, L"Disk #"), &link->disk);
+    s = s ? parseNumber(findAfter(s, L", Partition #"), &link->part) : NULL;
+    PCWCH id = findAfter(logical, L"DeviceID=\"");
+    if (!s || !id || !id[0] || id[1] != L':')
+        return FALSE;
+    link->letter = id[0];
+    return TRUE;
+}
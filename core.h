@@ -0,0 +1,187 @@
+#pragma once
+
+// Types and parsers shared by the tray and core.c/text.c. Only this header
+// is needed to build those two files, on Windows or anywhere else, e.g.
+// gcc -fshort-wchar -c core.c text.c for a benchmark on another OS.
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+
+// Subset of Windows types used here. WCHAR is UTF-16 like on Windows,
+// so L"" literals need 16-bit wchar_t.
+typedef int32_t BOOL;
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint16_t WCHAR;
+typedef uint32_t DWORD;
+typedef uint32_t ULONG;
+typedef uint64_t ULONGLONG;
+typedef uintptr_t ULONG_PTR;
+typedef WCHAR* PWCHAR;
+typedef const WCHAR* PCWCH;
+
+#define TRUE 1
+#define FALSE 0
+#define MAX_PATH 260
+#define MAXDWORD 0xffffffff
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define IS_HIGH_SURROGATE(c) ((c) >= 0xD800 && (c) <= 0xDBFF)
+#define IS_LOW_SURROGATE(c) ((c) >= 0xDC00 && (c) <= 0xDFFF)
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#define __inline inline
+#endif
+
+// Dynamic allocations are good if we need lots of memory.
+// But this a simple program. It has simple needs.
+#define MAX_DISKS 32
+#define MAX_PARTS 16
+#define MAX_PART_TYPE 64
+#define MAX_DRIVE_PATH 24
+#define MAX_RULES 256
+#define MAX_USAGE 32
+#define MAX_LETTERS 26
+
+// Container for readable error message with a title
+typedef struct err_desc {
+    PCWCH title;
+    PWCHAR text;
+    DWORD error; // windows error code
+} err_desc;
+
+#define ERRINIT() { .text = L"" }
+
+typedef struct part_info {
+    DWORD index;
+    ULONGLONG size;
+    WCHAR letter;
+    WCHAR type[MAX_PART_TYPE];
+} part_info;
+
+typedef struct disk_info {
+    err_desc e[1];
+    DWORD index;
+    PWCHAR model;
+    PWCHAR serial;
+    ULONGLONG size;
+    WCHAR path[MAX_DRIVE_PATH]; // mount point name for image files
+    WCHAR image[MAX_PATH]; // image file, empty for physical disk
+    BOOL no_attach; // raw image, wsl.exe attaches only VHD and VHDX
+    BOOL removable; // USB or external media, loaded first
+    BOOL loading; // listed, but partitions are not yet
+    ULONGLONG fingerprint; // of partition table, 0 if unknown
+    DWORD n_parts;
+    err_desc e_parts[1];
+    part_info part[MAX_PARTS];
+} disk_info;
+
+// Drive letter of partition, from Win32_LogicalDiskToPartition
+typedef struct part_letter {
+    DWORD disk; // disk_info.index
+    DWORD part; // part_info.index
+    WCHAR letter;
+} part_letter;
+
+#define NO_LETTERS (~0u) // letters are unknown, keep what there is
+
+// Filesystem usage of a partition mounted under /mnt/wsl
+typedef struct fs_usage {
+    WCHAR name[MAX_DRIVE_PATH]; // mount point name, e.g. PHYSICALDRIVE2p1
+    ULONGLONG size; // bytes
+    ULONGLONG used;
+    ULONGLONG avail;
+} fs_usage;
+
+// Platform-neutral helpers, see core.c
+// Cut string at the first line break
+void trimToLine(PWCHAR s);
+// Drop the line output of n characters was cut in the middle of,
+// everything after its last line break
+void trimPartialLine(PWCHAR s, DWORD n);
+// Parse unsigned decimal, returns 0 if there is anything but digits
+ULONGLONG wtou64(const WCHAR* s);
+// Sort disks by index
+void sortDisks(disk_info* disk, DWORD n);
+// Order in which partitions of listed disks are loaded: disks not in known
+// ids go first, then removable ones, the rest keeps list order.
+// Returns number of disks which are worth hurrying up.
+DWORD loadOrder(const disk_info* disk, const ULONG* ids, DWORD n,
+    const ULONG* known, DWORD n_known, DWORD* order);
+// FNV-1a of bytes, continues from h
+ULONGLONG hashBytes(ULONGLONG h, const void* data, DWORD n);
+// Reads size bytes at offset, both multiple of TABLE_BLOCK
+typedef BOOL (*read_fn)(void* ctx, ULONGLONG offset, void* buf, DWORD size);
+#define TABLE_BLOCK 4096
+// Fingerprint of partition table on raw disk or image: CRCs from GPT header,
+// or hash of MBR and its extended boot records. block is TABLE_BLOCK bytes,
+// sector is logical sector size MBR addresses count in, 512 or 4096.
+// Returns 0 if there is no partition table.
+ULONGLONG tableFingerprint(read_fn read, void* ctx, DWORD sector, BYTE* block);
+// List partitions of MBR or GPT, part->index is partition number - 1.
+// block and sector as for tableFingerprint. Returns number of partitions stored.
+DWORD parseTable(read_fn read, void* ctx, DWORD sector, BYTE* block, part_info* part, DWORD max);
+
+typedef enum image_format {
+    IMAGE_RAW,
+    IMAGE_VHD_FIXED,
+    IMAGE_VHD_DYNAMIC,
+    IMAGE_VHDX,
+} image_format;
+
+// Where virtual disk blocks are in an image file
+typedef struct image_map {
+    image_format format;
+    ULONGLONG size; // of virtual disk
+    ULONGLONG bat; // file offset of block allocation table
+    DWORD block; // bytes per block, 0 for flat images
+    DWORD n_blocks;
+    DWORD bitmap; // dynamic VHD: sector bitmap in front of every block
+    DWORD chunk; // VHDX: blocks per sector bitmap entry in BAT
+    DWORD sector; // logical sector size
+} image_map;
+
+// Image file, read gets any offset and size within file_size
+typedef struct image_reader {
+    read_fn read;
+    void* ctx;
+    ULONGLONG file_size;
+    image_map map;
+} image_reader;
+
+// Recognize VHDX, VHD or raw image by its headers and fill r->map.
+// Returns NULL, or why the image can't be read.
+PCWCH openImage(image_reader* r);
+// read_fn over virtual disk of image_reader,
+// blocks which were never written read as zeros
+BOOL readImage(void* ctx, ULONGLONG offset, void* buf, DWORD size);
+// Bytes in allocated blocks, walks the whole block table
+ULONGLONG imageAllocated(const image_reader* r, DWORD* blocks);
+// Parse Antecedent and Dependent of Win32_LogicalDiskToPartition
+BOOL parseLetterLink(PCWCH partition, PCWCH logical, part_letter* link);
+// Find default distribution in output of wsl --list -v
+BOOL parseDistroList(const WCHAR* text, PWCHAR dist, DWORD cch);
+// Parse output of df -kP, keeps only filesystems mounted under /mnt/wsl.
+// Returns number of entries stored.
+DWORD parseUsage(const WCHAR* text, fs_usage* usage, DWORD max);
+// Human readable size like "931GB" or "1.50MB"
+void formatSize(ULONGLONG size, PWCHAR text, DWORD cch);
+
+// Text kernels, see text.c
+// Find terminating zero, \r or \n
+PCWCH findLineEnd(PCWCH s);
+// Find terminating zero, tab, space or \n
+PCWCH findFieldEnd(PCWCH s);
+PCWCH skipLineBreaks(PCWCH s);
+// Transcoders return number of units written, output is not terminated.
+// Invalid input is replaced with U+FFFD, conversion stops when dst is full.
+DWORD utf16ToUtf8(PCWCH src, DWORD n, char* dst, DWORD cap);
+DWORD utf8ToUtf16(const char* src, DWORD n, PWCHAR dst, DWORD cap);
+// Same as wtou64, but also tells if input was valid
+BOOL parseDecimal(PCWCH s, ULONGLONG* out);
+// Use scanning kernels up to level: 0 scalar, 1 SSE2, 2 AVX2, so checks
+// can compare them. Returns the highest level this CPU supports.
+DWORD limitTextKernels(DWORD level);
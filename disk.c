@@ -5,8 +5,6 @@
 #include <Shlwapi.h>
 #include <strsafe.h>
 
-static IWbemStatusCodeText* pCode;
-
 static void ignore(HRESULT hr) { UNREFERENCED_PARAMETER(hr); }
 
 static void* release(void* any)
@@ -31,16 +29,24 @@ static void resetPart(part_info* part)
     part->index = 0;
     part->size = 0;
     part->letter = 0;
+    part->type[0] = 0;
 }
 
 static void resetDisk(disk_info* disk)
 {
     disk->model = LocalFree(disk->model);
+    disk->serial = LocalFree(disk->serial);
+    disk->size = 0;
     while (disk->n_parts) {
         disk->n_parts--;
         resetPart(getPart(disk, disk->n_parts));
     }
     disk->n_parts = 0;
+    disk->image[0] = 0;
+    disk->no_attach = FALSE;
+    disk->removable = FALSE;
+    disk->loading = FALSE;
+    disk->fingerprint = 0;
     resetErr(disk->e);
     resetErr(disk->e_parts);
 }
@@ -54,6 +60,34 @@ void resetDisks(state* st)
     resetErr(st->e);
 }
 
+void adoptDisks(state* st, state* from)
+{
+    // strings change owner, nothing is left to free in from
+    *st->e = *from->e;
+    st->n_disks = from->n_disks;
+    for (DWORD i = 0; i < from->n_disks; i++)
+        *getDisk(st, i) = *getDisk(from, i);
+    from->n_disks = 0;
+    from->e->text = NULL;
+}
+
+void adoptParts(disk_info* disk, disk_info* from)
+{
+    resetErr(disk->e_parts);
+    *disk->e_parts = *from->e_parts;
+    from->e_parts->text = NULL;
+    disk->n_parts = from->n_parts;
+    for (DWORD j = 0; j < min(from->n_parts, MAX_PARTS); j++)
+        *getPart(disk, j) = *getPart(from, j);
+    // image headers are read along with partitions
+    if (from->image[0]) {
+        disk->size = from->size;
+        disk->no_attach = from->no_attach;
+        disk->fingerprint = from->fingerprint;
+    }
+    disk->loading = FALSE;
+}
+
 static DWORD returnErr(err_desc* e)
 {
     // Make sure e->text is set to something
@@ -66,13 +100,8 @@ static DWORD returnErr(err_desc* e)
 
     // Windows error messages can be too lengthy.
     // Leave only one line
-    for (PWCHAR p = e->text; ; ++p) {
-        switch (*p) {
-        case 0: case L'\r': case L'\n':
-            *p = 0;
-            return e->error;
-        }
-    }
+    trimToLine(e->text);
+    return e->error;
 }
 
 DWORD setErrorCode(err_desc* e, PCWCH title, DWORD code)
@@ -99,9 +128,10 @@ static HRESULT setHresult(err_desc* e, PCWCH title, HRESULT hr)
     e->error = hr;
 
     // https://learn.microsoft.com/en-us/windows/win32/com/error-handling-in-com
-    if (!pCode)
-        ignore(CoCreateInstance(&CLSID_WbemStatusCodeText, 0,
-            CLSCTX_INPROC_SERVER, &IID_IWbemStatusCodeText, (LPVOID*)&pCode));
+    // Created per call: errors come from any worker and are rare
+    IWbemStatusCodeText* pCode = NULL;
+    ignore(CoCreateInstance(&CLSID_WbemStatusCodeText, 0,
+        CLSCTX_INPROC_SERVER, &IID_IWbemStatusCodeText, (LPVOID*)&pCode));
 
     if (pCode) {
         BSTR text = NULL;
@@ -110,35 +140,39 @@ static HRESULT setHresult(err_desc* e, PCWCH title, HRESULT hr)
             e->text = StrDupW(text);
             SysFreeString(text);
         }
+        release(pCode);
     }
     return returnErr(e);
 }
 
-static ULONGLONG wtou64(const WCHAR *s)
-{
-    ULONGLONG r = 0;
-    for (;;) {
-        switch (*s) {
-        case 0:
-            return r;
-        case L'0': case L'1': case L'2': case L'3': case L'4':
-        case L'5': case L'6': case L'7': case L'8': case L'9':
-            r = r * 10 + (*s - L'0');
-            s++;
-            break;
-        default:
-            return 0;
-        }
-    }
-}
-
 typedef struct part_ctx {
     IWbemServices* pSvc;
+    ULONGLONG deadline; // GetTickCount64() time
     part_info* part;
     WCHAR query[128];
     WCHAR deviceId[128];
 } part_ctx;
 
+static LONG msLeft(ULONGLONG deadline)
+{
+    const ULONGLONG now = GetTickCount64();
+    return now < deadline ? (LONG)(deadline - now) : 0;
+}
+
+// Next object within deadline, in short waits: exit must not wait
+// for a sleeping disk. Returns E_ABORT once pool is stopping.
+static HRESULT nextObject(IEnumWbemClassObject* pEnum, ULONGLONG deadline, IWbemClassObject** pCls, ULONG* nr)
+{
+    for (;;) {
+        const LONG left = msLeft(deadline);
+        const HRESULT hr = pEnum->lpVtbl->Next(pEnum, min(left, (LONG)WMI_SLICE_MS), 1, pCls, nr);
+        if (hr != WBEM_S_TIMEDOUT || *nr || !left)
+            return hr;
+        if (poolStopping())
+            return E_ABORT;
+    }
+}
+
 static HRESULT getPartLetter(part_ctx* ctx)
 {
     part_info* part = ctx->part;
@@ -149,13 +183,15 @@ static HRESULT getPartLetter(part_ctx* ctx)
         L" WHERE AssocClass = Win32_LogicalDiskToPartition", ctx->deviceId);
 
     IEnumWbemClassObject* pEnum = NULL;
-    HRESULT hr = pSvc->lpVtbl->ExecQuery(pSvc, L"WQL", ctx->query, 0, NULL, &pEnum);
+    statAdd(STAT_QUERIES, 1);
+    HRESULT hr = pSvc->lpVtbl->ExecQuery(pSvc, L"WQL", ctx->query,
+        WBEM_FLAG_FORWARD_ONLY | WBEM_FLAG_RETURN_IMMEDIATELY, NULL, &pEnum);
     if (FAILED(hr))
         return hr;
 
     IWbemClassObject* pCls = NULL;
     ULONG nr = 0;
-    pEnum->lpVtbl->Next(pEnum, WBEM_INFINITE, 1, &pCls, &nr);
+    nextObject(pEnum, ctx->deadline, &pCls, &nr);
     if (nr) {
         VARIANT v[1];
         VariantInit(v);
@@ -187,26 +223,33 @@ static void initPart(part_ctx* ctx, IWbemClassObject* pCls)
     // for some reason uint64 value is returned as string
     GET(Size, part->size = wtou64(v->bstrVal));
     GET(DeviceID, StringCchCopyW(ctx->deviceId, ARRAYSIZE(ctx->deviceId), v->bstrVal));
+    GET(Type, if (v->vt == VT_BSTR) StringCchCopyW(part->type, ARRAYSIZE(part->type), v->bstrVal));
 #undef GET
 
+    TRACE_BEGIN("wmi.letter");
     getPartLetter(ctx);
+    TRACE_END("wmi.letter");
 }
 
-static HRESULT listParts(disk_info* disk, IWbemServices* pSvc)
+// Semisynchronous queries, so a sleeping disk can't hold
+// the caller longer than timeout_ms, nor exit longer than WMI_SLICE_MS
+static HRESULT listParts(disk_info* disk, IWbemServices* pSvc, DWORD timeout_ms)
 {
-    part_ctx ctx[1] = { {.pSvc = pSvc, } };
-    wnsprintfW(ctx->query, ARRAYSIZE(ctx->query), L"SELECT Index, Size, DeviceID from Win32_DiskPartition WHERE DiskIndex = %u", disk->index);
+    part_ctx ctx[1] = { {.pSvc = pSvc, .deadline = GetTickCount64() + timeout_ms, } };
+    wnsprintfW(ctx->query, ARRAYSIZE(ctx->query), L"SELECT Index, Size, DeviceID, Type from Win32_DiskPartition WHERE DiskIndex = %u", disk->index);
 
     IEnumWbemClassObject* pEnum = NULL;
-    HRESULT hr = pSvc->lpVtbl->ExecQuery(pSvc, L"WQL", ctx->query, 0, NULL, &pEnum);
+    statAdd(STAT_QUERIES, 1);
+    HRESULT hr = pSvc->lpVtbl->ExecQuery(pSvc, L"WQL", ctx->query,
+        WBEM_FLAG_FORWARD_ONLY | WBEM_FLAG_RETURN_IMMEDIATELY, NULL, &pEnum);
     if (FAILED(hr))
         return setHresult(disk->e_parts, L"IWbemServices::ExecQuery failed", hr);
 
     DWORD i = 0;
     IWbemClassObject* pCls = NULL;
     ULONG nr = 0;
-    for (pEnum->lpVtbl->Next(pEnum, WBEM_INFINITE, 1, &pCls, &nr); nr;
-        pEnum->lpVtbl->Next(pEnum, WBEM_INFINITE, 1, &pCls, &nr))
+    for (hr = nextObject(pEnum, ctx->deadline, &pCls, &nr); nr;
+        hr = nextObject(pEnum, ctx->deadline, &pCls, &nr))
     {
         ctx->part = getPart(disk, i);
         ctx->deviceId[0] = 0;
@@ -220,9 +263,25 @@ static HRESULT listParts(disk_info* disk, IWbemServices* pSvc)
     }
 
     pEnum->lpVtbl->Release(pEnum);
+    if (hr == E_ABORT)
+        return setErrorCode(disk->e_parts, L"Cancelled on exit", ERROR_CANCELLED);
+    if (hr == WBEM_S_TIMEDOUT) {
+        statAdd(STAT_PARTS_TIMEOUT, 1);
+        return setErrorCode(disk->e_parts, L"Timed out listing partitions", ERROR_TIMEOUT);
+    }
     return 0;
 }
 
+static BOOL hasText(IWbemClassObject* pCls, PCWCH name, PCWCH text)
+{
+    VARIANT v[1];
+    VariantInit(v);
+    HRESULT hr = pCls->lpVtbl->Get(pCls, name, 0, v, NULL, NULL);
+    const BOOL found = !FAILED(hr) && v->vt == VT_BSTR && StrStrIW(v->bstrVal, text);
+    VariantClear(v);
+    return found;
+}
+
 static HRESULT initDisk(disk_info* disk, IWbemClassObject* pCls)
 {
     // https://learn.microsoft.com/en-us/windows/win32/cimwin32prov/win32-diskdrive
@@ -242,16 +301,30 @@ static HRESULT initDisk(disk_info* disk, IWbemClassObject* pCls)
     GET(Model,      disk->model = StrDupW(v->bstrVal));
     GET(DeviceID,   StringCchCopyW(disk->path, ARRAYSIZE(disk->path), v->bstrVal));
     GET(Partitions, disk->n_parts = v->uintVal);
+    // some drives don't report serial number
+    GET(SerialNumber, if (v->vt == VT_BSTR) disk->serial = StrDupW(v->bstrVal));
+    GET(Size,       if (v->vt == VT_BSTR) disk->size = wtou64(v->bstrVal));
+
+    if (disk->serial)
+        StrTrimW(disk->serial, L" ");
 
 #undef GET
+    // not critical, only moves such disks ahead when loading partitions
+    disk->removable = hasText(pCls, L"InterfaceType", L"USB") ||
+        hasText(pCls, L"MediaType", L"Removable") ||
+        hasText(pCls, L"MediaType", L"External");
     return 0;
 }
 
-static HRESULT servicesListDisks(state* st, IWbemServices* pSvc)
+static HRESULT servicesListDrives(state* st, IWbemServices* pSvc)
 {
     IEnumWbemClassObject* pEnum = NULL;
-    static WCHAR query[] = L"SELECT Index, Model, DeviceID, Partitions from Win32_DiskDrive";
+    static WCHAR query[] = L"SELECT Index, Model, DeviceID, Partitions, SerialNumber, Size,"
+        L" InterfaceType, MediaType from Win32_DiskDrive";
+    statAdd(STAT_QUERIES, 1);
+    TRACE_BEGIN("wmi.disks");
     HRESULT hr = pSvc->lpVtbl->ExecQuery(pSvc, L"WQL", query, 0, NULL, &pEnum);
+    TRACE_END("wmi.disks");
     if (FAILED(hr))
         return setHresult(st->e, L"IWbemServices::ExecQuery failed", hr);
 
@@ -263,12 +336,15 @@ static HRESULT servicesListDisks(state* st, IWbemServices* pSvc)
         disk_info* disk = getDisk(st, st->n_disks);
         st->n_disks++;
 
-        initDisk(disk, pCls);
+        // partitions are listed separately, see listDriveParts
+        disk->loading = !initDisk(disk, pCls);
+        // no raw reads here: a sleeping disk would hold up the whole list,
+        // such disk just gets its partitions listed again
+        if (disk->loading)
+            disk->fingerprint = diskFingerprint(disk->path, disk->size, FALSE);
 
         pCls->lpVtbl->Release(pCls);
 
-        listParts(disk, pSvc);
-
         if (st->n_disks == MAX_DISKS)
             break;
     }
@@ -277,61 +353,287 @@ static HRESULT servicesListDisks(state* st, IWbemServices* pSvc)
     return 0;
 }
 
-static void swapDisks(disk_info* l, disk_info* r)
+HRESULT listDrives(state* st)
 {
-    disk_info t[1];
-    *t = *l;
-    *l = *r;
-    *r = *t;
+    // images are there even if WMI is not
+    if (!st->services) {
+        listImages(st);
+        return st->e->error;
+    }
+
+    TRACE_BEGIN("disks.drives");
+    HRESULT hr = servicesListDrives(st, st->services);
+    listImages(st);
+    sortDisks(st->disk, st->n_disks);
+    TRACE_END("disks.drives");
+    return hr;
 }
 
-static void sortDisks(state* st)
+DWORD listLetters(state* st, part_letter* map, DWORD max)
 {
-    if (st->n_disks < 2)
-        return;
+    IWbemServices* pSvc = st->services;
+    if (!pSvc)
+        return NO_LETTERS;
 
-    for (DWORD x = 0; x < st->n_disks - 1; x++) {
-        for (DWORD y = 0; y < st->n_disks - x - 1; y++) {
-            disk_info* l = getDisk(st, y);
-            disk_info* r = getDisk(st, y + 1);
-            if (l->index > r->index)
-                swapDisks(l, r);
+    // one query for all disks instead of one per partition
+    static WCHAR query[] = L"SELECT Antecedent, Dependent from Win32_LogicalDiskToPartition";
+    IEnumWbemClassObject* pEnum = NULL;
+    statAdd(STAT_QUERIES, 1);
+    TRACE_BEGIN("wmi.letters");
+    HRESULT hr = pSvc->lpVtbl->ExecQuery(pSvc, L"WQL", query,
+        WBEM_FLAG_FORWARD_ONLY | WBEM_FLAG_RETURN_IMMEDIATELY, NULL, &pEnum);
+    if (FAILED(hr)) {
+        TRACE_END("wmi.letters");
+        return NO_LETTERS;
+    }
+
+    const ULONGLONG deadline = GetTickCount64() + DISK_PARTS_MS;
+    DWORD n = 0;
+    IWbemClassObject* pCls = NULL;
+    ULONG nr = 0;
+    for (hr = nextObject(pEnum, deadline, &pCls, &nr); nr;
+        hr = nextObject(pEnum, deadline, &pCls, &nr))
+    {
+        VARIANT a[1], d[1];
+        VariantInit(a);
+        VariantInit(d);
+        if (!FAILED(pCls->lpVtbl->Get(pCls, L"Antecedent", 0, a, NULL, NULL)) &&
+            !FAILED(pCls->lpVtbl->Get(pCls, L"Dependent", 0, d, NULL, NULL)) &&
+            a->vt == VT_BSTR && d->vt == VT_BSTR &&
+            parseLetterLink(a->bstrVal, d->bstrVal, &map[n]))
+            n++;
+        VariantClear(a);
+        VariantClear(d);
+        pCls->lpVtbl->Release(pCls);
+        if (n == max)
+            break;
+    }
+    pEnum->lpVtbl->Release(pEnum);
+    TRACE_END("wmi.letters");
+    // partial map would clear letters of the rest
+    return hr == WBEM_S_TIMEDOUT || hr == E_ABORT ? NO_LETTERS : n;
+}
+
+DWORD reuseParts(state* st, const state* old)
+{
+    DWORD reused = 0;
+    DWORD listed = 0;
+    for (DWORD i = 0; i < st->n_disks; i++) {
+        disk_info* disk = getDisk(st, i);
+        if (!disk->loading)
+            continue;
+
+        const ULONG id = diskId(disk);
+        const disk_info* from = NULL;
+        for (DWORD j = 0; j < old->n_disks && !from && disk->fingerprint; j++) {
+            const disk_info* o = &old->disk[j];
+            if (!o->loading && !o->e->error && !o->e_parts->error &&
+                o->fingerprint == disk->fingerprint && diskId(o) == id)
+                from = o;
+        }
+        if (!from) {
+            // layout changed, or the disk is new: cached blocks are stale.
+            // Images are checked against the file, see cacheValidate.
+            if (!disk->image[0])
+                cacheInvalidate(disk->path);
+            listed++;
+            continue;
         }
+
+        disk->n_parts = from->n_parts;
+        for (DWORD j = 0; j < min(from->n_parts, MAX_PARTS); j++)
+            *getPart(disk, j) = from->part[j];
+        disk->loading = FALSE;
+        reused++;
     }
+    statAdd(STAT_PARTS_REUSED, reused);
+    statAdd(STAT_PARTS_LISTED, listed);
+    return reused;
 }
 
-HRESULT listDisks(state* st)
+void applyLetters(state* st, const part_letter* map, DWORD n)
 {
-    if (!st->services)
-        return st->e->error;
+    for (DWORD i = 0; i < st->n_disks; i++) {
+        disk_info* disk = getDisk(st, i);
+        if (disk->loading)
+            continue;
+        for (DWORD j = 0; j < min(disk->n_parts, MAX_PARTS); j++) {
+            part_info* part = getPart(disk, j);
+            part->letter = 0;
+            for (DWORD k = 0; k < n; k++)
+                if (map[k].disk == disk->index && map[k].part == part->index)
+                    part->letter = map[k].letter;
+        }
+    }
+}
 
-    HRESULT hr = servicesListDisks(st, st->services);
-    sortDisks(st);
+HRESULT listDriveParts(state* st, disk_info* disk, DWORD timeout_ms)
+{
+    if (disk->image[0])
+        return listImageParts(disk);
+
+    HRESULT hr = 0;
+    if (st->services) {
+        TRACE_BEGIN("wmi.partitions");
+        hr = listParts(disk, st->services, timeout_ms);
+        TRACE_END("wmi.partitions");
+    }
+    disk->loading = FALSE;
     return hr;
 }
 
+// Convert event creation time to nowUs() clock,
+// so latency includes time event waited for the poll timer
+static ULONGLONG eventTime(IWbemClassObject* pCls)
+{
+    const ULONGLONG now = nowUs();
+    ULONGLONG created = 0;
+
+    VARIANT v[1];
+    VariantInit(v);
+    // uint64 is returned as string, FILETIME units
+    HRESULT hr = pCls->lpVtbl->Get(pCls, L"TIME_CREATED", 0, v, NULL, NULL);
+    if (!FAILED(hr) && v->vt == VT_BSTR)
+        created = wtou64(v->bstrVal);
+    VariantClear(v);
+    if (!created)
+        return now;
+
+    FILETIME ft;
+    GetSystemTimePreciseAsFileTime(&ft);
+    const ULONGLONG wall = ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    const ULONGLONG age = wall > created ? (wall - created) / 10 : 0;
+    return age < now ? now - age : 1;
+}
+
+static DWORD letterBit(WCHAR c)
+{
+    if (c >= L'a' && c <= L'z')
+        c -= L'a' - L'A';
+    return c >= L'A' && c <= L'Z' ? 1u << (c - L'A') : 0;
+}
+
+// Drop cached blocks of disks which have a partition with one of letters.
+// Letter of no listed partition may be on any disk, so is an event
+// without one: everything is dropped then.
+static void dropEventBlocks(const state* st, DWORD letters, BOOL unknown)
+{
+    DWORD matched = 0;
+    for (DWORD i = 0; i < st->n_disks && !unknown; i++) {
+        const disk_info* disk = &st->disk[i];
+        DWORD mask = 0;
+        for (DWORD j = 0; j < min(disk->n_parts, MAX_PARTS); j++)
+            mask |= letterBit(disk->part[j].letter);
+        if (!disk->image[0] && (mask & letters))
+            cacheInvalidate(disk->path);
+        matched |= mask;
+    }
+    if (unknown || (letters & ~matched))
+        cacheInvalidate(NULL);
+}
+
 BOOL pollDisks(state* st)
 {
     IEnumWbemClassObject* pEnum = st->events;
     if (!pEnum)
         return FALSE;
 
-    IWbemClassObject* pCls = NULL;
-    ULONG nr = 0;
-    pEnum->lpVtbl->Next(pEnum, WBEM_NO_WAIT, 1, &pCls, &nr);
-    if (!nr)
+    // Plugging a disk produces a burst of volume events.
+    // Drain all of them, single refresh is enough.
+    DWORD n = 0;
+    DWORD letters = 0;
+    BOOL unknown = FALSE;
+    for (;;) {
+        IWbemClassObject* pCls = NULL;
+        ULONG nr = 0;
+        pEnum->lpVtbl->Next(pEnum, WBEM_NO_WAIT, 1, &pCls, &nr);
+        if (!nr)
+            break;
+        if (!n && !st->event_us)
+            st->event_us = eventTime(pCls);
+
+        // "E:", the volume which came, went or changed
+        VARIANT v[1];
+        VariantInit(v);
+        HRESULT hr = pCls->lpVtbl->Get(pCls, L"DriveName", 0, v, NULL, NULL);
+        const DWORD bit = !FAILED(hr) && v->vt == VT_BSTR && v->bstrVal ? letterBit(v->bstrVal[0]) : 0;
+        letters |= bit;
+        unknown |= !bit;
+        VariantClear(v);
+
+        pCls->lpVtbl->Release(pCls);
+        n++;
+    }
+    if (!n)
         return FALSE;
 
-    pCls->lpVtbl->Release(pCls);
+    dropEventBlocks(st, letters, unknown);
+
+    statAdd(STAT_EVENTS, n);
+    statAdd(STAT_EVENTS_COALESCED, n - 1);
     return TRUE;
 }
 
+void partMountName(PCWCH disk, DWORD partition, PWCHAR name, DWORD cch)
+{
+    PCWCH s = disk;
+    for (PCWCH c = disk; *c; ++c)
+        if (*c == L'\\')
+            s = c + 1;
+    wnsprintfW(name, cch, L"%sp%u", s, partition);
+}
+
+ULONG diskId(const disk_info* disk)
+{
+    return hashText(hashText(2166136261u, diskDevice(disk)), disk->serial);
+}
+
+BOOL backendPoll(state* st)
+{
+    return st->backend ? st->backend->poll(st) : pollDisks(st);
+}
+
+HRESULT backendDrives(state* st)
+{
+    return st->backend ? st->backend->drives(st) : listDrives(st);
+}
+
+HRESULT backendParts(state* st, disk_info* disk, DWORD timeout_ms)
+{
+    return st->backend ? st->backend->parts(st, disk, timeout_ms) : listDriveParts(st, disk, timeout_ms);
+}
+
+DWORD backendLetters(state* st, part_letter* map, DWORD max)
+{
+    if (st->backend)
+        return st->backend->letters ? st->backend->letters(st, map, max) : NO_LETTERS;
+    return listLetters(st, map, max);
+}
+
+HRESULT backendList(state* st)
+{
+    const ULONGLONG start = nowUs();
+    const LONG64 queries = statGet(STAT_QUERIES);
+    TRACE_BEGIN("disks.list");
+    HRESULT hr = backendDrives(st);
+    for (DWORD i = 0; i < st->n_disks; i++) {
+        disk_info* disk = getDisk(st, i);
+        if (disk->loading)
+            backendParts(st, disk, DISK_PARTS_MS);
+    }
+    TRACE_END("disks.list");
+
+    statAdd(STAT_REFRESHES, 1);
+    statRecord(HIST_ENUM, nowUs() - start);
+    statRecord(HIST_QUERIES, statGet(STAT_QUERIES) - queries);
+    return hr;
+}
+
 void deinitDisks(state* st)
 {
     st->events = release(st->events);
     st->services = release(st->services);
     st->locator = release(st->locator);
-    pCode = release(pCode);
 }
 
 static HRESULT setupDisks(state* st)
@@ -344,7 +646,9 @@ static HRESULT setupDisks(state* st)
         return setHresult(st->e, L"Failed to create IWbemLocator instance", hr);
 
     IWbemLocator* pLoc = st->locator;
+    TRACE_BEGIN("wmi.connect");
     hr = pLoc->lpVtbl->ConnectServer(pLoc, L"ROOT\\CIMV2", NULL, NULL, 0, 0, 0, 0, &st->services);
+    TRACE_END("wmi.connect");
     if (FAILED(hr))
         return setHresult(st->e, L"IWbemLocator::ConnectServer failed", hr);
 
@@ -380,7 +684,9 @@ static HRESULT setupDisks(state* st)
 
 HRESULT initDisks(state* st)
 {
+    TRACE_BEGIN("disks.init");
     HRESULT hr = setupDisks(st);
+    TRACE_END("disks.init");
     if (FAILED(hr))
         deinitDisks(st);
     return hr;
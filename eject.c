@@ -0,0 +1,216 @@
+#include "shared.h"
+
+#include <windows.h>
+#include <Shlwapi.h>
+
+// Safe eject of every disk mounted through this program.
+// Steps run under one deadline:
+//   1. sync in the default distribution, so dirty data hits the disks
+//   2. wsl --unmount <disk> for all disks at once, each one unmounts
+//      its filesystems and detaches the disk from the VM
+// Whatever has not finished by the deadline is left running and
+// reported, killing wsl.exe halfway through detach does more harm.
+
+static DWORD findMount(const mount_list* m, PCWCH path)
+{
+    for (DWORD i = 0; i < m->n; i++)
+        if (!lstrcmpiW(m->path[i], path))
+            return i;
+    return m->n;
+}
+
+BOOL isMounted(const mount_list* m, PCWCH path)
+{
+    return findMount(m, path) < m->n;
+}
+
+void trackMount(mount_list* m, PCWCH path)
+{
+    if (isMounted(m, path) || m->n >= MAX_DISKS)
+        return;
+    StrCpyNW(m->path[m->n++], path, ARRAYSIZE(m->path[0]));
+}
+
+void untrackMount(mount_list* m, PCWCH path)
+{
+    const DWORD i = findMount(m, path);
+    if (i >= m->n)
+        return;
+    m->n--;
+    if (i != m->n)
+        StrCpyNW(m->path[i], m->path[m->n], ARRAYSIZE(m->path[0]));
+}
+
+static HANDLE spawnWsl(PCWCH args)
+{
+    // command line must start with executable name
+    WCHAR cmd[MAX_PATH + 64];
+    wnsprintfW(cmd, ARRAYSIZE(cmd), L"wsl.exe %s", args);
+
+    STARTUPINFO si = { .cb = sizeof(si), };
+    PROCESS_INFORMATION pi;
+    if (!CreateProcessW(WSL_PATH, cmd, NULL, NULL, FALSE, CREATE_NO_WINDOW,
+        NULL, NULL, &si, &pi))
+        return NULL;
+    CloseHandle(pi.hThread);
+    return pi.hProcess;
+}
+
+static DWORD msLeft(ULONGLONG deadline)
+{
+    const ULONGLONG now = GetTickCount64();
+    return now < deadline ? (DWORD)(deadline - now) : 0;
+}
+
+static void appendReport(PWCHAR report, DWORD cch, PCWCH path, PCWCH why)
+{
+    const DWORD n = lstrlenW(report);
+    wnsprintfW(report + n, cch - n, L"%s%s: %s", n ? L"\n" : L"", path, why);
+}
+
+DWORD ejectAll(mount_list* m, DWORD timeout_ms, PWCHAR report, DWORD cch)
+{
+    report[0] = 0;
+    if (!m->n)
+        return 0;
+
+    TRACE_BEGIN("eject");
+    const ULONGLONG start = nowUs();
+    const ULONGLONG deadline = GetTickCount64() + timeout_ms;
+
+    // flush gets at most half of the time, detach must have a chance
+    TRACE_BEGIN("eject.sync");
+    HANDLE sync = spawnWsl(L"-e sync");
+    if (sync) {
+        WaitForSingleObject(sync, msLeft(deadline) / 2);
+        CloseHandle(sync);
+    }
+    TRACE_END("eject.sync");
+
+    // why each disk is still mounted, NULL once it is detached
+    const DWORD n = m->n;
+    PCWCH why[MAX_DISKS];
+    HANDLE procs[MAX_DISKS];
+    DWORD running = 0;
+    for (DWORD i = 0; i < n; i++) {
+        // image files may have spaces in their paths
+        WCHAR args[MAX_PATH + 32];
+        wnsprintfW(args, ARRAYSIZE(args), L"--unmount \"%s\"", m->path[i]);
+        procs[i] = spawnWsl(args);
+        why[i] = procs[i] ? L"timed out" : L"failed to start wsl.exe";
+        if (procs[i])
+            running++;
+    }
+
+    TRACE_BEGIN("eject.unmount");
+    while (running) {
+        HANDLE wait[MAX_DISKS];
+        DWORD map[MAX_DISKS];
+        DWORD k = 0;
+        for (DWORD i = 0; i < n; i++)
+            if (procs[i]) {
+                map[k] = i;
+                wait[k++] = procs[i];
+            }
+
+        const DWORD r = WaitForMultipleObjects(k, wait, FALSE, msLeft(deadline));
+        if (r >= WAIT_OBJECT_0 + k)
+            break; // deadline
+
+        const DWORD i = map[r - WAIT_OBJECT_0];
+        DWORD exitCode = 1;
+        GetExitCodeProcess(procs[i], &exitCode);
+        CloseHandle(procs[i]);
+        procs[i] = NULL;
+        running--;
+
+        why[i] = exitCode ? L"wsl --unmount failed" : NULL;
+        statAdd(exitCode ? STAT_UNMOUNT_FAILED : STAT_UNMOUNT_OK, 1);
+    }
+    TRACE_END("eject.unmount");
+
+    DWORD failed = 0;
+    for (DWORD i = n; i-- > 0;) {
+        if (procs[i]) {
+            CloseHandle(procs[i]);
+            statAdd(STAT_EJECT_TIMEOUT, 1);
+        }
+        if (why[i]) {
+            appendReport(report, cch, m->path[i], why[i]);
+            failed++;
+        }
+        else
+            untrackMount(m, m->path[i]); // only moves entries after i
+    }
+
+    TRACE_END("eject");
+    statRecord(HIST_EJECT, nowUs() - start);
+    return failed;
+}
+
+static void checkList(check* c)
+{
+    mount_list m[1] = { 0 };
+    trackMount(m, L"\\\\.\\PHYSICALDRIVE1");
+    trackMount(m, L"\\\\.\\physicaldrive1");
+    trackMount(m, L"C:\\images\\backup disk.vhdx");
+    expectNumber(c, m->n, 2, L"same disk is tracked once");
+    expect(c, isMounted(m, L"\\\\.\\PhysicalDrive1"), L"paths are case insensitive");
+    expect(c, !isMounted(m, L"\\\\.\\PHYSICALDRIVE10"), L"no prefix match");
+
+    untrackMount(m, L"\\\\.\\PHYSICALDRIVE7");
+    expectNumber(c, m->n, 2, L"untrack of unknown disk");
+    untrackMount(m, L"\\\\.\\PHYSICALDRIVE1");
+    expectNumber(c, m->n, 1, L"untrack");
+    expectText(c, m->path[0], L"C:\\images\\backup disk.vhdx", L"last entry moves in");
+
+    // full list ignores more disks
+    m->n = 0;
+    for (DWORD i = 0; i <= MAX_DISKS; i++) {
+        WCHAR path[MAX_DRIVE_PATH];
+        wnsprintfW(path, ARRAYSIZE(path), L"\\\\.\\PHYSICALDRIVE%u", i);
+        trackMount(m, path);
+    }
+    expectNumber(c, m->n, MAX_DISKS, L"list is full");
+    expect(c, !isMounted(m, L"\\\\.\\PHYSICALDRIVE32"), L"disk over the limit");
+
+    // ejectAll drops detached disks going backwards: moving the last
+    // entry into a freed slot never touches slots it has yet to visit
+    DWORD wrong = 0;
+    for (DWORD i = MAX_DISKS; i-- > 0;)
+        if (i % 3)
+            untrackMount(m, m->path[i]);
+    for (DWORD i = 0; i < MAX_DISKS; i++) {
+        WCHAR path[MAX_DRIVE_PATH];
+        wnsprintfW(path, ARRAYSIZE(path), L"\\\\.\\PHYSICALDRIVE%u", i);
+        wrong += isMounted(m, path) != (i % 3 == 0);
+    }
+    expectNumber(c, m->n, (MAX_DISKS + 2) / 3, L"disks left after eject");
+    expectNumber(c, wrong, 0, L"detached disks are the ones dropped");
+}
+
+static void checkReport(check* c)
+{
+    WCHAR report[128] = L"stale";
+    mount_list m[1] = { 0 };
+    expectNumber(c, ejectAll(m, 1000, report, ARRAYSIZE(report)), 0, L"nothing to eject");
+    expectText(c, report, L"", L"empty report");
+
+    appendReport(report, ARRAYSIZE(report), L"\\\\.\\PHYSICALDRIVE2", L"timed out");
+    appendReport(report, ARRAYSIZE(report), L"D:\\a.vhdx", L"wsl --unmount failed");
+    expectText(c, report, L"\\\\.\\PHYSICALDRIVE2: timed out\nD:\\a.vhdx: wsl --unmount failed",
+        L"report line per disk");
+
+    // report is cut, not overrun
+    report[0] = 0;
+    for (DWORD i = 0; i < 10; i++)
+        appendReport(report, 40, L"\\\\.\\PHYSICALDRIVE2", L"timed out");
+    expect(c, lstrlenW(report) < 40, L"report fits its buffer");
+}
+
+// Mount list and eject report, nothing is started
+void checkMounts(check* c)
+{
+    checkList(c);
+    checkReport(c);
+}
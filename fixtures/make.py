@@ -0,0 +1,201 @@
+# Sample disk images for "wsldskmnt check", run from this directory.
+# Output is the same on every run, so regenerated files don't show up in diffs.
+import struct
+import uuid
+import zlib
+
+MBR_ENTRY = 446
+
+
+def guid(s):
+    return uuid.UUID(s).bytes_le
+
+
+LINUX = '0FC63DAF-8483-4772-8E79-3D69D8477DE4'
+SYSTEM = 'C12A7328-F81F-11D2-BA4B-00A0C93EC93B'
+DISK_ID = '5F1AC2D0-7B3E-4C8A-9E21-3D4C5B6A7980'
+
+
+def gpt_disk(sectors, parts, sector=512):
+    """parts: (type, first lba, last lba) by entry index, None leaves it empty"""
+    d = bytearray(sectors * sector)
+    struct.pack_into('<B3sB3sII', d, MBR_ENTRY, 0, b'\0\2\0', 0xEE, b'\xff\xff\xff', 1, sectors - 1)
+    d[510:512] = b'\x55\xaa'
+
+    ents = bytearray(128 * 128)
+    for i, p in enumerate(parts):
+        if p:
+            t, a, b = p
+            part_id = uuid.UUID(int=i + 1).bytes_le
+            struct.pack_into('<16s16sQQQ', ents, i * 128, guid(t), part_id, a, b, 0)
+    first = 2 + len(ents) // sector
+    hdr = bytearray(92)
+    struct.pack_into('<8sIIIIQQQQ16sQIII', hdr, 0, b'EFI PART', 0x10000, 92, 0, 0,
+                     1, sectors - 1, first, sectors - 2, guid(DISK_ID), 2, 128, 128, zlib.crc32(ents))
+    struct.pack_into('<I', hdr, 16, zlib.crc32(hdr))
+    d[sector:sector + 92] = hdr
+    d[2 * sector:2 * sector + len(ents)] = ents
+    return d
+
+
+def mbr_entry(d, at, typ, start, count):
+    struct.pack_into('<B3sB3sII', d, at, 0, b'\xfe\xff\xff', typ, b'\xfe\xff\xff', start, count)
+
+
+def mbr_disk(sectors, logical, sector=512):
+    """Linux partition 1 at LBA 8, extended one from LBA 32 with a chain of
+    logical partitions: (type, EBR LBA relative to extended, count)"""
+    d = bytearray(sectors * sector)
+    struct.pack_into('<I', d, 440, 0x5744534B)
+    mbr_entry(d, MBR_ENTRY, 0x83, 8, 24)
+    mbr_entry(d, MBR_ENTRY + 16, 0x05, 32, sectors - 32)
+    d[510:512] = b'\x55\xaa'
+    for k, (typ, rel, count) in enumerate(logical):
+        at = (32 + rel) * sector
+        mbr_entry(d, at + MBR_ENTRY, typ, 1, count)
+        if k + 1 < len(logical):
+            # link spans up to the EBR after the next one
+            rel = logical[k + 1][1]
+            end = logical[k + 2][1] if k + 2 < len(logical) else sectors - 32
+            mbr_entry(d, at + MBR_ENTRY + 16, 0x05, rel, end - rel)
+        d[at + 510:at + 512] = b'\x55\xaa'
+    return d
+
+
+LOGICAL = [(0x83, 0, 15), (0x82, 16, 15), (0x8E, 32, 63)]
+
+
+def checksum(b):
+    return ~sum(b) & 0xffffffff
+
+
+def vhd_footer(size, disk_type, data_offset):
+    f = bytearray(512)
+    struct.pack_into('>8sIIQI4sI4sQQIII16s', f, 0, b'conectix', 2, 0x10000, data_offset, 0,
+                     b'wdsk', 0x10000, b'Wi2k', size, size, 0, disk_type, 0, guid(DISK_ID))
+    struct.pack_into('>I', f, 64, checksum(f))
+    return bytes(f)
+
+
+def vhd_fixed(disk):
+    return bytes(disk) + vhd_footer(len(disk), 2, 0xffffffffffffffff)
+
+
+def vhd_dynamic(disk, block):
+    """Only blocks with data are stored, and only their sectors with data
+    are marked in block bitmap. Unmarked sectors hold garbage, which must
+    read as zeros."""
+    n = (len(disk) + block - 1) // block
+    footer = vhd_footer(len(disk), 3, 512)
+    bat_at = 512 + 1024
+    bat = bytearray(b'\xff' * ((4 * n + 511) // 512 * 512))
+    hdr = bytearray(1024)
+    struct.pack_into('>8sQQIII', hdr, 0, b'cxsparse', 0xffffffffffffffff, bat_at, 0x10000, n, block)
+    struct.pack_into('>I', hdr, 36, checksum(hdr))
+
+    sectors = block // 512
+    bitmap = (sectors // 8 + 511) // 512 * 512
+    out = bytearray(footer + hdr)
+    data = bytearray()
+    at = bat_at + len(bat)
+    for b in range(n):
+        chunk = disk[b * block:(b + 1) * block]
+        if not any(chunk):
+            continue
+        struct.pack_into('>I', bat, 4 * b, (at + len(data)) // 512)
+        bits = bytearray(bitmap)
+        stored = bytearray(b'\xab' * block)
+        for k in range(sectors):
+            sector = chunk[k * 512:(k + 1) * 512]
+            if any(sector):
+                bits[k // 8] |= 0x80 >> (k % 8)
+                stored[k * 512:(k + 1) * 512] = sector
+        data += bits + stored
+    return bytes(out + bat + data + footer)
+
+
+VHDX_BAT = '2DC27766-F623-4200-9D64-115E9BFD4A08'
+VHDX_METADATA = '8B7CA206-4790-4B9A-B8FE-575F050F886E'
+MB = 1 << 20
+
+
+def crc32c(data):
+    crc = 0xffffffff
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1))
+    return crc ^ 0xffffffff
+
+
+def with_crc(b):
+    struct.pack_into('<I', b, 4, crc32c(b))
+    return b
+
+
+def vhdx(disk, sector):
+    """1MB blocks: headers, metadata at 1MB, BAT at 2MB, payload from 3MB"""
+    block = MB
+    out = bytearray(3 * MB)
+    out[0:8] = b'vhdxfile'
+    for i in (1, 2):
+        h = bytearray(4096)
+        struct.pack_into('<4sIQ16s16s16sHHIQ', h, 0, b'head', 0, i, uuid.UUID(int=i).bytes_le,
+                         uuid.UUID(int=3).bytes_le, bytes(16), 0, 1, MB, MB)
+        out[i * 64 << 10:(i * 64 << 10) + 4096] = with_crc(h)
+
+    regions = bytearray(64 << 10)
+    struct.pack_into('<4sIII', regions, 0, b'regi', 0, 2, 0)
+    struct.pack_into('<16sQII', regions, 16, guid(VHDX_BAT), 2 * MB, MB, 1)
+    struct.pack_into('<16sQII', regions, 48, guid(VHDX_METADATA), MB, MB, 1)
+    with_crc(regions)
+    out[192 << 10:256 << 10] = regions
+    out[256 << 10:320 << 10] = regions
+
+    items = [
+        ('CAA16737-FA36-4D43-B3B6-33F0AA44E76B', struct.pack('<II', block, 0)),  # file parameters
+        ('2FA54224-CD1B-4876-B211-5DBED83BF4B8', struct.pack('<Q', len(disk))),  # virtual disk size
+        ('BECA12AB-B2E6-4523-93EF-C309E000C746', guid(DISK_ID)),  # page 83 data
+        ('8141BF1D-A96F-4709-BA47-F233A8FAAB5F', struct.pack('<I', sector)),  # logical sector size
+        ('CDA348C7-445D-4471-9CC9-E9885251C556', struct.pack('<I', 4096)),  # physical sector size
+    ]
+    meta = bytearray(MB)
+    struct.pack_into('<8sHH', meta, 0, b'metadata', 0, len(items))
+    for i, (g, v) in enumerate(items):
+        at = (64 << 10) + i * 4096
+        flags = 4 if i == 0 else 6  # required, and virtual disk ones
+        struct.pack_into('<16sIII', meta, 32 + i * 32, guid(g), at, len(v), flags)
+        meta[at:at + len(v)] = v
+    out[MB:2 * MB] = meta
+
+    # one payload block, fully present, at 3MB
+    assert len(disk) <= block
+    struct.pack_into('<Q', out, 2 * MB, 6 | (3 << 20))
+    return bytes(out + disk.ljust(block, b'\0'))
+
+
+def write(name, data):
+    with open(name, 'wb') as f:
+        f.write(data)
+
+
+if __name__ == '__main__':
+    write('gpt.img', gpt_disk(256, [(SYSTEM, 34, 99), None, (LINUX, 100, 254)]))
+    # last partition is one sector shorter
+    write('gpt-resized.img', gpt_disk(256, [(SYSTEM, 34, 99), None, (LINUX, 100, 253)]))
+    write('gpt-4k.img', gpt_disk(64, [(SYSTEM, 6, 31), (LINUX, 32, 62)], sector=4096))
+    write('mbr.img', mbr_disk(128, LOGICAL))
+    # primary table is the same, only the second extended boot record differs
+    write('mbr-logical.img', mbr_disk(128, [LOGICAL[0], (0x82, 16, 14), LOGICAL[2]]))
+    write('blank.img', bytes(64 << 10))
+
+    mbr = mbr_disk(128, LOGICAL)
+    write('mbr-fixed.vhd', vhd_fixed(mbr))
+    write('mbr-dynamic.vhd', vhd_dynamic(mbr, 16 << 10))
+    write('gpt-dynamic.vhd', vhd_dynamic(gpt_disk(256, [(SYSTEM, 34, 99), None, (LINUX, 100, 254)]), 16 << 10))
+    write('mbr.vhdx', vhdx(mbr, 512))
+    # MBR counts in 4K sectors there
+    write('mbr-4k.vhdx', vhdx(mbr_disk(128, LOGICAL, sector=4096), 4096))
+    write('mbr-4k-logical.vhdx', vhdx(mbr_disk(128, [LOGICAL[0], (0x82, 16, 14), LOGICAL[2]], sector=4096), 4096))
+    # payload block is gone
+    write('mbr-truncated.vhdx', vhdx(mbr, 512)[:3 * MB])
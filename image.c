@@ -0,0 +1,414 @@
+#include "shared.h"
+
+#include <windows.h>
+#include <Shlwapi.h>
+#include <strsafe.h>
+
+// Disk image files shown along with physical disks, without attaching them.
+// They are listed in "wsldskmnt.images" next to the executable, one per
+// line, '#' starts a comment:
+//
+//   D:\vm\backup.vhdx
+//   D:\images          every .vhd, .vhdx, .img and .raw file in it
+//
+// Image is read through the block cache, keyed by its path. Headers and
+// the block allocation table tell where virtual disk blocks are, see
+// openImage in core.c, and only blocks holding the bytes we touch are
+// read: listing partitions of a sparse multi-terabyte image reads a few
+// hundred kilobytes, and listing it again while the file is unchanged
+// reads nothing. A file mapping would turn an I/O error of a truncated
+// image, or one on a network share, into an exception.
+// Partitions are attached with wsl --mount --vhd, which can't take raw images.
+
+#define IMAGES_FILE L"wsldskmnt.images"
+#define IMAGE_INDEX 1000 // disk index of the first image, physical disks go before
+
+typedef struct image_file {
+    PCWCH path;
+    DWORD error; // of the first read which failed
+    image_reader r[1];
+} image_file;
+
+static BOOL readCachedFile(void* ctx, ULONGLONG offset, void* buf, DWORD size)
+{
+    image_file* f = ctx;
+    if (offset > f->r->file_size || size > f->r->file_size - offset) {
+        // block table points past the end, the file was cut
+        if (!f->error)
+            f->error = ERROR_HANDLE_EOF;
+        return FALSE;
+    }
+    if (cacheRead(f->path, offset, buf, size))
+        return TRUE;
+    if (!f->error)
+        f->error = GetLastError() ? GetLastError() : ERROR_READ_FAULT;
+    return FALSE;
+}
+
+static DWORD setFormatError(err_desc* e, PCWCH why)
+{
+    e->title = L"Unsupported image";
+    e->error = ERROR_BAD_FORMAT;
+    e->text = StrDupW(why);
+    return e->error;
+}
+
+// Failed read makes the image look corrupted, report the read instead
+static DWORD setReadError(const image_file* f, err_desc* e)
+{
+    return setErrorCode(e, L"Failed to read image", f->error);
+}
+
+// Parse image headers, f must be zeroed and outlive path.
+// Cached blocks of the file are dropped if it was written to since.
+static DWORD openImageFile(image_file* f, PCWCH path, err_desc* e)
+{
+    TRACE_BEGIN("image.open");
+    DWORD code = 0;
+    WIN32_FILE_ATTRIBUTE_DATA fa;
+    if (!GetFileAttributesExW(path, GetFileExInfoStandard, &fa))
+        code = setError(e, L"Failed to open image");
+    else if (!fa.nFileSizeLow && !fa.nFileSizeHigh)
+        code = setFormatError(e, L"Image file is empty");
+    else {
+        const ULONGLONG size = (ULONGLONG)fa.nFileSizeHigh << 32 | fa.nFileSizeLow;
+        cacheValidate(path, hashBytes(hashBytes(0, &fa.ftLastWriteTime,
+            sizeof(fa.ftLastWriteTime)), &size, sizeof(size)));
+        f->path = path;
+        f->r->read = readCachedFile;
+        f->r->ctx = f;
+        f->r->file_size = size;
+        PCWCH why = openImage(f->r);
+        if (f->error)
+            code = setReadError(f, e);
+        else if (why)
+            code = setFormatError(e, why);
+    }
+    TRACE_END("image.open");
+    return code;
+}
+
+static BOOL isImageFile(PCWCH path)
+{
+    static const PCWCH ext[] = { L".vhd", L".vhdx", L".img", L".raw" };
+    PCWCH e = PathFindExtensionW(path);
+    for (DWORD i = 0; i < ARRAYSIZE(ext); i++)
+        if (!lstrcmpiW(e, ext[i]))
+            return TRUE;
+    return FALSE;
+}
+
+// Name of image is made of its file name, with room left for a suffix
+static void nameFromFile(PCWCH image, PWCHAR name)
+{
+    PCWCH s = PathFindFileNameW(image);
+    PCWCH end = PathFindExtensionW(s);
+    DWORD n = 0;
+    for (; s < end && n < MAX_DRIVE_PATH - 8; ++s) {
+        const WCHAR c = *s;
+        const BOOL plain = (c >= L'a' && c <= L'z') || (c >= L'A' && c <= L'Z') ||
+            (c >= L'0' && c <= L'9') || c == L'-';
+        name[n++] = plain ? c : L'_';
+    }
+    name[n] = 0;
+    if (!n)
+        StringCchCopyW(name, MAX_DRIVE_PATH, L"image");
+}
+
+// Image is mounted at /mnt/wsl/<name>p<partition>, name is made of
+// its file name and must be unique among images. Images with the same
+// file name get a hash of the full path appended, so the name stays
+// the same whatever order images are listed in.
+static void setMountNames(disk_info* disk, DWORD n)
+{
+    BOOL clash[MAX_DISKS] = { 0 };
+    for (DWORD i = 0; i < n; i++)
+        for (DWORD j = i + 1; j < n; j++)
+            if (!lstrcmpiW(disk[i].path, disk[j].path))
+                clash[i] = clash[j] = TRUE;
+
+    for (DWORD i = 0; i < n; i++) {
+        if (!clash[i])
+            continue;
+        WCHAR suffix[8];
+        wnsprintfW(suffix, ARRAYSIZE(suffix), L"_%04x", hashText(2166136261u, disk[i].image) & 0xffff);
+        StringCchCatW(disk[i].path, ARRAYSIZE(disk[i].path), suffix);
+    }
+}
+
+static ULONGLONG imageFingerprint(image_file* f)
+{
+    ULONGLONG fp = 0;
+    BYTE* block = LocalAlloc(LMEM_FIXED, TABLE_BLOCK);
+    if (block)
+        fp = tableFingerprint(readImage, f->r, f->r->map.sector, block);
+    LocalFree(block);
+
+    // same as diskFingerprint, 0 means unknown
+    const ULONGLONG size = f->r->map.size;
+    return fp ? hashBytes(fp, &size, sizeof(size)) | 1 : 0;
+}
+
+static void addImage(state* st, PCWCH path, DWORD k)
+{
+    disk_info* disk = getDisk(st, st->n_disks);
+    st->n_disks++;
+    disk->index = IMAGE_INDEX + k;
+    StrCpyNW(disk->image, path, ARRAYSIZE(disk->image));
+    disk->model = StrDupW(PathFindFileNameW(path));
+    nameFromFile(path, disk->path);
+
+    // headers are read with partitions, by a task of its own: an image
+    // on a slow share holds up only itself, see listImageParts.
+    // File which can't be found still shows up, with the reason.
+    if (GetFileAttributesW(path) == INVALID_FILE_ATTRIBUTES)
+        setError(disk->e_parts, L"Failed to open image");
+    else
+        disk->loading = TRUE;
+}
+
+static DWORD addFolder(state* st, PCWCH dir, DWORD k)
+{
+    WCHAR path[MAX_PATH];
+    PathCombineW(path, dir, L"*");
+    WIN32_FIND_DATAW fd;
+    HANDLE h = FindFirstFileW(path, &fd);
+    if (h == INVALID_HANDLE_VALUE)
+        return k;
+    do {
+        if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && isImageFile(fd.cFileName) &&
+            st->n_disks < MAX_DISKS && PathCombineW(path, dir, fd.cFileName))
+            addImage(st, path, k++);
+    } while (FindNextFileW(h, &fd));
+    FindClose(h);
+    return k;
+}
+
+void listImages(state* st)
+{
+    // error of reading the list is shown unless there is a worse one
+    err_desc e[1] = { 0 };
+    PWCHAR text = readConfigFile(IMAGES_FILE, L"Failed to read image list",
+        st->e->error ? e : st->e);
+    resetErr(e);
+    if (!text)
+        return;
+
+    TRACE_BEGIN("images.list");
+    const DWORD first = st->n_disks;
+    DWORD k = 0;
+    for (PCWCH s = text; *s && st->n_disks < MAX_DISKS; s = skipLineBreaks(findLineEnd(s))) {
+        WCHAR line[MAX_PATH];
+        const PCWCH end = findLineEnd(s);
+        StrCpyNW(line, s, (int)min((DWORD)(end - s) + 1, ARRAYSIZE(line)));
+        StrTrimW(line, L" \t\"");
+        if (!line[0] || line[0] == L'#')
+            continue;
+        if (PathIsDirectoryW(line))
+            k = addFolder(st, line, k);
+        else
+            addImage(st, line, k++);
+    }
+    setMountNames(getDisk(st, first), st->n_disks - first);
+    TRACE_END("images.list");
+    LocalFree(text);
+}
+
+void imageMountName(state* st, PCWCH image, PWCHAR name)
+{
+    if (!st->n_disks)
+        listImages(st);
+    for (DWORD i = 0; i < st->n_disks; i++) {
+        const disk_info* disk = getDisk(st, i);
+        if (disk->image[0] && !lstrcmpiW(disk->image, image)) {
+            StringCchCopyW(name, MAX_DRIVE_PATH, disk->path);
+            return;
+        }
+    }
+    nameFromFile(image, name);
+}
+
+HRESULT listImageParts(disk_info* disk)
+{
+    TRACE_BEGIN("image.partitions");
+    image_file f[1] = { 0 };
+    BYTE* block = LocalAlloc(LMEM_FIXED, TABLE_BLOCK);
+    HRESULT hr = block ? openImageFile(f, disk->image, disk->e_parts) :
+        setError(disk->e_parts, L"Failed to list partitions");
+    if (!hr) {
+        disk->size = f->r->map.size;
+        disk->no_attach = f->r->map.format == IMAGE_RAW;
+        disk->fingerprint = imageFingerprint(f);
+        disk->n_parts = parseTable(readImage, f->r, f->r->map.sector, block, disk->part, MAX_PARTS);
+    }
+    if (!hr && f->error)
+        hr = setReadError(f, disk->e_parts);
+    LocalFree(block);
+    disk->loading = FALSE;
+    TRACE_END("image.partitions");
+    return hr;
+}
+
+DWORD inspectImage(json* j, PCWCH path, err_desc* e)
+{
+    static const PCWCH formats[] = { L"raw", L"vhd-fixed", L"vhd-dynamic", L"vhdx" };
+    image_file f[1] = { 0 };
+    BYTE* block = LocalAlloc(LMEM_FIXED, TABLE_BLOCK + MAX_PARTS * sizeof(part_info));
+    part_info* part = (part_info*)(block + TABLE_BLOCK);
+    if (!block)
+        return setError(e, L"Failed to inspect image");
+
+    // blocks read through the cache, a cold cache in a fresh process
+    const LONG64 before = statGet(STAT_CACHE_READS);
+    const ULONGLONG start = nowUs();
+    const DWORD code = openImageFile(f, path, e);
+    if (code) {
+        LocalFree(block);
+            return code;
+    }
+
+    // partitions are what the tray needs, walking the whole table is for comparison
+    const ULONGLONG opened = nowUs();
+    const DWORD n = parseTable(readImage, f->r, f->r->map.sector, block, part, MAX_PARTS);
+    const ULONGLONG listed = nowUs();
+    const LONG64 reads = statGet(STAT_CACHE_READS) - before;
+    DWORD blocks;
+    const ULONGLONG allocated = imageAllocated(f->r, &blocks);
+    const ULONGLONG walked = nowUs();
+    if (f->error) {
+        const DWORD failed = setReadError(f, e);
+        LocalFree(block);
+            return failed;
+    }
+
+    const image_map* m = &f->r->map;
+    jsonBegin(j, NULL);
+    jsonString(j, "path", path);
+    jsonString(j, "format", formats[m->format]);
+    jsonNumber(j, "size", m->size);
+    jsonNumber(j, "file_size", f->r->file_size);
+    jsonNumber(j, "block_size", m->block);
+    jsonNumber(j, "sector_size", m->sector);
+    jsonNumber(j, "blocks", m->n_blocks);
+    jsonNumber(j, "allocated_blocks", blocks);
+    jsonNumber(j, "allocated", allocated);
+    jsonNumber(j, "open_us", opened - start);
+    jsonNumber(j, "parts_us", listed - opened);
+    jsonNumber(j, "parts_reads", reads);
+    jsonNumber(j, "walk_us", walked - listed);
+    jsonNumber(j, "walk_reads", statGet(STAT_CACHE_READS) - before - reads);
+    jsonBeginArray(j, "parts");
+    for (DWORD i = 0; i < n; i++) {
+        jsonBegin(j, NULL);
+        jsonNumber(j, "index", part[i].index);
+        jsonNumber(j, "partition", part[i].index + 1);
+        jsonNumber(j, "size", part[i].size);
+        jsonString(j, "type", part[i].type);
+        jsonEnd(j);
+    }
+    jsonEndArray(j);
+    jsonEnd(j);
+
+    LocalFree(block);
+    return 0;
+}
+
+// Expected partitions of sample images, see fixtures/make.py
+typedef struct fixture_part {
+    DWORD index;
+    DWORD sectors;
+    PCWCH type;
+} fixture_part;
+
+static const fixture_part MBR_PARTS[] = {
+    {0, 24, L"Linux Native"},
+    {4, 15, L"Linux Native"},
+    {5, 15, L"Linux Swap"},
+    {6, 63, L"Linux LVM"},
+};
+
+static const fixture_part GPT_PARTS[] = {
+    {0, 66, L"GPT: System"},
+    {2, 155, L"GPT: Linux Filesystem"},
+};
+
+static void checkFixture(check* c, PCWCH name, image_format format, DWORD sector,
+    const fixture_part* want, DWORD n_want)
+{
+    WCHAR path[MAX_PATH];
+    if (!fixturePath(c, name, path))
+        return;
+
+    disk_info* disk = LocalAlloc(LPTR, sizeof(*disk));
+    image_file f[1] = { 0 };
+    if (!expect(c, disk != NULL, L"disk info"))
+        return;
+    if (expectNumber(c, openImageFile(f, path, disk->e_parts), 0, name)) {
+        expectNumber(c, f->r->map.format, format, L"image format");
+        expectNumber(c, f->r->map.sector, sector, L"sector size");
+        expect(c, imageFingerprint(f) != 0, L"image fingerprint");
+    }
+    resetErr(disk->e_parts);
+
+    StrCpyNW(disk->image, path, ARRAYSIZE(disk->image));
+    expectNumber(c, listImageParts(disk), 0, L"partitions are listed");
+    expectNumber(c, disk->no_attach, format == IMAGE_RAW, L"raw image is not attached");
+    expect(c, disk->size && disk->fingerprint, L"image size and fingerprint");
+    if (expectNumber(c, disk->n_parts, n_want, L"number of partitions")) {
+        for (DWORD i = 0; i < n_want; i++) {
+            expectNumber(c, disk->part[i].index, want[i].index, L"partition index");
+            expectNumber(c, disk->part[i].size, (ULONGLONG)want[i].sectors * sector, L"partition size");
+            expectText(c, disk->part[i].type, want[i].type, L"partition type");
+        }
+    }
+    resetErr(disk->e_parts);
+    LocalFree(disk);
+}
+
+// Image readers over sample images, from the file to partitions
+void checkImages(check* c)
+{
+    checkFixture(c, L"mbr.img", IMAGE_RAW, 512, MBR_PARTS, ARRAYSIZE(MBR_PARTS));
+    checkFixture(c, L"mbr-fixed.vhd", IMAGE_VHD_FIXED, 512, MBR_PARTS, ARRAYSIZE(MBR_PARTS));
+    checkFixture(c, L"mbr-dynamic.vhd", IMAGE_VHD_DYNAMIC, 512, MBR_PARTS, ARRAYSIZE(MBR_PARTS));
+    checkFixture(c, L"gpt-dynamic.vhd", IMAGE_VHD_DYNAMIC, 512, GPT_PARTS, ARRAYSIZE(GPT_PARTS));
+    checkFixture(c, L"mbr.vhdx", IMAGE_VHDX, 512, MBR_PARTS, ARRAYSIZE(MBR_PARTS));
+    checkFixture(c, L"mbr-4k.vhdx", IMAGE_VHDX, 4096, MBR_PARTS, ARRAYSIZE(MBR_PARTS));
+
+    // payload block is cut off: an error, not an empty disk
+    WCHAR path[MAX_PATH];
+    disk_info* disk = LocalAlloc(LPTR, sizeof(*disk));
+    if (disk && fixturePath(c, L"mbr-truncated.vhdx", path)) {
+        StrCpyNW(disk->image, path, ARRAYSIZE(disk->image));
+        expectNumber(c, listImageParts(disk), ERROR_HANDLE_EOF, L"truncated image");
+        resetErr(disk->e_parts);
+    }
+    LocalFree(disk);
+
+    // the tray and the command line give images the same mount point
+    WCHAR name[MAX_DRIVE_PATH], mnt[MAX_DRIVE_PATH];
+    nameFromFile(L"D:\\vm\\my disk.vhdx", name);
+    partMountName(name, 5, mnt, ARRAYSIZE(mnt));
+    expectText(c, mnt, L"my_diskp5", L"image mount point");
+
+    // images with the same file name, listed in one order and the other
+    static const PCWCH same[] = { L"D:\\a\\disk.vhdx", L"D:\\b\\disk.vhdx", L"D:\\c\\other.vhdx" };
+    disk_info* d = LocalAlloc(LPTR, 2 * ARRAYSIZE(same) * sizeof(*d));
+    if (!expect(c, d != NULL, L"disk info"))
+        return;
+    const DWORD n = ARRAYSIZE(same);
+    for (DWORD i = 0; i < n; i++) {
+        StrCpyNW(d[i].image, same[i], ARRAYSIZE(d[i].image));
+        StrCpyNW(d[n + i].image, same[n - 1 - i], ARRAYSIZE(d[n + i].image));
+        nameFromFile(d[i].image, d[i].path);
+        nameFromFile(d[n + i].image, d[n + i].path);
+    }
+    setMountNames(d, n);
+    setMountNames(d + n, n);
+    expect(c, lstrcmpiW(d[0].path, d[1].path) && StrCmpNIW(d[0].path, L"disk_", 5) == 0,
+        L"same file names get a suffix");
+    for (DWORD i = 0; i < n; i++)
+        expectText(c, d[n + i].path, d[n - 1 - i].path, L"name doesn't depend on order");
+    expectText(c, d[2].path, L"other", L"unique name has no suffix");
+    LocalFree(d);
+}
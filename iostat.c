@@ -0,0 +1,226 @@
+#include "shared.h"
+
+#include <windows.h>
+#include <winioctl.h>
+#include <Shlwapi.h>
+
+// Live I/O rates of attached disks.
+// Every sample pass reads kernel counters of all disks with
+// IOCTL_DISK_PERFORMANCE and stores them into per-disk ring.
+// Rates are computed over the whole ring, so a single slow tick
+// doesn't make numbers jump.
+//
+// Disk handles are not kept between passes: an open handle,
+// even without access rights, may prevent wsl --mount from
+// taking the disk offline.
+
+#define IO_SAMPLES 4 // per disk, must be power of two
+
+typedef struct io_sample {
+    ULONGLONG us;
+    ULONGLONG read;     // bytes
+    ULONGLONG written;
+    ULONGLONG reads;    // operations
+    ULONGLONG writes;
+} io_sample;
+
+typedef struct io_disk {
+    ULONG id; // diskId, 0 if slot is free
+    BOOL seen; // present in the current pass
+    DWORD head; // number of samples ever recorded
+    io_sample s[IO_SAMPLES];
+} io_disk;
+
+static io_disk g_io[MAX_DISKS];
+
+static io_disk* findSlot(ULONG id)
+{
+    io_disk* slot = NULL;
+    for (DWORD i = 0; i < MAX_DISKS; i++) {
+        if (g_io[i].id == id)
+            return &g_io[i];
+        if (!slot && !g_io[i].id)
+            slot = &g_io[i];
+    }
+    if (slot) {
+        slot->id = id;
+        slot->head = 0;
+    }
+    return slot;
+}
+
+static BOOL readCounters(PCWCH path, io_sample* s)
+{
+    HANDLE h = CreateFileW(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, OPEN_EXISTING, 0, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    DISK_PERFORMANCE perf;
+    DWORD n;
+    const BOOL ok = DeviceIoControl(h, IOCTL_DISK_PERFORMANCE,
+        NULL, 0, &perf, sizeof(perf), &n, NULL);
+    CloseHandle(h);
+    if (!ok)
+        return FALSE;
+
+    s->us = nowUs();
+    s->read = perf.BytesRead.QuadPart;
+    s->written = perf.BytesWritten.QuadPart;
+    s->reads = perf.ReadCount;
+    s->writes = perf.WriteCount;
+    return TRUE;
+}
+
+void sampleIo(state* st)
+{
+    const ULONGLONG start = nowUs();
+    TRACE_BEGIN("io.sample");
+
+    for (DWORD i = 0; i < MAX_DISKS; i++)
+        g_io[i].seen = FALSE;
+
+    for (DWORD i = 0; i < st->n_disks; i++) {
+        disk_info* disk = getDisk(st, i);
+        if (disk->image[0])
+            continue; // file, not a device
+        io_disk* d = findSlot(diskId(disk));
+        if (!d)
+            continue;
+
+        d->seen = TRUE;
+        if (readCounters(disk->path, &d->s[d->head & (IO_SAMPLES - 1)]))
+            d->head++;
+        else
+            d->head = 0; // counters are gone, start over
+    }
+
+    // forget disks which went away
+    for (DWORD i = 0; i < MAX_DISKS; i++)
+        if (!g_io[i].seen)
+            g_io[i].id = 0;
+
+    TRACE_END("io.sample");
+    statRecord(HIST_IO_SAMPLE, nowUs() - start);
+}
+
+BOOL getIoRate(const disk_info* disk, io_rate* r)
+{
+    const ULONG id = diskId(disk);
+    const io_disk* d = NULL;
+    for (DWORD i = 0; i < MAX_DISKS && !d; i++)
+        if (g_io[i].id == id)
+            d = &g_io[i];
+    if (!d || d->head < 2)
+        return FALSE;
+
+    const DWORD n = min(d->head, IO_SAMPLES);
+    const io_sample* last = &d->s[(d->head - 1) & (IO_SAMPLES - 1)];
+    const io_sample* first = &d->s[(d->head - n) & (IO_SAMPLES - 1)];
+    const ULONGLONG us = last->us - first->us;
+    if (!us)
+        return FALSE;
+
+    // counters are cumulative, per second values are scaled by 10^6/us
+    r->read_bps = (last->read - first->read) * 1000000 / us;
+    r->write_bps = (last->written - first->written) * 1000000 / us;
+    r->read_iops = (last->reads - first->reads) * 1000000 / us;
+    r->write_iops = (last->writes - first->writes) * 1000000 / us;
+    return TRUE;
+}
+
+static void formatRate(PWCHAR text, DWORD cch, ULONGLONG bps, ULONGLONG iops)
+{
+    // MB/s with one decimal
+    const ULONGLONG tenths = bps * 10 >> 20;
+    wnsprintfW(text, cch, L"%llu.%llu MB/s, %llu IOPS", tenths / 10, tenths % 10, iops);
+}
+
+void formatIoRate(const io_rate* r, PWCHAR text, DWORD cch)
+{
+    WCHAR rd[48], wr[48];
+    formatRate(rd, ARRAYSIZE(rd), r->read_bps, r->read_iops);
+    formatRate(wr, ARRAYSIZE(wr), r->write_bps, r->write_iops);
+    wnsprintfW(text, cch, L"Read %s; write %s", rd, wr);
+}
+
+// Samples of a made-up disk: us, bytes read, written, reads, writes
+static void checkSample(io_disk* d, ULONGLONG us, ULONGLONG read, ULONGLONG written,
+    ULONGLONG reads, ULONGLONG writes)
+{
+    io_sample* s = &d->s[d->head++ & (IO_SAMPLES - 1)];
+    s->us = us;
+    s->read = read;
+    s->written = written;
+    s->reads = reads;
+    s->writes = writes;
+}
+
+static void checkRates(check* c)
+{
+    disk_info disk[1] = { {.path = L"\\\\.\\PHYSICALDRIVE7", .serial = L"IO1"} };
+    io_rate r[1] = { 0 };
+    io_disk* d = findSlot(diskId(disk));
+    if (!expect(c, d != NULL, L"free slot"))
+        return;
+
+    expect(c, !getIoRate(disk, r), L"no rate before samples");
+    checkSample(d, 5000000, 1 << 20, 0, 10, 0);
+    expect(c, !getIoRate(disk, r), L"no rate from one sample");
+    checkSample(d, 5000000, 1 << 20, 0, 10, 0);
+    expect(c, !getIoRate(disk, r), L"no rate over zero time");
+
+    // 8 MB and 100 reads, 1 MB and 4 writes in half a second
+    d->head = 0;
+    checkSample(d, 5000000, 1 << 20, 0, 10, 0);
+    checkSample(d, 5500000, 9 << 20, 1 << 20, 110, 4);
+    if (expect(c, getIoRate(disk, r), L"rate from two samples")) {
+        expectNumber(c, r->read_bps, 16 << 20, L"read bytes per second");
+        expectNumber(c, r->write_bps, 2 << 20, L"written bytes per second");
+        expectNumber(c, r->read_iops, 200, L"reads per second");
+        expectNumber(c, r->write_iops, 8, L"writes per second");
+    }
+
+    // ring keeps the last IO_SAMPLES samples: 3 MB/s, then 1 MB/s
+    d->head = 0;
+    for (DWORD i = 0; i <= 6; i++)
+        checkSample(d, i * 1000000ull, (ULONGLONG)(i < 3 ? i * 3 : 6 + i - 2) << 20, 0, i, 0);
+    if (expect(c, getIoRate(disk, r), L"rate after ring wraps"))
+        expectNumber(c, r->read_bps, 1 << 20, L"rate over the last samples");
+
+    // same slot comes back for the same disk
+    expect(c, findSlot(diskId(disk)) == d, L"slot of known disk");
+}
+
+static void checkFormatRate(check* c)
+{
+    WCHAR text[128];
+    const io_rate idle = { 0 };
+    formatIoRate(&idle, text, ARRAYSIZE(text));
+    expectText(c, text, L"Read 0.0 MB/s, 0 IOPS; write 0.0 MB/s, 0 IOPS", L"idle disk");
+
+    // 1.5 MB/s, and 1 byte short of 2 MB/s which is not rounded up
+    const io_rate busy = { 3 << 19, (2 << 20) - 1, 12, 34567 };
+    formatIoRate(&busy, text, ARRAYSIZE(text));
+    expectText(c, text, L"Read 1.5 MB/s, 12 IOPS; write 1.9 MB/s, 34567 IOPS", L"busy disk");
+
+    const io_rate fast = { 7000ull << 20, 0, 1000000, 0 };
+    formatIoRate(&fast, text, ARRAYSIZE(text));
+    expectText(c, text, L"Read 7000.0 MB/s, 1000000 IOPS; write 0.0 MB/s, 0 IOPS", L"fast disk");
+}
+
+// Uses the sample slots, which nothing fills in headless mode
+void checkIostat(check* c)
+{
+    ZeroMemory(g_io, sizeof(g_io));
+    checkRates(c);
+
+    // table full of other disks, one more gets no slot
+    for (DWORD i = 0; i < MAX_DISKS; i++)
+        g_io[i].id = i + 1;
+    disk_info extra[1] = { {.path = L"\\\\.\\PHYSICALDRIVE99", .serial = L"IO2"} };
+    expect(c, findSlot(diskId(extra)) == NULL, L"no slot when table is full");
+    ZeroMemory(g_io, sizeof(g_io));
+
+    checkFormatRate(c);
+}
@@ -0,0 +1,166 @@
+#include "shared.h"
+
+#include <windows.h>
+
+// Minimal streaming JSON writer.
+// Every top-level value is written as a single line (NDJSON) and
+// handed to WriteFile as soon as it is complete, so consumers see
+// each record immediately. Buffer only batches bytes of one line.
+
+static void jsonFlush(json* j)
+{
+    DWORD n = 0;
+    if (j->n && !j->error && !WriteFile(j->out, j->buf, j->n, &n, NULL))
+        j->error = GetLastError();
+    j->n = 0;
+}
+
+static void jsonPut(json* j, char c)
+{
+    if (j->n == sizeof(j->buf))
+        jsonFlush(j);
+    j->buf[j->n++] = c;
+}
+
+static void jsonPuts(json* j, PCSTR s)
+{
+    while (*s)
+        jsonPut(j, *s++);
+}
+
+static void jsonKey(json* j, PCSTR key)
+{
+    if (j->comma)
+        jsonPut(j, ',');
+    if (key) {
+        jsonPut(j, '"');
+        jsonPuts(j, key);
+        jsonPuts(j, "\":");
+    }
+    j->comma = TRUE;
+}
+
+static void jsonOpen(json* j, PCSTR key, char c)
+{
+    jsonKey(j, key);
+    jsonPut(j, c);
+    j->depth++;
+    j->comma = FALSE;
+}
+
+static void jsonClose(json* j, char c)
+{
+    jsonPut(j, c);
+    j->comma = TRUE;
+    if (--j->depth)
+        return;
+
+    // end of record
+    jsonPut(j, '\n');
+    jsonFlush(j);
+    j->comma = FALSE;
+}
+
+void jsonBegin(json* j, PCSTR key)
+{
+    jsonOpen(j, key, '{');
+}
+
+void jsonEnd(json* j)
+{
+    jsonClose(j, '}');
+}
+
+void jsonBeginArray(json* j, PCSTR key)
+{
+    jsonOpen(j, key, '[');
+}
+
+void jsonEndArray(json* j)
+{
+    jsonClose(j, ']');
+}
+
+static void jsonUtf8(json* j, DWORD c)
+{
+    if (c < 0x80) {
+        jsonPut(j, (char)c);
+    }
+    else if (c < 0x800) {
+        jsonPut(j, (char)(0xC0 | (c >> 6)));
+        jsonPut(j, (char)(0x80 | (c & 0x3F)));
+    }
+    else if (c < 0x10000) {
+        jsonPut(j, (char)(0xE0 | (c >> 12)));
+        jsonPut(j, (char)(0x80 | ((c >> 6) & 0x3F)));
+        jsonPut(j, (char)(0x80 | (c & 0x3F)));
+    }
+    else {
+        jsonPut(j, (char)(0xF0 | (c >> 18)));
+        jsonPut(j, (char)(0x80 | ((c >> 12) & 0x3F)));
+        jsonPut(j, (char)(0x80 | ((c >> 6) & 0x3F)));
+        jsonPut(j, (char)(0x80 | (c & 0x3F)));
+    }
+}
+
+static void jsonEscape(json* j, WCHAR c)
+{
+    static const char hex[] = "0123456789abcdef";
+    jsonPuts(j, "\\u00");
+    jsonPut(j, hex[(c >> 4) & 0xF]);
+    jsonPut(j, hex[c & 0xF]);
+}
+
+void jsonString(json* j, PCSTR key, PCWCH s)
+{
+    jsonKey(j, key);
+    if (!s) {
+        jsonPuts(j, "null");
+        return;
+    }
+
+    jsonPut(j, '"');
+    for (; *s; ++s) {
+        DWORD c = *s;
+        switch (c) {
+        case L'"':  jsonPuts(j, "\\\""); continue;
+        case L'\\': jsonPuts(j, "\\\\"); continue;
+        case L'\n': jsonPuts(j, "\\n"); continue;
+        case L'\r': jsonPuts(j, "\\r"); continue;
+        case L'\t': jsonPuts(j, "\\t"); continue;
+        }
+        if (c < 0x20) {
+            jsonEscape(j, (WCHAR)c);
+            continue;
+        }
+        if (IS_HIGH_SURROGATE(c) && IS_LOW_SURROGATE(s[1])) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (s[1] - 0xDC00);
+            ++s;
+        }
+        else if (c >= 0xD800 && c <= 0xDFFF) {
+            c = 0xFFFD; // lone surrogate
+        }
+        jsonUtf8(j, c);
+    }
+    jsonPut(j, '"');
+}
+
+void jsonNumber(json* j, PCSTR key, ULONGLONG v)
+{
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+
+    jsonKey(j, key);
+    while (n)
+        jsonPut(j, digits[--n]);
+}
+
+void jsonBool(json* j, PCSTR key, BOOL v)
+{
+    jsonKey(j, key);
+    jsonPuts(j, v ? "true" : "false");
+}
@@ -0,0 +1,170 @@
+#include "shared.h"
+
+#include <windows.h>
+#include <winioctl.h>
+
+// Partition table fingerprints.
+// Most volume change events are drive letters coming and going or media
+// checks, the layout stays the same. Disk whose fingerprint didn't change
+// keeps partitions from the previous enumeration, see reuseParts.
+//
+// Partition manager keeps the layout of every disk, reading it needs
+// no access rights and no I/O. Raw table is read only when that fails,
+// or for image files: GPT header keeps CRCs of itself and of the entry
+// array, MBR is hashed along with its chain of extended boot records.
+// Disk list doesn't read raw tables, a sleeping disk would hold it up.
+// Raw reads go through block cache, see cache.c. VHD and VHDX files are
+// read through their block map, so they get the fingerprint of the disk
+// inside.
+
+static const ULONGLONG FNV_BASIS = 14695981039346656037ull;
+
+// Room for 128 entries, what GPT reserves by default
+#define LAYOUT_ENTRIES 128
+
+static ULONGLONG hashLayout(const DRIVE_LAYOUT_INFORMATION_EX* l)
+{
+    ULONGLONG h = hashBytes(FNV_BASIS, &l->PartitionStyle, sizeof(l->PartitionStyle));
+    if (l->PartitionStyle == PARTITION_STYLE_MBR)
+        h = hashBytes(h, &l->Mbr.Signature, sizeof(l->Mbr.Signature));
+    else if (l->PartitionStyle == PARTITION_STYLE_GPT)
+        h = hashBytes(h, &l->Gpt.DiskId, sizeof(l->Gpt.DiskId));
+
+    for (DWORD i = 0; i < l->PartitionCount; i++) {
+        const PARTITION_INFORMATION_EX* p = &l->PartitionEntry[i];
+        // MBR layout always has 4 primary slots, empty ones are type 0
+        if (l->PartitionStyle == PARTITION_STYLE_MBR && !p->Mbr.PartitionType)
+            continue;
+        h = hashBytes(h, &p->StartingOffset, sizeof(p->StartingOffset));
+        h = hashBytes(h, &p->PartitionLength, sizeof(p->PartitionLength));
+        h = hashBytes(h, &p->PartitionNumber, sizeof(p->PartitionNumber));
+        if (l->PartitionStyle == PARTITION_STYLE_MBR)
+            h = hashBytes(h, &p->Mbr.PartitionType, sizeof(p->Mbr.PartitionType));
+        else if (l->PartitionStyle == PARTITION_STYLE_GPT)
+            h = hashBytes(h, &p->Gpt.PartitionType, sizeof(p->Gpt.PartitionType));
+    }
+    return h;
+}
+
+static ULONGLONG layoutFingerprint(PCWCH path)
+{
+    HANDLE h = CreateFileW(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, OPEN_EXISTING, 0, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+        return 0;
+
+    const DWORD cb = sizeof(DRIVE_LAYOUT_INFORMATION_EX) +
+        (LAYOUT_ENTRIES - 1) * sizeof(PARTITION_INFORMATION_EX);
+    DRIVE_LAYOUT_INFORMATION_EX* l = LocalAlloc(LMEM_FIXED, cb);
+    ULONGLONG fp = 0;
+    DWORD n;
+    if (l && DeviceIoControl(h, IOCTL_DISK_GET_DRIVE_LAYOUT_EX, NULL, 0, l, cb, &n, NULL))
+        fp = hashLayout(l);
+    LocalFree(l);
+    CloseHandle(h);
+    return fp;
+}
+
+static BOOL readCached(void* ctx, ULONGLONG offset, void* buf, DWORD size)
+{
+    return cacheRead(ctx, offset, buf, size);
+}
+
+// MBR and its extended boot records address logical sectors. Disk tells
+// their size, a file is an image and its header tells, see openImage.
+// Returns FALSE if it is neither a disk nor a supported image.
+static BOOL openRaw(PCWCH path, image_reader* r)
+{
+    HANDLE h = CreateFileW(path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, OPEN_EXISTING, 0, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    union {
+        DISK_GEOMETRY_EX g;
+        BYTE b[256]; // partition and detection info follow
+    } geo;
+    LARGE_INTEGER size;
+    DWORD n;
+    BOOL ok = FALSE;
+    r->read = readCached;
+    r->ctx = (void*)path;
+    if (DeviceIoControl(h, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, NULL, 0, &geo, sizeof(geo), &n, NULL)) {
+        r->map.format = IMAGE_RAW;
+        r->map.sector = geo.g.Geometry.BytesPerSector;
+        ok = r->map.sector >= 512;
+    }
+    else if (GetFileSizeEx(h, &size)) {
+        r->file_size = size.QuadPart;
+        ok = !openImage(r);
+    }
+    CloseHandle(h);
+    return ok;
+}
+
+static ULONGLONG rawFingerprint(PCWCH path)
+{
+    ULONGLONG fp = 0;
+    image_reader r[1] = { 0 };
+    BYTE* block = LocalAlloc(LMEM_FIXED, TABLE_BLOCK);
+    if (block && openRaw(path, r)) {
+        // image files are read through their block map
+        if (r->file_size)
+            fp = tableFingerprint(readImage, r, r->map.sector, block);
+        else
+            fp = tableFingerprint(readCached, (void*)path, r->map.sector, block);
+    }
+    LocalFree(block);
+    return fp;
+}
+
+ULONGLONG diskFingerprint(PCWCH path, ULONGLONG size, BOOL raw)
+{
+    TRACE_BEGIN("layout.fingerprint");
+    ULONGLONG fp = layoutFingerprint(path);
+    if (!fp && raw)
+        fp = rawFingerprint(path);
+    TRACE_END("layout.fingerprint");
+
+    // 0 means unknown, such disk is always listed again
+    return fp ? hashBytes(fp, &size, sizeof(size)) | 1 : 0;
+}
+
+// Fingerprints of sample images, see fixtures/make.py
+void checkLayout(check* c)
+{
+    WCHAR gpt[MAX_PATH], path[MAX_PATH];
+    if (!fixturePath(c, L"gpt.img", gpt))
+        return;
+
+    const ULONGLONG fp = diskFingerprint(gpt, 0, TRUE);
+    expect(c, fp != 0, L"GPT image has fingerprint");
+    expectNumber(c, diskFingerprint(gpt, 0, TRUE), fp, L"same table, same fingerprint");
+    expect(c, diskFingerprint(gpt, 1, TRUE) != fp, L"disk size is part of fingerprint");
+    // a file has no layout in partition manager, only raw reads tell
+    expectNumber(c, diskFingerprint(gpt, 0, FALSE), 0, L"no raw reads without raw");
+    if (fixturePath(c, L"gpt-resized.img", path))
+        expect(c, diskFingerprint(path, 0, TRUE) != fp, L"resized GPT partition");
+    if (fixturePath(c, L"gpt-4k.img", path))
+        expect(c, diskFingerprint(path, 0, TRUE) != 0, L"GPT with 4K sectors");
+
+    WCHAR mbr[MAX_PATH];
+    if (fixturePath(c, L"mbr.img", mbr)) {
+        const ULONGLONG m = diskFingerprint(mbr, 0, TRUE);
+        expect(c, m != 0 && m != fp, L"MBR image has fingerprint");
+        if (fixturePath(c, L"mbr-logical.img", path))
+            expect(c, diskFingerprint(path, 0, TRUE) != m, L"changed logical partition");
+        if (fixturePath(c, L"mbr.vhdx", path))
+            expectNumber(c, diskFingerprint(path, 0, TRUE), m, L"VHDX has fingerprint of its disk");
+    }
+
+    // extended boot records are found only if their LBAs count in 4K sectors
+    WCHAR mbr4k[MAX_PATH];
+    if (fixturePath(c, L"mbr-4k.vhdx", mbr4k) && fixturePath(c, L"mbr-4k-logical.vhdx", path)) {
+        const ULONGLONG m = diskFingerprint(mbr4k, 0, TRUE);
+        expect(c, m != 0, L"MBR with 4K sectors has fingerprint");
+        expect(c, diskFingerprint(path, 0, TRUE) != m, L"changed logical partition, 4K sectors");
+    }
+    if (fixturePath(c, L"blank.img", path))
+        expectNumber(c, diskFingerprint(path, 0, TRUE), 0, L"no partition table");
+}
@@ -6,16 +6,12 @@
 #include <shlwapi.h>
 #include <strsafe.h>
 
-#define MAX_CMD (MAX_DISKS * MAX_PARTS)
-
-enum {
-    APP_NOTIFY = WM_APP + 1, // Tray icon notification callback message
-    MENU_EXIT = 40001,
-    MENU_COPY = 41000,
-    MENU_MOUNT = 42000,
-    MENU_UNMOUNT = 43000,
-    MENU_PART = 44000,
-};
+// Unmount all deadlines: user can wait, shutdown and sleep can't
+static const DWORD EJECT_MENU_MS = 30000;
+static const DWORD EJECT_SESSION_MS = 10000;
+static const DWORD EJECT_SUSPEND_MS = 2000;
+static const DWORD EJECT_POLL_MS = 50; // while menu eject finishes
+
 // Tray icon will be identified by guid
 static const GUID GUID_NOTIFY = {
     0xd9cbd4ab,
@@ -24,8 +20,6 @@ static const GUID GUID_NOTIFY = {
     { 0xb2, 0xf, 0xfc, 0xe3, 0x7e, 0x80, 0xd7, 0xb3 }
 };
 
-static const WCHAR* WSL_PATH = L"C:\\Windows\\System32\\wsl.exe";
-static const UINT DISK_POLL_MS = 500;
 
 #define NIDINIT(name, hwnd) {       \
         .cbSize = sizeof(name),     \
@@ -51,12 +45,14 @@ static HMENU getMenu(HWND hwnd)
     return getState(hwnd)->menu;
 }
 
+static const shell_backend* getShell(HWND hwnd);
+
 static HINSTANCE getInst(HWND hwnd)
 {
     return (HINSTANCE)GetWindowLongPtrW(hwnd, GWLP_HINSTANCE);
 }
 
-static BOOL showNotify(HWND hwnd, PCWCH text, PCWCH title, DWORD niif)
+static BOOL notifyTray(HWND hwnd, PCWCH text, PCWCH title, DWORD niif)
 {
     NOTIFYICONDATA nid = NIDINIT(nid, hwnd);
     nid.uFlags |= NIF_INFO;
@@ -67,6 +63,11 @@ static BOOL showNotify(HWND hwnd, PCWCH text, PCWCH title, DWORD niif)
     return Shell_NotifyIconW(NIM_MODIFY, &nid);
 }
 
+static BOOL showNotify(HWND hwnd, PCWCH text, PCWCH title, DWORD niif)
+{
+    return getShell(hwnd)->notify(hwnd, text, title, niif);
+}
+
 static BOOL showWarning(HWND hwnd, PCWCH text, PCWCH title)
 {
     return showNotify(hwnd, text, title, NIIF_WARNING);
@@ -90,7 +91,26 @@ static void removeTrayIcon(HWND hwnd)
     Shell_NotifyIconW(NIM_DELETE, &nid);
 }
 
-static void showContextMenu(HWND hwnd)
+static void fillDiagMenu(HMENU menu)
+{
+    WCHAR text[128];
+    while (DeleteMenu(menu, 0, MF_BYPOSITION));
+
+    for (DWORD h = 0; h < HIST_COUNT; h++) {
+        formatHist(h, text, ARRAYSIZE(text));
+        AppendMenuW(menu, MF_STRING | MF_DISABLED, 0, text);
+    }
+    AppendMenuW(menu, MF_SEPARATOR, 0, NULL);
+    for (DWORD c = 0; c < STAT_COUNTERS; c++) {
+        formatCounter(c, text, ARRAYSIZE(text));
+        AppendMenuW(menu, MF_STRING | MF_DISABLED, 0, text);
+    }
+    AppendMenuW(menu, MF_SEPARATOR, 0, NULL);
+    AppendMenuW(menu, MF_STRING, MENU_STATS, L"&Export statistics");
+    AppendMenuW(menu, MF_STRING, MENU_TRACE, L"Dump &trace");
+}
+
+static void trackMenu(HWND hwnd, HMENU menu)
 {
     POINT pt;
     GetCursorPos(&pt);
@@ -104,7 +124,14 @@ static void showContextMenu(HWND hwnd)
     else
         flags |= TPM_LEFTALIGN;
 
-    TrackPopupMenuEx(getMenu(hwnd), flags, pt.x, pt.y, hwnd, NULL);
+    TrackPopupMenuEx(menu, flags, pt.x, pt.y, hwnd, NULL);
+}
+
+static void showContextMenu(HWND hwnd)
+{
+    // numbers in diagnostics may be stale since the menu was created
+    fillDiagMenu(getState(hwnd)->diag);
+    getShell(hwnd)->popup(hwnd, getMenu(hwnd));
 }
 
 static DWORD onWslRunAs(HWND hwnd, DWORD exitCode)
@@ -126,32 +153,112 @@ static void onWslRunFailure(HWND hwnd, DWORD code)
     resetErr(e);
 }
 
-static DWORD runWslAs(HWND hwnd, WCHAR* cmd)
+// Elevated wsl --mount, runs on a worker: UAC prompt and mounting
+// may take seconds and the tray must stay responsive meanwhile.
+typedef struct mount_task {
+    HWND hwnd;
+    BOOL ran;       // wsl.exe was started and exitCode is valid
+    BOOL open;      // open partition in Explorer when mounted
+    DWORD error;    // ShellExecuteEx failure
+    DWORD exitCode;
+    WCHAR disk[MAX_PATH]; // device path or image file
+    WCHAR cmd[MAX_PATH + 96];
+    WCHAR mnt[MAX_PATH]; // \\wsl$ path of partition, empty for --bare
+} mount_task;
+
+static BOOL directoryExists(const WCHAR *path)
+{
+    TRACE_BEGIN("wsl.probe");
+    DWORD dwAttrib = GetFileAttributesW(path);
+    TRACE_END("wsl.probe");
+
+    return (dwAttrib != INVALID_FILE_ATTRIBUTES &&
+        (dwAttrib & FILE_ATTRIBUTE_DIRECTORY));
+}
+
+// ShellExecuteEx, waits for the program if exitCode is wanted
+static DWORD executeShell(HWND hwnd, PCWCH verb, PCWCH file, PCWCH args, DWORD* exitCode)
 {
     SHELLEXECUTEINFO sei = {
         .cbSize = sizeof(sei),
-        .fMask = SEE_MASK_NOCLOSEPROCESS,
-        .lpVerb = L"runas",
-        .lpFile = WSL_PATH,
-        .lpParameters = cmd,
+        .fMask = exitCode ? SEE_MASK_NOCLOSEPROCESS : 0,
+        .lpVerb = verb,
+        .lpFile = file,
+        .lpParameters = args,
         .hwnd = hwnd,
         .nShow = SW_NORMAL,
     };
-    if (ShellExecuteExW(&sei)) {
-        HANDLE proc = sei.hProcess;
-        WaitForSingleObject(proc, INFINITE);
-        DWORD exitCode = 1;
-        GetExitCodeProcess(proc, &exitCode);
-        CloseHandle(proc);
+    if (!ShellExecuteExW(&sei))
+        return GetLastError();
+    if (!exitCode)
+        return 0;
+
+    HANDLE proc = sei.hProcess;
+    WaitForSingleObject(proc, INFINITE);
+    *exitCode = 1;
+    GetExitCodeProcess(proc, exitCode);
+    CloseHandle(proc);
+    return 0;
+}
+
+static void runWslAs(mount_task* t)
+{
+    // includes time spent in UAC prompt
+    const ULONGLONG start = nowUs();
+    TRACE_BEGIN("wsl.runas");
+    t->error = getShell(t->hwnd)->execute(t->hwnd, L"runas", WSL_PATH, t->cmd, &t->exitCode);
+    TRACE_END("wsl.runas");
+    if (t->error)
+        return;
+    statRecord(HIST_WSL_RUNAS, nowUs() - start);
+    t->ran = TRUE;
+}
+
+static void runMountTask(void* arg)
+{
+    mount_task* t = arg;
+    const shell_backend* shell = getShell(t->hwnd);
+    // partition may be mounted already, e.g. by another instance
+    if (!t->mnt[0] || !shell->exists(t->mnt))
+        runWslAs(t);
+    if (t->error || t->exitCode || !t->open)
+        return;
+
+    shell->execute(t->hwnd, L"open", t->mnt, NULL, NULL);
+}
+
+static void onMountDone(void* arg)
+{
+    mount_task* t = arg;
+    HWND hwnd = t->hwnd;
+    state* st = getState(hwnd);
 
-        return onWslRunAs(hwnd, exitCode);
+    if (t->ran)
+        statAdd(t->exitCode ? STAT_MOUNT_FAILED : STAT_MOUNT_OK, 1);
+    if (t->error) {
+        if (t->error != ERROR_CANCELLED) {
+            statAdd(STAT_MOUNT_FAILED, 1);
+            onWslRunFailure(hwnd, t->error);
+        }
     }
-    else {
-        DWORD code = GetLastError();
-        if (code != ERROR_CANCELLED)
-            onWslRunFailure(hwnd, code);
-        return code;
+    else if (!onWslRunAs(hwnd, t->exitCode)) {
+        trackMount(st->mounted, t->disk);
+        st->usage_us = 0;
     }
+    LocalFree(t);
+}
+
+static void submitMount(HWND hwnd, PCWCH disk, PCWCH cmd, PCWCH mnt, BOOL open)
+{
+    mount_task* t = LocalAlloc(LPTR, sizeof(*t));
+    if (!t)
+        return;
+    t->hwnd = hwnd;
+    t->open = open;
+    StrCpyNW(t->disk, disk, ARRAYSIZE(t->disk));
+    StrCpyNW(t->cmd, cmd, ARRAYSIZE(t->cmd));
+    StrCpyNW(t->mnt, mnt, ARRAYSIZE(t->mnt));
+    submitTask(TASK_HIGH, runMountTask, onMountDone, t);
 }
 
 static void closeIfOpen(HANDLE* ph)
@@ -184,67 +291,144 @@ static void openStdHandles(STARTUPINFO* si, HANDLE* pout)
     si->dwFlags |= STARTF_USESTDHANDLES;
 }
 
-typedef DWORD (*cmd_cb)(HWND hwnd, DWORD exitCode, const WCHAR* text, DWORD cch);
+// wsl.exe own messages are UTF-16, but commands run with -e print UTF-8.
+// UTF-8 text has no zero bytes, while UTF-16 has them at least in line breaks.
+static DWORD decodeOutput(PWCHAR text, DWORD bytes, DWORD cch)
+{
+    const char* raw = (const char*)text;
+    DWORD zero = bytes;
+    for (DWORD i = 0; i < bytes && zero == bytes; i++)
+        if (!raw[i])
+            zero = i;
+    if (zero < bytes && !(bytes & 1))
+        return bytes / sizeof(WCHAR);
+
+    char* copy = LocalAlloc(LMEM_FIXED, bytes);
+    if (!copy)
+        return 0;
+    for (DWORD i = 0; i < bytes; i++)
+        copy[i] = raw[i];
+    cch = utf8ToUtf16(copy, bytes, text, cch);
+    LocalFree(copy);
+    return cch;
+}
+
+// wsl.exe run on a worker, output is handed to callback on UI thread
+typedef struct wsl_task wsl_task;
+typedef void (*cmd_cb)(const wsl_task* t);
+
+struct wsl_task {
+    HWND hwnd;
+    cmd_cb cb;
+    DWORD error;    // CreateProcess failure
+    DWORD exitCode;
+    DWORD cch;
+    BOOL cut; // output didn't fit in text
+    WCHAR disk[MAX_PATH]; // disk the command is about, if any
+    WCHAR cmd[MAX_PATH + 64];
+    DWORD cap;
+    PWCHAR text; // cap characters, allocated along with the task
+};
+
+#define WSL_TEXT 1024
+// df prints a header and a line per mount point
+#define USAGE_TEXT ((MAX_USAGE + 1) * 160)
 
-static DWORD execWslAndThen(HWND hwnd, WCHAR* cmd, cmd_cb cb)
+// wsl.exe with args, decoded output is left in text
+static DWORD execWsl(PCWCH args, PWCHAR text, DWORD cch, DWORD* n, BOOL* cut, DWORD* exitCode)
 {
     PROCESS_INFORMATION pi;
     HANDLE out = 0;
     STARTUPINFO si = { .cb = sizeof(si), };
     // command line must start with executable name
-    WCHAR text[1024];
-    wnsprintfW(text, ARRAYSIZE(text), L"wsl.exe %s", cmd);
-    cmd = text;
+    wnsprintfW(text, cch, L"wsl.exe %s", args);
 
+    const ULONGLONG start = nowUs();
+    TRACE_BEGIN("wsl.exec");
     openStdHandles(&si, &out);
+    TRACE_BEGIN("wsl.spawn");
     if (!CreateProcessW(WSL_PATH,
-        cmd, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi))
+        text, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi))
     {
-        onWslRunFailure(hwnd, GetLastError());
+        const DWORD error = GetLastError();
+        TRACE_END("wsl.spawn");
+        TRACE_END("wsl.exec");
         closeStdHandles(&si, &out);
-        return ~0u;
+        return error;
     }
+    TRACE_END("wsl.spawn");
+    statRecord(HIST_WSL_SPAWN, nowUs() - start);
     closeIfOpen(&si.hStdOutput);
 
     BYTE* buf = (BYTE*)text;
     BYTE* p = buf;
-    DWORD sz = sizeof(text) - sizeof(WCHAR);
+    DWORD sz = (cch - 1) * sizeof(WCHAR);
     do {
-        DWORD n;
-        if (!ReadFile(out, p, sz, &n, NULL))
+        DWORD got;
+        if (!ReadFile(out, p, sz, &got, NULL))
             break;
-        sz -= n;
-        p += n;
+        sz -= got;
+        p += got;
     } while (sz);
     closeIfOpen(&out);
     WaitForSingleObject(pi.hProcess, INFINITE);
 
-    DWORD exitCode = 1;
-    GetExitCodeProcess(pi.hProcess, &exitCode);
+    *exitCode = 1;
+    GetExitCodeProcess(pi.hProcess, exitCode);
     CloseHandle(pi.hProcess);
     CloseHandle(pi.hThread);
     closeStdHandles(&si, &out);
 
-    const DWORD cch = (DWORD)(p - buf) / sizeof(WCHAR);
-    text[cch] = 0;
+    *n = decodeOutput(text, (DWORD)(p - buf), cch - 1);
+    text[*n] = 0;
+    *cut = !sz || *n == cch - 1;
+    TRACE_END("wsl.exec");
+    statRecord(HIST_WSL_EXIT, nowUs() - start);
+    return 0;
+}
 
-    return cb(hwnd, exitCode, text, cch);
+static void runWslTask(void* arg)
+{
+    wsl_task* t = arg;
+    t->error = getShell(t->hwnd)->wsl(t->cmd, t->text, t->cap, &t->cch, &t->cut, &t->exitCode);
 }
 
-static DWORD onWslExit(HWND hwnd, DWORD exitCode, const WCHAR* text, DWORD cch)
+static void onWslTaskDone(void* arg)
 {
-    UNREFERENCED_PARAMETER(cch);
-    if (exitCode) {
-        WCHAR title[128];
-        wnsprintfW(title, ARRAYSIZE(title), L"wsl.exe exit code: %d", exitCode);
-        showWarning(hwnd, text, title);
+    wsl_task* t = arg;
+    if (t->error)
+        onWslRunFailure(t->hwnd, t->error);
+    else
+        t->cb(t);
+    LocalFree(t);
+}
+
+// Output of up to cap characters is kept
+static void execWslAndThen(HWND hwnd, PCWCH cmd, PCWCH disk, cmd_cb cb, task_priority prio,
+    DWORD cap)
+{
+    wsl_task* t = LocalAlloc(LPTR, sizeof(*t) + cap * sizeof(WCHAR));
+    if (!t) {
+        onWslRunFailure(hwnd, GetLastError());
+        return;
     }
-    return exitCode;
+    t->hwnd = hwnd;
+    t->cb = cb;
+    t->cap = cap;
+    t->text = (PWCHAR)(t + 1);
+    StrCpyNW(t->cmd, cmd, ARRAYSIZE(t->cmd));
+    if (disk)
+        StrCpyNW(t->disk, disk, ARRAYSIZE(t->disk));
+    submitTask(prio, runWslTask, onWslTaskDone, t);
 }
 
-static void execWsl(HWND hwnd, WCHAR* cmd)
+static void onWslExit(const wsl_task* t)
 {
-    execWslAndThen(hwnd, cmd, onWslExit);
+    if (t->exitCode) {
+        WCHAR title[128];
+        wnsprintfW(title, ARRAYSIZE(title), L"wsl.exe exit code: %d", t->exitCode);
+        showWarning(t->hwnd, t->text, title);
+    }
 }
 
 static void onMountClicked(HWND hwnd, DWORD i)
@@ -252,21 +436,13 @@ static void onMountClicked(HWND hwnd, DWORD i)
     state* st = getState(hwnd);
     disk_info* disk = getDisk(st, i);
 
-    WCHAR cmd[MAX_PATH];
-    wnsprintfW(cmd, ARRAYSIZE(cmd), L"--mount \"%s\" --bare", disk->path);
-
-    runWslAs(hwnd, cmd);
-}
-
-static BOOL directoryExists(const WCHAR *path)
-{
-    DWORD dwAttrib = GetFileAttributesW(path);
-
-    return (dwAttrib != INVALID_FILE_ATTRIBUTES &&
-        (dwAttrib & FILE_ATTRIBUTE_DIRECTORY));
+    WCHAR cmd[MAX_PATH + 96];
+    wnsprintfW(cmd, ARRAYSIZE(cmd), L"--mount %s\"%s\" --bare",
+        disk->image[0] ? L"--vhd " : L"", diskDevice(disk));
+    submitMount(hwnd, diskDevice(disk), cmd, L"", FALSE);
 }
 
-static void onPartClicked(HWND hwnd, DWORD n)
+static void mountPart(HWND hwnd, DWORD n, BOOL open)
 {
     state* st = getState(hwnd);
     DWORD i = n / MAX_PARTS;
@@ -274,30 +450,35 @@ static void onPartClicked(HWND hwnd, DWORD n)
     disk_info* disk = getDisk(st, i);
     part_info* part = getPart(disk, j);
     DWORD p = part->index + 1;
-    WCHAR path[MAX_PATH];
+    WCHAR name[MAX_DRIVE_PATH];
+    partMountName(disk->path, p, name, ARRAYSIZE(name));
 
-    const WCHAR* name = NULL;
-    for (const WCHAR* c = disk->path; *c; ++c)
-        if (*c == L'\\')
-            name = c + 1;
-
-    wnsprintfW(path, ARRAYSIZE(path), L"\\\\wsl$\\%s\\mnt\\wsl\\%sp%u", st->dist, name, p);
-    if (!directoryExists(path)) {
-        WCHAR cmd[MAX_PATH];
+    WCHAR path[MAX_PATH];
+    wnsprintfW(path, ARRAYSIZE(path), L"\\\\wsl$\\%s\\mnt\\wsl\\%s", st->dist, name);
+    WCHAR cmd[MAX_PATH + 96];
+    if (disk->image[0])
+        // name keeps the mount point the same as for physical disks
+        wnsprintfW(cmd, ARRAYSIZE(cmd), L"--mount --vhd \"%s\" --partition %u --name %s",
+            disk->image, p, name);
+    else
         wnsprintfW(cmd, ARRAYSIZE(cmd), L"--mount %s --partition %u", disk->path, p);
+    submitMount(hwnd, diskDevice(disk), cmd, path, open);
+}
 
-        if (runWslAs(hwnd, cmd) != 0)
-            return;
-    }
+static void onPartClicked(HWND hwnd, DWORD n)
+{
+    mountPart(hwnd, n, TRUE);
+}
 
-    SHELLEXECUTEINFO sei = {
-        .cbSize = sizeof(sei),
-        .lpVerb = L"open",
-        .lpFile = path,
-        .hwnd = hwnd,
-        .nShow = SW_NORMAL,
-    };
-    ShellExecuteExW(&sei);
+static void onUnmountExit(const wsl_task* t)
+{
+    onWslExit(t);
+    statAdd(t->exitCode ? STAT_UNMOUNT_FAILED : STAT_UNMOUNT_OK, 1);
+    if (!t->exitCode) {
+        state* st = getState(t->hwnd);
+        untrackMount(st->mounted, t->disk);
+        st->usage_us = 0;
+    }
 }
 
 static void onUnmountClicked(HWND hwnd, DWORD i)
@@ -305,20 +486,209 @@ static void onUnmountClicked(HWND hwnd, DWORD i)
     state* st = getState(hwnd);
     disk_info* disk = getDisk(st, i);
 
-    WCHAR cmd[MAX_PATH];
-    wnsprintfW(cmd, ARRAYSIZE(cmd), L"--unmount %s", disk->path);
+    WCHAR cmd[MAX_PATH + 32];
+    wnsprintfW(cmd, ARRAYSIZE(cmd), L"--unmount \"%s\"", diskDevice(disk));
+    execWslAndThen(hwnd, cmd, diskDevice(disk), onUnmountExit, TASK_HIGH, WSL_TEXT);
+}
 
-    execWsl(hwnd, cmd);
+// Menu eject works on a copy of mount list, so mounts and unmounts
+// finishing meanwhile don't race with it. Only one runs at a time.
+typedef struct eject_task {
+    HWND hwnd;
+    HANDLE finished; // set by worker when eject returns
+    BOOL applied; // detached disks are dropped from state
+    DWORD failed;
+    mount_list asked[1]; // what was mounted when it started
+    mount_list m[1]; // what is still mounted
+    WCHAR report[256];
+} eject_task;
+
+static void runEjectTask(void* arg)
+{
+    eject_task* t = arg;
+    t->failed = getShell(t->hwnd)->eject(t->m, EJECT_MENU_MS, t->report, ARRAYSIZE(t->report));
+    SetEvent(t->finished);
 }
 
-static void copyToClipboard(HGLOBAL hdst)
+// Forget disks which were detached, ejectAll dropped them from the copy.
+// Disks mounted after eject started are not touched.
+static void applyEject(state* st, eject_task* t)
+{
+    if (t->applied)
+        return;
+    t->applied = TRUE;
+    mount_list* m = st->mounted;
+    for (DWORD i = m->n; i-- > 0;)
+        if (isMounted(t->asked, m->path[i]) && !isMounted(t->m, m->path[i]))
+            untrackMount(m, m->path[i]);
+    st->usage_us = 0;
+}
+
+static void onEjectDone(void* arg)
+{
+    eject_task* t = arg;
+    state* st = getState(t->hwnd);
+    applyEject(st, t);
+    st->eject = NULL;
+    CloseHandle(t->finished);
+
+    if (t->failed)
+        showWarning(t->hwnd, t->report, L"Some disks are still mounted");
+    else
+        showNotify(t->hwnd, L"All disks are unmounted", L"Unmount all", NIIF_INFO);
+    LocalFree(t);
+}
+
+static void onEjectClicked(HWND hwnd)
+{
+    state* st = getState(hwnd);
+    if (st->eject) {
+        showNotify(hwnd, L"Disks are being unmounted already", L"Unmount all", NIIF_INFO);
+        return;
+    }
+    if (!st->mounted->n) {
+        showNotify(hwnd, L"No disks were mounted by wsldskmnt", L"Unmount all", NIIF_INFO);
+        return;
+    }
+
+    eject_task* t = LocalAlloc(LPTR, sizeof(*t));
+    if (!t)
+        return;
+    t->finished = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!t->finished) {
+        LocalFree(t);
+        return;
+    }
+    t->hwnd = hwnd;
+    *t->asked = *st->mounted;
+    *t->m = *st->mounted;
+    st->eject = t;
+    submitTask(TASK_HIGH, runEjectTask, onEjectDone, t);
+}
+
+// Shutdown and sleep eject right away on UI thread. If menu eject is
+// running, its disks must not be unmounted twice at the same time:
+// wait for it, then take over what is left. Returns FALSE if it is
+// still running, its own deadline covers its disks then.
+static BOOL finishEject(state* st, DWORD timeout_ms)
+{
+    eject_task* t = st->eject;
+    if (!t)
+        return TRUE;
+
+    // simulation runs tasks on virtual time, it must not block for real
+    for (DWORD waited = 0; WaitForSingleObject(t->finished, 0) == WAIT_TIMEOUT; waited += EJECT_POLL_MS) {
+        if (waited >= timeout_ms)
+            return FALSE;
+        simSleep(EJECT_POLL_MS);
+    }
+    applyEject(st, t);
+    return TRUE;
+}
+
+// Give WSL a chance to detach disks before the VM is killed.
+// Windows waits for the answer, so this one runs right here.
+static LRESULT onQueryEndSession(HWND hwnd)
+{
+    state* st = getState(hwnd);
+    if (st->mounted->n) {
+        WCHAR report[256];
+        ShutdownBlockReasonCreate(hwnd, L"Unmounting disks from WSL");
+        if (finishEject(st, EJECT_SESSION_MS))
+            getShell(hwnd)->eject(st->mounted, EJECT_SESSION_MS, report, ARRAYSIZE(report));
+        ShutdownBlockReasonDestroy(hwnd);
+    }
+    return TRUE; // never block shutdown
+}
+
+static LRESULT onPowerBroadcast(HWND hwnd, WPARAM event)
+{
+    state* st = getState(hwnd);
+    if (event != PBT_APMSUSPEND || !st->mounted->n)
+        return TRUE;
+
+    // system sleeps as soon as this returns, so no task either
+    WCHAR report[256];
+    if (!finishEject(st, EJECT_SUSPEND_MS))
+        return TRUE;
+    const DWORD failed = getShell(hwnd)->eject(st->mounted, EJECT_SUSPEND_MS, report, ARRAYSIZE(report));
+    st->usage_us = 0;
+    // shown after resume
+    if (failed)
+        showWarning(hwnd, report, L"Disks not unmounted before sleep");
+    return TRUE;
+}
+
+typedef struct bench_task {
+    HWND hwnd;
+    DWORD error;
+    WCHAR args[MAX_PATH + 64];
+} bench_task;
+
+static void runBenchTask(void* arg)
+{
+    bench_task* t = arg;
+    t->error = getShell(t->hwnd)->execute(t->hwnd, L"runas", L"cmd.exe", t->args, NULL);
+}
+
+static void onBenchDone(void* arg)
 {
-    if (!OpenClipboard(NULL))
+    bench_task* t = arg;
+    if (t->error && t->error != ERROR_CANCELLED) {
+        err_desc e[1] = { ERRINIT() };
+        setErrorCode(e, L"Failed to start benchmark", t->error);
+        showWarning(t->hwnd, e->text, e->title);
+        resetErr(e);
+    }
+    LocalFree(t);
+}
+
+// Benchmark needs raw disk access, so run CLI elevated in own console.
+// cmd /k keeps the window with results open.
+static void runBench(HWND hwnd, DWORD i, DWORD partition)
+{
+    state* st = getState(hwnd);
+    if (i >= st->n_disks)
         return;
 
-    EmptyClipboard();
-    SetClipboardData(CF_UNICODETEXT, hdst);
-    CloseClipboard();
+    bench_task* t = LocalAlloc(LPTR, sizeof(*t));
+    if (!t)
+        return;
+    WCHAR exe[MAX_PATH];
+    GetModuleFileNameW(NULL, exe, ARRAYSIZE(exe));
+    t->hwnd = hwnd;
+    // without partition number bench-disk reads the whole disk
+    if (partition)
+        wnsprintfW(t->args, ARRAYSIZE(t->args), L"/k \"\"%s\" bench-disk %s %u\"",
+            exe, getDisk(st, i)->path, partition);
+    else
+        wnsprintfW(t->args, ARRAYSIZE(t->args), L"/k \"\"%s\" bench-disk %s\"",
+            exe, getDisk(st, i)->path);
+    submitTask(TASK_HIGH, runBenchTask, onBenchDone, t);
+}
+
+static void onBenchClicked(HWND hwnd, DWORD i)
+{
+    runBench(hwnd, i, 0);
+}
+
+static void onBenchPartClicked(HWND hwnd, DWORD n)
+{
+    state* st = getState(hwnd);
+    const DWORD i = n / MAX_PARTS;
+    if (i < st->n_disks)
+        runBench(hwnd, i, getPart(getDisk(st, i), n % MAX_PARTS)->index + 1);
+}
+
+static void copyToClipboard(HGLOBAL hdst)
+{
+    TRACE_BEGIN("clipboard");
+    if (OpenClipboard(NULL)) {
+        EmptyClipboard();
+        SetClipboardData(CF_UNICODETEXT, hdst);
+        CloseClipboard();
+    }
+    TRACE_END("clipboard");
 }
 
 static void onCopyClicked(HWND hwnd, DWORD i)
@@ -326,14 +696,14 @@ static void onCopyClicked(HWND hwnd, DWORD i)
     state* st = getState(hwnd);
     disk_info* disk = getDisk(st, i);
 
-    const int cch = lstrlenW(disk->path) + 1;
+    const int cch = lstrlenW(diskDevice(disk)) + 1;
     HGLOBAL hdst = GlobalAlloc(GMEM_MOVEABLE, cch * sizeof(WCHAR));
     if (!hdst)
         return;
 
     PWSTR dst = (LPWSTR)GlobalLock(hdst);
     if (dst) {
-        StringCchCopyW(dst, cch, disk->path);
+        StringCchCopyW(dst, cch, diskDevice(disk));
         GlobalUnlock(hdst);
 
         copyToClipboard(hdst);
@@ -341,6 +711,24 @@ static void onCopyClicked(HWND hwnd, DWORD i)
     GlobalFree(hdst);
 }
 
+static void saveDiagnostics(HWND hwnd, PCWCH name, DWORD (*save)(PCWCH path))
+{
+    WCHAR path[MAX_PATH];
+    GetTempPathW(ARRAYSIZE(path), path);
+    PathAppendW(path, name);
+
+    const DWORD code = save(path);
+    if (!code) {
+        showNotify(hwnd, path, L"Diagnostics saved", NIIF_INFO);
+        return;
+    }
+
+    err_desc e[1] = { ERRINIT() };
+    setErrorCode(e, L"Failed to save diagnostics", code);
+    showWarning(hwnd, e->text, e->title);
+    resetErr(e);
+}
+
 static LRESULT onMenuCommand(HWND hwnd, WPARAM wparam, LPARAM lparam)
 {
     typedef struct {
@@ -353,6 +741,8 @@ static LRESULT onMenuCommand(HWND hwnd, WPARAM wparam, LPARAM lparam)
         {MENU_MOUNT,    onMountClicked},
         {MENU_UNMOUNT,  onUnmountClicked},
         {MENU_PART,     onPartClicked},
+        {MENU_BENCH,    onBenchClicked},
+        {MENU_BENCH_PART, onBenchPartClicked},
         {0, NULL}
     };
 
@@ -362,6 +752,15 @@ static LRESULT onMenuCommand(HWND hwnd, WPARAM wparam, LPARAM lparam)
     case MENU_EXIT:
         DestroyWindow(hwnd);
         return 0;
+    case MENU_TRACE:
+        saveDiagnostics(hwnd, L"wsldskmnt-trace.json", dumpTrace);
+        return 0;
+    case MENU_STATS:
+        saveDiagnostics(hwnd, L"wsldskmnt-stats.json", exportStats);
+        return 0;
+    case MENU_EJECT:
+        onEjectClicked(hwnd);
+        return 0;
     default:
         for (const dispatch* d = table; d->cmd; ++d) {
             if (cmd >= d->cmd && cmd < d->cmd + MAX_CMD) {
@@ -373,6 +772,87 @@ static LRESULT onMenuCommand(HWND hwnd, WPARAM wparam, LPARAM lparam)
     }
 }
 
+static const fs_usage* findUsage(const state* st, const disk_info* disk, const part_info* part)
+{
+    WCHAR mnt[MAX_DRIVE_PATH];
+    partMountName(disk->path, part->index + 1, mnt, ARRAYSIZE(mnt));
+    for (DWORD i = 0; i < st->n_usage; i++)
+        if (!lstrcmpiW(st->usage[i].name, mnt))
+            return &st->usage[i];
+    return NULL;
+}
+
+static void formatPartLabel(const state* st, const disk_info* disk, const part_info* part,
+    PWCHAR text, DWORD cch)
+{
+    WCHAR letter[8] = L"";
+    if (part->letter)
+        wnsprintfW(letter, 8, L" (%c)", part->letter);
+
+    WCHAR size[32];
+    formatSize(part->size, size, ARRAYSIZE(size));
+
+    WCHAR avail[32] = L"";
+    const fs_usage* u = findUsage(st, disk, part);
+    if (u) {
+        StringCchCopyW(avail, ARRAYSIZE(avail), L", ");
+        formatSize(u->avail, avail + 2, ARRAYSIZE(avail) - 2);
+        StringCchCatW(avail, ARRAYSIZE(avail), L" free");
+    }
+    wnsprintfW(text, cch, L"Part %u%s: %s%s", part->index, letter, size, avail);
+}
+
+static void updatePartLabels(state* st)
+{
+    WCHAR text[128];
+    MENUITEMINFOW mii = {
+        .cbSize = sizeof(mii),
+        .fMask = MIIM_STRING,
+        .dwTypeData = text,
+    };
+    for (DWORD i = 0; i < st->n_disks; i++) {
+        disk_info* disk = getDisk(st, i);
+        if (disk->loading)
+            continue;
+        for (DWORD j = 0; j < disk->n_parts; ++j) {
+            formatPartLabel(st, disk, getPart(disk, j), text, ARRAYSIZE(text));
+            SetMenuItemInfoW(st->menu, MENU_PART + i * MAX_PARTS + j, FALSE, &mii);
+        }
+    }
+}
+
+static void onUsage(const wsl_task* t)
+{
+    // df fails if any mount point is gone, lines for the rest are still good
+    state* st = getState(t->hwnd);
+    // cut mount point, e.g. PHYSICALDRIVE1p1 of PHYSICALDRIVE1p12, would match another partition
+    if (t->cut)
+        trimPartialLine(t->text, t->cch);
+    st->n_usage = parseUsage(t->text, st->usage, MAX_USAGE);
+    st->usage_us = nowUs();
+    updatePartLabels(st);
+}
+
+// One wsl.exe call for all mounted partitions, at most once per USAGE_TTL_MS
+static void updateUsage(HWND hwnd, state* st)
+{
+    // never start WSL VM just to show free space
+    if (!st->mounted->n) {
+        if (st->n_usage) {
+            st->n_usage = 0;
+            updatePartLabels(st);
+        }
+        return;
+    }
+    if (st->usage_us && nowUs() - st->usage_us < USAGE_TTL_MS * 1000ull)
+        return;
+
+    // labels are updated when df is done, even if the menu is open by then
+    execWslAndThen(hwnd, L"-e sh -c \"df -kP /mnt/wsl/*p[0-9]*\"", NULL,
+        onUsage, TASK_HIGH, USAGE_TEXT);
+    st->usage_us = nowUs(); // don't start another one meanwhile
+}
+
 static LRESULT onTrayCallback(HWND hwnd, WPARAM wparam, LPARAM lparam)
 {
     UNREFERENCED_PARAMETER(wparam);
@@ -381,6 +861,7 @@ static LRESULT onTrayCallback(HWND hwnd, WPARAM wparam, LPARAM lparam)
     {
     case WM_LBUTTONUP:
     case WM_RBUTTONUP:
+        updateUsage(hwnd, getState(hwnd));
         showContextMenu(hwnd);
     }
     return 0;
@@ -392,49 +873,72 @@ static void appendError(HMENU menu, err_desc* e)
     AppendMenuW(menu, MF_STRING | MF_DISABLED, 0, e->text);
 }
 
-static void createDiskMenu(HMENU parent, DWORD i, disk_info* disk, HBITMAP shield)
+static void formatIoLabel(const disk_info* disk, PWCHAR text, DWORD cch)
+{
+    io_rate r;
+    if (getIoRate(disk, &r))
+        formatIoRate(&r, text, cch);
+    else
+        StringCchCopyW(text, cch, L"Read -; write -");
+}
+
+static void appendBenchMenu(HMENU parent, DWORD i, disk_info* disk, HBITMAP shield)
+{
+    HMENU menu = CreatePopupMenu();
+    WCHAR text[32];
+
+    AppendMenuW(menu, MF_STRING, MENU_BENCH + i, L"&Whole disk");
+    if (shield)
+        SetMenuItemBitmaps(menu, MENU_BENCH + i, MF_BYCOMMAND, shield, shield);
+    if (!disk->e_parts->error && !disk->loading)
+        for (DWORD j = 0; j < disk->n_parts; ++j) {
+            const DWORD n = MENU_BENCH_PART + i * MAX_PARTS + j;
+            wnsprintfW(text, ARRAYSIZE(text), L"Part %u", getPart(disk, j)->index);
+            AppendMenuW(menu, MF_STRING, n, text);
+            if (shield)
+                SetMenuItemBitmaps(menu, n, MF_BYCOMMAND, shield, shield);
+        }
+    AppendMenuW(parent, MF_STRING | MF_POPUP, (UINT_PTR)menu, L"&Benchmark");
+}
+
+static void createDiskMenu(state* st, DWORD i)
 {
+    disk_info* disk = getDisk(st, i);
+    HBITMAP shield = st->shield;
     HMENU menu = CreatePopupMenu();
     WCHAR text[256] = L"";
     DWORD letters = 0;
 
+    // raw images can be looked into, but not attached
+    const DWORD attach = disk->no_attach ? MF_DISABLED : 0;
     if (disk->e->error)
         appendError(menu, disk->e);
     else {
+        if (disk->image[0])
+            AppendMenuW(menu, MF_STRING | MF_DISABLED, 0, disk->image);
+        else {
+            formatIoLabel(disk, text, ARRAYSIZE(text));
+            AppendMenuW(menu, MF_STRING | MF_DISABLED, MENU_IOSTAT + i, text);
+        }
         AppendMenuW(menu, MF_STRING, MENU_COPY + i, L"&Copy device path");
-        AppendMenuW(menu, MF_STRING, MENU_MOUNT + i, L"&Mount --bare");
+        AppendMenuW(menu, MF_STRING | attach, MENU_MOUNT + i, L"&Mount --bare");
         if (shield)
             SetMenuItemBitmaps(menu, MENU_MOUNT + i, MF_BYCOMMAND, shield, shield);
 
         if (disk->e_parts->error)
             appendError(menu, disk->e_parts);
+        else if (disk->loading)
+            AppendMenuW(menu, MF_STRING | MF_DISABLED, 0, L"Loading partitions...");
         else
             for (DWORD j = 0; j < disk->n_parts; ++j) {
                 part_info* part = getPart(disk, j);
 
-                DWORD disabled = 0;
-                WCHAR letter[8] = L"";
+                DWORD disabled = attach;
                 if (part->letter) {
                     letters ++;
                     disabled = MF_DISABLED;
-                    wnsprintfW(letter, 8, L" (%c)", part->letter);
-                }
-
-                const WCHAR* suffix = L"MB";
-                ULONGLONG hi = part->size >> 10;
-                if (hi > (1000<<10)) {
-                    suffix = L"GB";
-                    hi >>= 10;
                 }
-                DWORD lo = hi % 1000;
-                hi /= 1000;
-
-                if (hi < 10 && lo > 100)
-                    wnsprintfW(text, ARRAYSIZE(text), L"Part %u%s: %llu.%u%s",
-                        part->index, letter, hi, lo / 10, suffix);
-                else
-                    wnsprintfW(text, ARRAYSIZE(text), L"Part %u%s: %llu%s",
-                        part->index, letter, hi, suffix);
+                formatPartLabel(st, disk, part, text, ARRAYSIZE(text));
 
                 const DWORD n = MENU_PART + i * MAX_PARTS + j;
                 AppendMenuW(menu, MF_STRING | disabled, n, text);
@@ -442,25 +946,56 @@ static void createDiskMenu(HMENU parent, DWORD i, disk_info* disk, HBITMAP shiel
                     SetMenuItemBitmaps(menu, n, MF_BYCOMMAND, shield, shield);
             }
 
-        AppendMenuW(menu, MF_STRING, MENU_UNMOUNT + i, L"&Unmount");
+        AppendMenuW(menu, MF_STRING | attach, MENU_UNMOUNT + i, L"&Unmount");
+        // benchmark of an image file would measure the file system it is on
+        if (!disk->image[0])
+            appendBenchMenu(menu, i, disk, shield);
     }
-    wnsprintfW(text, ARRAYSIZE(text), L"&%u: %s %u/%u parts",
-        disk->index, disk->model, letters, disk->n_parts);
+    if (disk->image[0] && disk->loading)
+        wnsprintfW(text, ARRAYSIZE(text), L"Image: %s, loading", disk->model);
+    else if (disk->image[0])
+        wnsprintfW(text, ARRAYSIZE(text), L"Image: %s, %u parts", disk->model, disk->n_parts);
+    else if (disk->loading)
+        wnsprintfW(text, ARRAYSIZE(text), L"&%u: %s, loading", disk->index, disk->model);
+    else
+        wnsprintfW(text, ARRAYSIZE(text), L"&%u: %s %u/%u parts",
+            disk->index, disk->model, letters, disk->n_parts);
     text[ARRAYSIZE(text) - 1] = 0;
-    AppendMenuW(parent, MF_STRING | MF_POPUP, (UINT_PTR)menu, text);
+    AppendMenuW(st->menu, MF_STRING | MF_POPUP, (UINT_PTR)menu, text);
 }
 
 static void createDisksMenu(state* st)
 {
+    if (st->dist_ready) {
+        PCWCH text = st->dist[0] ? st->dist : L"No distribution";
+        AppendMenuW(st->menu, MF_STRING | MF_DISABLED, 0, text);
+    }
     if (st->e->error)
         appendError(st->menu, st->e);
+    if (st->e_rules->error)
+        appendError(st->menu, st->e_rules);
 
     for (DWORD i = 0; i < st->n_disks; i++)
-        createDiskMenu(st->menu, i, getDisk(st, i), st->shield);
+        createDiskMenu(st, i);
 
+    st->diag = CreatePopupMenu();
+    fillDiagMenu(st->diag);
+    AppendMenuW(st->menu, MF_STRING, MENU_EJECT, L"Unmount &all");
+    AppendMenuW(st->menu, MF_STRING | MF_POPUP, (UINT_PTR)st->diag, L"&Diagnostics");
     AppendMenuW(st->menu, MF_STRING, MENU_EXIT, L"&Exit");
 }
 
+// Refresh rate labels in place, menu may be open at the moment
+static void updateIoLabels(state* st)
+{
+    WCHAR text[128];
+    for (DWORD i = 0; i < st->n_disks; i++) {
+        formatIoLabel(getDisk(st, i), text, ARRAYSIZE(text));
+        ModifyMenuW(st->menu, MENU_IOSTAT + i, MF_BYCOMMAND | MF_STRING | MF_DISABLED,
+            MENU_IOSTAT + i, text);
+    }
+}
+
 static void cleanDisksMenu(state* st)
 {
     while (DeleteMenu(st->menu, 0, MF_BYPOSITION));
@@ -487,61 +1022,289 @@ static HBITMAP createShieldBitmap(void)
     return bitmap;
 }
 
-static DWORD parseDistroList(HWND hwnd, DWORD exitCode, const WCHAR* text, DWORD cch)
+static void autoMount(HWND hwnd, state* st);
+
+static void onDistroList(const wsl_task* t)
 {
-    state* st = getState(hwnd);
+    state* st = getState(t->hwnd);
     st->dist[0] = 0;
+    st->dist_ready = TRUE;
+
+    if (t->exitCode)
+        onWslExit(t);
+    else
+        parseDistroList(t->text, st->dist, ARRAYSIZE(st->dist));
+
+    cleanDisksMenu(st);
+    createDisksMenu(st);
+    // partitions are opened through \\wsl$\<distribution>
+    autoMount(t->hwnd, st);
+}
+
+static void getDefaultDistribution(HWND hwnd)
+{
+    execWslAndThen(hwnd, L"--list -v", NULL, onDistroList, TASK_HIGH, WSL_TEXT);
+}
+
+static BOOL wasSeen(const state* st, ULONG id)
+{
+    for (DWORD i = 0; i < st->n_seen; i++)
+        if (st->seen[i] == id)
+            return TRUE;
+    return FALSE;
+}
 
-    if (exitCode)
-        return onWslExit(hwnd, exitCode, text, cch);
-
-    for (;;) {
-        switch (*text) {
-        case 0:
-            return 0;
-
-        case L'*': // found
-            // skip "* "
-            ++text;
-            ++text;
-            // copy name of the distro
-            const WCHAR * sep = text;
-            WCHAR *p = st->dist;
-            while (*sep && *sep != L'\t' && *sep != L' ')
-                *p++ = *sep++;
-            *p = 0;
-            return 0;
+// Apply auto-mount rules to disks which were not present during previous enumeration
+static void autoMount(HWND hwnd, state* st)
+{
+    // rules may open partitions, wait for distribution name
+    if (!st->dist_ready)
+        return;
 
+    ULONG seen[MAX_DISKS];
+    DWORD n_seen = 0;
+
+    for (DWORD i = 0; i < st->n_disks; i++) {
+        disk_info* disk = getDisk(st, i);
+        const ULONG id = diskId(disk);
+        // rules look at partitions, new disk is checked once they are listed
+        if (disk->loading && !wasSeen(st, id))
+            continue;
+        seen[n_seen++] = id;
+        if (wasSeen(st, id) || disk->no_attach)
+            continue;
+
+        DWORD parts = 0;
+        const rule_action action = matchRules(st->rules, disk, &parts);
+        switch (action) {
+        case RULE_BARE:
+            onMountClicked(hwnd, i);
+            break;
+        case RULE_MOUNT:
+        case RULE_OPEN:
+            for (DWORD j = 0; j < disk->n_parts; j++)
+                if (parts & (1u << j))
+                    mountPart(hwnd, i * MAX_PARTS + j, action == RULE_OPEN);
+            break;
         default:
-            // goto next line
-            while (*text && *text != L'\r' && *text != '\n')
-                ++text;
-            while (*text && (*text == L'\r' || *text == L'\n'))
-                ++text;
+            break;
         }
     }
+
+    for (DWORD i = 0; i < n_seen; i++)
+        st->seen[i] = seen[i];
+    st->n_seen = n_seen;
 }
 
-static void getDefaultDistribution(HWND hwnd, state* st)
+static void showDisks(state* st)
 {
-    WCHAR cmd[MAX_PATH];
-    wnsprintfW(cmd, ARRAYSIZE(cmd), L"--list -v");
-    execWslAndThen(hwnd, cmd, parseDistroList);
-    const WCHAR* text = L"No distribution";
-    if (st->dist[0])
-        text = st->dist;
-    InsertMenuW(st->menu, 0, MF_BYPOSITION | MF_STRING | MF_DISABLED, 0, st->dist);
+    publishSnapshot(st);
+    createDisksMenu(st);
+    if (st->n_loading)
+        return;
+
+    // menu is complete and clickable from now on
+    if (st->event_us) {
+        statRecord(HIST_EVENT_TO_MENU, nowUs() - st->event_us);
+        st->event_us = 0;
+    }
+}
+
+void refreshDisks(state* st)
+{
+    TRACE_BEGIN("refresh");
+    cleanDisksMenu(st);
+    resetDisks(st);
+    // partition tasks still running, if any, are stale now
+    st->generation++;
+    st->n_loading = 0;
+    backendList(st);
+    showDisks(st);
+    TRACE_END("refresh");
 }
 
-static LRESULT onTimer(HWND hwnd)
+// Partitions of every disk are listed by a task of its own, so a slow
+// disk holds up only itself. Each disk is shown as soon as it is ready.
+typedef struct parts_task {
+    HWND hwnd;
+    state* st; // only backend and WMI services are used by worker
+    DWORD generation;
+    ULONG id;
+    disk_info disk[1]; // identity copied from the list, gets partitions
+} parts_task;
+
+static void runPartsTask(void* arg)
 {
+    parts_task* t = arg;
+    backendParts(t->st, t->disk, DISK_PARTS_MS);
+}
+
+static void onPartsDone(void* arg)
+{
+    parts_task* t = arg;
+    HWND hwnd = t->hwnd;
     state* st = getState(hwnd);
-    if (pollDisks(st)) {
-        cleanDisksMenu(st);
-        resetDisks(st);
-        listDisks(st);
-        createDisksMenu(st);
+
+    // list was replaced meanwhile, newer task is on its way
+    disk_info* disk = NULL;
+    if (t->generation == st->generation)
+        for (DWORD i = 0; i < st->n_disks && !disk; i++)
+            if (getDisk(st, i)->loading && diskId(getDisk(st, i)) == t->id)
+                disk = getDisk(st, i);
+    if (!disk) {
+        resetErr(t->disk->e_parts);
+        LocalFree(t);
+        return;
+    }
+
+    TRACE_BEGIN("refresh.disk");
+    adoptParts(disk, t->disk);
+    LocalFree(t);
+    st->n_loading--;
+    statRecord(HIST_DISK_READY, nowUs() - st->refresh_us);
+    if (!st->n_loading) {
+        statAdd(STAT_REFRESHES, 1);
+        statRecord(HIST_ENUM, nowUs() - st->refresh_us);
+    }
+    cleanDisksMenu(st);
+    showDisks(st);
+    TRACE_END("refresh.disk");
+    autoMount(hwnd, st);
+}
+
+static void loadParts(HWND hwnd, state* st, const ULONG* known, DWORD n_known)
+{
+    ULONG ids[MAX_DISKS];
+    DWORD order[MAX_DISKS];
+    for (DWORD i = 0; i < st->n_disks; i++)
+        ids[i] = diskId(getDisk(st, i));
+    const DWORD urgent = loadOrder(st->disk, ids, st->n_disks, known, n_known, order);
+
+    for (DWORD k = 0; k < st->n_disks; k++) {
+        disk_info* disk = getDisk(st, order[k]);
+        if (!disk->loading)
+            continue;
+
+        parts_task* t = LocalAlloc(LPTR, sizeof(*t));
+        if (!t) {
+            setErrorCode(disk->e_parts, L"Failed to list partitions", ERROR_NOT_ENOUGH_MEMORY);
+            disk->loading = FALSE;
+            st->n_loading--;
+            continue;
+        }
+        t->hwnd = hwnd;
+        t->st = st;
+        t->generation = st->generation;
+        t->id = ids[order[k]];
+        t->disk->index = disk->index;
+        t->disk->n_parts = disk->n_parts;
+        t->disk->loading = TRUE;
+        StrCpyNW(t->disk->path, disk->path, ARRAYSIZE(t->disk->path));
+        StrCpyNW(t->disk->image, disk->image, ARRAYSIZE(t->disk->image));
+        submitTask(k < urgent ? TASK_HIGH : TASK_LOW, runPartsTask, onPartsDone, t);
     }
+}
+
+// Disk list itself is one quick query on a worker into scratch state,
+// UI thread swaps the result in and shows disks as loading.
+// Disks with unchanged partition table only get fresh drive letters.
+typedef struct refresh_task {
+    HWND hwnd;
+    state* scan;
+    DWORD n_letters;
+    part_letter letters[MAX_LETTERS];
+} refresh_task;
+
+static void runRefreshTask(void* arg)
+{
+    refresh_task* t = arg;
+    backendDrives(t->scan);
+    t->n_letters = backendLetters(t->scan, t->letters, MAX_LETTERS);
+}
+
+static void startRefresh(HWND hwnd, state* st);
+
+static void onRefreshDone(void* arg)
+{
+    refresh_task* t = arg;
+    HWND hwnd = t->hwnd;
+    state* st = getState(hwnd);
+
+    // disks which were here before can wait for others
+    ULONG known[MAX_DISKS];
+    const DWORD n_known = st->n_disks;
+    for (DWORD i = 0; i < n_known; i++)
+        known[i] = diskId(getDisk(st, i));
+
+    TRACE_BEGIN("refresh");
+    reuseParts(t->scan, st);
+    if (t->n_letters != NO_LETTERS)
+        applyLetters(t->scan, t->letters, t->n_letters);
+    cleanDisksMenu(st);
+    resetDisks(st);
+    adoptDisks(st, t->scan);
+    VirtualFree(t->scan, 0, MEM_RELEASE);
+    LocalFree(t);
+    st->generation++;
+    st->n_loading = 0;
+    for (DWORD i = 0; i < st->n_disks; i++)
+        if (getDisk(st, i)->loading)
+            st->n_loading++;
+    if (!st->n_loading) {
+        statAdd(STAT_REFRESHES, 1);
+        statRecord(HIST_ENUM, nowUs() - st->refresh_us);
+    }
+    showDisks(st);
+    TRACE_END("refresh");
+
+    st->refreshing = FALSE;
+    loadParts(hwnd, st, known, n_known);
+    autoMount(hwnd, st);
+    // disks changed while enumerating, result may be stale already
+    if (st->refresh_again) {
+        st->refresh_again = FALSE;
+        startRefresh(hwnd, st);
+    }
+}
+
+static void startRefresh(HWND hwnd, state* st)
+{
+    if (st->refreshing) {
+        st->refresh_again = TRUE;
+        return;
+    }
+
+    // state is too big for LocalAlloc, comes zeroed from VirtualAlloc
+    refresh_task* t = LocalAlloc(LPTR, sizeof(*t));
+    state* scan = VirtualAlloc(NULL, sizeof(*scan), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!t || !scan) {
+        LocalFree(t);
+        if (scan)
+            VirtualFree(scan, 0, MEM_RELEASE);
+        refreshDisks(st);
+        autoMount(hwnd, st);
+        return;
+    }
+    scan->services = st->services;
+    scan->backend = st->backend;
+    t->hwnd = hwnd;
+    t->scan = scan;
+    st->refreshing = TRUE;
+    st->refresh_us = nowUs();
+    submitTask(TASK_LOW, runRefreshTask, onRefreshDone, t);
+}
+
+static LRESULT onTimer(HWND hwnd, WPARAM id)
+{
+    state* st = getState(hwnd);
+    if (id == IO_TIMER) {
+        sampleIo(st);
+        updateIoLabels(st);
+        return 0;
+    }
+
+    if (backendPoll(st))
+        startRefresh(hwnd, st);
     return 0;
 }
 
@@ -551,6 +1314,9 @@ static void initTimer(state* st)
         return;
 
     st->timer = SetTimer(st->hwnd, (UINT_PTR)st, DISK_POLL_MS, NULL);
+    // rates need two samples, so take the first one right away
+    sampleIo(st);
+    SetTimer(st->hwnd, IO_TIMER, IO_SAMPLE_MS, NULL);
 }
 
 static LRESULT onCreate(HWND hwnd, LPARAM lparam)
@@ -567,10 +1333,15 @@ static LRESULT onCreate(HWND hwnd, LPARAM lparam)
         return GetLastError();
     }
 
-    if (!initDisks(st)) {
-        listDisks(st);
+    // workers fall back to running tasks inline, so failure is not fatal
+    initPool(hwnd, APP_TASK_DONE);
+
+    loadRules(st);
+    openSnapshot(st);
+    const BOOL ready = !initDisks(st);
+    if (ready)
         initTimer(st);
-    }
+    publishSnapshot(st);
 
     st->menu = CreatePopupMenu();
     if (!st->menu)
@@ -582,7 +1353,10 @@ static LRESULT onCreate(HWND hwnd, LPARAM lparam)
     if (!addTrayIcon(hwnd))
         return GetLastError();
 
-    getDefaultDistribution(hwnd, st);
+    // both finish on their own, whichever is last triggers auto-mount
+    getDefaultDistribution(hwnd);
+    if (ready)
+        startRefresh(hwnd, st);
     return 0;
 }
 
@@ -591,16 +1365,39 @@ static void onDestroy(HWND hwnd)
     state* st = getState(hwnd);
 
     KillTimer(st->hwnd, st->timer);
+    KillTimer(st->hwnd, IO_TIMER);
     removeTrayIcon(hwnd);
     DestroyMenu(st->menu);
     DeleteObject(st->shield);
 
-    resetDisks(st);
-    deinitDisks(st);
+    // tasks may still use WMI services, disk list and the rest of state:
+    // if a worker is stuck, all of it is left for process exit to clean up
+    if (deinitPool()) {
+        resetDisks(st);
+        deinitDisks(st);
+        freeRules(st);
+        closeSnapshot(st);
+    }
 
     CoUninitialize();
 }
 
+// Programs and desktop as they are, simulation brings its own
+static const shell_backend desktopShell = {
+    .execute = executeShell,
+    .wsl = execWsl,
+    .eject = ejectAll,
+    .exists = directoryExists,
+    .notify = notifyTray,
+    .popup = trackMenu,
+};
+
+static const shell_backend* getShell(HWND hwnd)
+{
+    const state* st = getState(hwnd);
+    return st->shell ? st->shell : &desktopShell;
+}
+
 static LRESULT CALLBACK WndProc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam)
 {
     switch (umsg)
@@ -614,21 +1411,64 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lpar
     case WM_COMMAND:
         return onMenuCommand(hwnd, wparam, lparam);
     case WM_TIMER:
-        return onTimer(hwnd);
+        return onTimer(hwnd, wparam);
     case APP_NOTIFY:
         return onTrayCallback(hwnd, wparam, lparam);
+    case APP_TASK_DONE:
+        completeTask(lparam);
+        return 0;
+    case WM_QUERYENDSESSION:
+        return onQueryEndSession(hwnd);
+    case WM_POWERBROADCAST:
+        return onPowerBroadcast(hwnd, wparam);
     }
     return DefWindowProcW(hwnd, umsg, wparam, lparam);
 }
 
+DWORD startHeadlessTray(HWND hwnd, state* st)
+{
+    setState(hwnd, st);
+    st->menu = CreatePopupMenu();
+    if (!st->menu)
+        return GetLastError();
+    createDisksMenu(st);
+
+    getDefaultDistribution(hwnd);
+    startRefresh(hwnd, st);
+    return 0;
+}
+
+void stopHeadlessTray(state* st)
+{
+    DestroyMenu(st->menu);
+    st->menu = NULL;
+    resetDisks(st);
+}
+
+LRESULT dispatchTray(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
+{
+    return WndProc(hwnd, msg, wparam, lparam);
+}
+
 int WINAPI wWinMain(_In_ HINSTANCE hinst, _In_opt_ HINSTANCE hprev, _In_ PWSTR argv, _In_ int show)
 {
     UNREFERENCED_PARAMETER(hprev);
-    UNREFERENCED_PARAMETER(argv);
     UNREFERENCED_PARAMETER(show);
 
     state* st = g_state;
     st->hinst = hinst;
+    initTrace();
+
+    // Any arguments switch program into headless mode
+    int argc = 0;
+    PWSTR* args = CommandLineToArgvW(argv, &argc);
+    if (args && argc > 1) {
+        const int code = runCli(st, argc - 1, args + 1);
+        LocalFree(args);
+        TerminateProcess(GetCurrentProcess(), (UINT)code);
+        return code;
+    }
+    LocalFree(args);
 
     // The program will use only tray icon popup menu,
     // but it's simpler to use window handle to process messages.
@@ -0,0 +1,494 @@
+#include "shared.h"
+
+#include <windows.h>
+#include <objbase.h>
+
+// Shared executor for everything which may block: WMI queries,
+// wsl.exe runs, \\wsl$ probing and so on.
+//
+// Every worker owns a deque per priority. Owner pushes and pops at the
+// bottom, idle workers steal from the top of others' deques, so a burst
+// of tasks spreads over all workers. Deques are short and touched a few
+// times per second, a slim reader/writer lock per deque is cheap enough.
+//
+// Tasks submitted by UI thread are dealt to workers round robin.
+// High priority tasks are taken from all deques before any low one.
+// Completion callback runs on UI thread: the task is posted back to the
+// window, so state is only ever changed by the UI thread.
+// Simulation replaces workers with a sink, see sim.c
+
+#define POOL_WORKERS 4
+#define DEQUE_SIZE 64 // must be power of two
+#define POOL_JOIN_MS 2000
+
+typedef struct task {
+    task_fn fn;
+    task_fn done;
+    void* arg;
+    ULONGLONG queued_us;
+} task;
+
+typedef struct deque {
+    SRWLOCK lock;
+    LONG top;    // next to steal
+    LONG bottom; // next free slot
+    task* slot[DEQUE_SIZE];
+} deque;
+
+typedef struct worker {
+    HANDLE thread;
+    deque q[TASK_PRIORITIES];
+} worker;
+
+typedef struct pool {
+    HWND hwnd;
+    UINT msg;
+    HANDLE wake; // semaphore, released once per submitted task
+    volatile LONG stop;
+    DWORD n;
+    DWORD next; // round robin for submissions from outside
+    DWORD tls;
+    task_sink sink; // takes all tasks when set
+    worker w[POOL_WORKERS];
+} pool;
+
+static pool g_pool[1];
+
+static BOOL pushBottom(deque* q, task* t)
+{
+    AcquireSRWLockExclusive(&q->lock);
+    const BOOL ok = q->bottom - q->top < DEQUE_SIZE;
+    if (ok)
+        q->slot[q->bottom++ & (DEQUE_SIZE - 1)] = t;
+    ReleaseSRWLockExclusive(&q->lock);
+    return ok;
+}
+
+static task* popBottom(deque* q)
+{
+    task* t = NULL;
+    AcquireSRWLockExclusive(&q->lock);
+    if (q->bottom != q->top)
+        t = q->slot[--q->bottom & (DEQUE_SIZE - 1)];
+    ReleaseSRWLockExclusive(&q->lock);
+    return t;
+}
+
+static task* stealTop(deque* q)
+{
+    task* t = NULL;
+    AcquireSRWLockExclusive(&q->lock);
+    if (q->bottom != q->top)
+        t = q->slot[q->top++ & (DEQUE_SIZE - 1)];
+    ReleaseSRWLockExclusive(&q->lock);
+    return t;
+}
+
+static task* findTask(pool* p, worker* w)
+{
+    const DWORD self = (DWORD)(w - p->w);
+    for (DWORD prio = 0; prio < TASK_PRIORITIES; prio++) {
+        task* t = popBottom(&w->q[prio]);
+        if (t)
+            return t;
+
+        // start with the next worker, so thieves don't all pick on the first one
+        for (DWORD k = 1; k < p->n; k++) {
+            t = stealTop(&p->w[(self + k) % p->n].q[prio]);
+            if (t) {
+                statAdd(STAT_TASKS_STOLEN, 1);
+                return t;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void runTask(pool* p, task* t)
+{
+    statRecord(HIST_TASK_WAIT, nowUs() - t->queued_us);
+    statAdd(STAT_TASKS, 1);
+    TRACE_BEGIN("task");
+    t->fn(t->arg);
+    TRACE_END("task");
+
+    if (!t->done) {
+        LocalFree(t);
+        return;
+    }
+    // exiting: UI thread won't take completions and the state they
+    // would update may be gone, the task is left to process exit
+    if (p->stop)
+        return;
+    // outside of the pool nobody waits for completion
+    if (!p->hwnd) {
+        t->done(t->arg);
+        LocalFree(t);
+        return;
+    }
+    // task leaks if window is gone, it happens only on exit
+    PostMessageW(p->hwnd, p->msg, 0, (LPARAM)t);
+}
+
+static DWORD WINAPI workerMain(LPVOID param)
+{
+    pool* p = g_pool;
+    worker* w = param;
+    TlsSetValue(p->tls, w);
+    // WMI proxies were created in multithreaded apartment
+    const HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+    while (!p->stop) {
+        task* t = findTask(p, w);
+        if (t)
+            runTask(p, t);
+        else
+            WaitForSingleObject(p->wake, INFINITE);
+    }
+
+    if (SUCCEEDED(hr))
+        CoUninitialize();
+    return 0;
+}
+
+// Start n workers, without hwnd completions run on the worker
+static DWORD startPool(pool* p, HWND hwnd, UINT msg, DWORD n)
+{
+    p->tls = TlsAlloc();
+    if (p->tls == TLS_OUT_OF_INDEXES)
+        return GetLastError();
+    p->wake = CreateSemaphoreW(NULL, 0, MAXLONG, NULL);
+    if (!p->wake)
+        return GetLastError();
+
+    p->hwnd = hwnd;
+    p->msg = msg;
+    for (DWORD i = 0; i < n; i++) {
+        worker* w = &p->w[i];
+        for (DWORD prio = 0; prio < TASK_PRIORITIES; prio++)
+            InitializeSRWLock(&w->q[prio].lock);
+        // deques must be ready before thieves look at them
+        p->n = i + 1;
+        w->thread = CreateThread(NULL, 0, workerMain, w, 0, NULL);
+        if (!w->thread) {
+            p->n = i;
+            break;
+        }
+    }
+    return p->n ? 0 : GetLastError();
+}
+
+DWORD initPool(HWND hwnd, UINT msg)
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return startPool(g_pool, hwnd, msg, min(max(si.dwNumberOfProcessors, 2), POOL_WORKERS));
+}
+
+BOOL deinitPool(void)
+{
+    pool* p = g_pool;
+    if (!p->n)
+        return TRUE;
+
+    InterlockedExchange(&p->stop, 1);
+    ReleaseSemaphore(p->wake, p->n, NULL);
+
+    // workers may be stuck waiting for wsl.exe, don't hang on exit
+    HANDLE threads[POOL_WORKERS];
+    for (DWORD i = 0; i < p->n; i++)
+        threads[i] = p->w[i].thread;
+    const BOOL joined = WaitForMultipleObjects(p->n, threads, TRUE, POOL_JOIN_MS) == WAIT_OBJECT_0;
+    for (DWORD i = 0; i < p->n; i++)
+        CloseHandle(threads[i]);
+    p->n = 0;
+    if (!joined)
+        return FALSE; // semaphore and TLS slot are still in use
+
+    CloseHandle(p->wake);
+    TlsFree(p->tls);
+    p->hwnd = NULL;
+    p->stop = 0;
+    return TRUE;
+}
+
+BOOL poolStopping(void)
+{
+    return g_pool->stop != 0;
+}
+
+void setTaskSink(task_sink sink)
+{
+    g_pool->sink = sink;
+}
+
+void submitTask(task_priority prio, task_fn fn, task_fn done, void* arg)
+{
+    pool* p = g_pool;
+    if (p->sink) {
+        p->sink(prio, fn, done, arg);
+        return;
+    }
+
+    task* t = LocalAlloc(LMEM_FIXED, sizeof(*t));
+    if (!t) {
+        // can't even queue, do it the old way
+        fn(arg);
+        if (done)
+            done(arg);
+        return;
+    }
+    t->fn = fn;
+    t->done = done;
+    t->arg = arg;
+    t->queued_us = nowUs();
+
+    BOOL queued = FALSE;
+    if (p->n) {
+        // workers keep their own tasks, others are dealt round robin
+        worker* w = TlsGetValue(p->tls);
+        if (!w)
+            w = &p->w[p->next++ % p->n];
+        queued = pushBottom(&w->q[prio], t);
+    }
+    if (queued)
+        ReleaseSemaphore(p->wake, 1, NULL);
+    else
+        runTask(p, t); // no workers or deque is full
+}
+
+void completeTask(LPARAM lparam)
+{
+    task* t = (task*)lparam;
+    t->done(t->arg);
+    LocalFree(t);
+}
+
+// Random task graph for check and benchmark: tasks of random length
+// and priority, some of which submit more tasks from their worker for
+// idle workers to steal. Every task counts its run and its completion.
+
+#define LOAD_WORK 4096 // spin rounds, at most
+#define LOAD_WINDOW 64 // tasks in flight from outside, so deques rarely overflow
+#define LOAD_HOG 32 // children of the task which waits for them to be stolen
+
+typedef struct load_run load_run;
+
+typedef struct load_item {
+    load_run* run;
+    volatile LONG ran;
+    volatile LONG done;
+    ULONG seed;
+    DWORD fanout; // tasks it submits
+    BOOL hog; // keeps its worker busy until children completed
+} load_item;
+
+struct load_run {
+    load_item* item;
+    DWORD max;
+    volatile LONG next; // items handed out
+    volatile LONG finished;
+    volatile LONG early; // completed before it ran
+    volatile LONG starved; // hog gave up waiting for thieves
+    volatile ULONG sink; // keeps spin loops
+    ULONG rnd;
+};
+
+static ULONG loadRandom(ULONG x)
+{
+    // xorshift32, same as synth.c
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+static void loadTask(void* arg);
+static void loadDone(void* arg);
+
+static load_item* newItem(load_run* r, ULONG seed)
+{
+    const LONG i = InterlockedIncrement(&r->next) - 1;
+    if ((DWORD)i >= r->max) {
+        InterlockedDecrement(&r->next);
+        return NULL;
+    }
+    load_item* it = &r->item[i];
+    it->run = r;
+    it->seed = seed;
+    // one task in eight fans out into up to eight
+    it->fanout = (seed >> 24) % 8 ? 0 : 1 + (seed >> 16) % 8;
+    return it;
+}
+
+static void submitItem(load_item* it)
+{
+    submitTask((task_priority)((it->seed >> 8) % TASK_PRIORITIES), loadTask, loadDone, it);
+}
+
+static void loadTask(void* arg)
+{
+    load_item* it = arg;
+    load_run* r = it->run;
+    InterlockedIncrement(&it->ran);
+
+    ULONG x = it->seed;
+    for (DWORD k = it->seed % LOAD_WORK; k; k--)
+        x = loadRandom(x);
+    r->sink += x;
+
+    const LONG base = r->finished;
+    DWORD n = 0;
+    for (DWORD k = 0; k < it->fanout; k++) {
+        load_item* child = newItem(r, loadRandom(it->seed + k + 1));
+        if (!child)
+            break;
+        child->fanout = it->hog ? 0 : child->fanout;
+        submitItem(child);
+        n++;
+    }
+
+    // owner is busy, so the children only run if they are stolen
+    const ULONGLONG deadline = nowUs() + 5000000;
+    while (it->hog && r->finished - base < (LONG)n) {
+        if (nowUs() > deadline) {
+            InterlockedIncrement(&r->starved);
+            break;
+        }
+        YieldProcessor();
+    }
+}
+
+static void loadDone(void* arg)
+{
+    load_item* it = arg;
+    if (!it->ran)
+        InterlockedIncrement(&it->run->early);
+    InterlockedIncrement(&it->done);
+    InterlockedIncrement(&it->run->finished);
+}
+
+// Wait until every task handed out completed. Returns FALSE on timeout.
+static BOOL waitLoad(load_run* r, DWORD timeout_ms)
+{
+    const ULONGLONG deadline = nowUs() + timeout_ms * 1000ull;
+    while (r->finished != r->next) {
+        if (nowUs() > deadline)
+            return FALSE;
+        Sleep(1);
+    }
+    return TRUE;
+}
+
+// Submit tasks from outside of the pool until they and their children
+// fill r->max items, then wait for them. Returns FALSE on timeout.
+static BOOL runLoad(load_run* r, DWORD timeout_ms)
+{
+    for (;;) {
+        while (r->next - r->finished >= LOAD_WINDOW)
+            YieldProcessor();
+        r->rnd = loadRandom(r->rnd);
+        load_item* it = newItem(r, r->rnd);
+        if (!it)
+            break;
+        submitItem(it);
+    }
+    return waitLoad(r, timeout_ms);
+}
+
+static load_run* newLoad(DWORD max)
+{
+    load_run* r = LocalAlloc(LMEM_ZEROINIT, sizeof(*r) + max * sizeof(load_item));
+    if (r) {
+        r->item = (load_item*)(r + 1);
+        r->max = max;
+        r->rnd = 2463534242u;
+    }
+    return r;
+}
+
+#define CHECK_TASKS 20000
+
+// Many tasks over all workers, each must run and complete exactly once
+void checkPool(check* c)
+{
+    pool* p = g_pool;
+    if (!expect(c, !p->n && !p->sink, L"pool is idle"))
+        return;
+    load_run* r = newLoad(CHECK_TASKS);
+    if (!expect(c, r != NULL, L"task table"))
+        return;
+    if (!expectNumber(c, startPool(p, NULL, 0, POOL_WORKERS), 0, L"workers start")) {
+        deinitPool();
+        LocalFree(r);
+        return;
+    }
+
+    // the task's own worker waits, so its children must be stolen
+    const LONG64 stolen = statGet(STAT_TASKS_STOLEN);
+    load_item* hog = newItem(r, 1);
+    hog->hog = TRUE;
+    hog->fanout = LOAD_HOG;
+    submitItem(hog);
+    expect(c, waitLoad(r, 10000), L"stolen tasks complete");
+    expectNumber(c, r->starved, 0, L"idle workers steal");
+    expect(c, statGet(STAT_TASKS_STOLEN) - stolen >= LOAD_HOG, L"steals are counted");
+
+    expect(c, runLoad(r, 30000), L"all tasks complete");
+    expect(c, deinitPool(), L"workers exit");
+
+    DWORD twice = 0, lost = 0;
+    for (LONG i = 0; i < r->next; i++) {
+        twice += r->item[i].ran > 1 || r->item[i].done > 1;
+        lost += !r->item[i].ran || !r->item[i].done;
+    }
+    expectNumber(c, r->next, CHECK_TASKS, L"task graph is full");
+    expectNumber(c, r->finished, r->next, L"completions");
+    expectNumber(c, lost, 0, L"tasks not run or not completed");
+    expectNumber(c, twice, 0, L"tasks run or completed twice");
+    expectNumber(c, r->early, 0, L"completed before run");
+    LocalFree(r);
+}
+
+DWORD benchPool(json* j, DWORD tasks, err_desc* e)
+{
+    pool* p = g_pool;
+    if (p->n || p->sink)
+        return setErrorCode(e, L"Pool is running", ERROR_BUSY);
+
+    for (DWORD n = 1; n <= POOL_WORKERS; n++) {
+        // same graph for every worker count
+        load_run* r = newLoad(tasks);
+        if (!r)
+            return setError(e, L"Pool benchmark failed");
+        DWORD code = startPool(p, NULL, 0, n);
+        if (code) {
+            deinitPool();
+            LocalFree(r);
+            return setErrorCode(e, L"Failed to start workers", code);
+        }
+
+        statReset(HIST_TASK_WAIT);
+        const LONG64 stolen = statGet(STAT_TASKS_STOLEN);
+        const ULONGLONG start = nowUs();
+        const BOOL ok = runLoad(r, 60000);
+        const ULONGLONG elapsed = max(nowUs() - start, 1);
+        if (!deinitPool() || !ok) {
+            LocalFree(r);
+            return setErrorCode(e, L"Pool benchmark timed out", ERROR_TIMEOUT);
+        }
+
+        jsonBegin(j, NULL);
+        jsonString(j, "bench", L"pool");
+        jsonNumber(j, "workers", n);
+        jsonNumber(j, "tasks", r->finished);
+        jsonNumber(j, "elapsed_us", elapsed);
+        jsonNumber(j, "tasks_per_s", r->finished * 1000000ull / elapsed);
+        jsonNumber(j, "stolen", statGet(STAT_TASKS_STOLEN) - stolen);
+        jsonNumber(j, "wait_p50_us", statPercentile(HIST_TASK_WAIT, 50));
+        jsonNumber(j, "wait_p99_us", statPercentile(HIST_TASK_WAIT, 99));
+        jsonEnd(j);
+        LocalFree(r);
+    }
+    return 0;
+}
@@ -0,0 +1,707 @@
+#include "shared.h"
+
+#include <windows.h>
+#include <Shlwapi.h>
+#include <strsafe.h>
+#include <intrin.h>
+
+// Auto-mount rules file "wsldskmnt.rules" lives next to the executable.
+// One rule per line, '#' starts a comment:
+//
+//   model="Samsung T7" size=900G-1T part=1 action=open
+//   serial=WD-WX21A1234567 action=bare
+//
+// Keys:
+//   model=<text>    substring of disk model, case insensitive
+//   serial=<text>   exact disk serial number, case insensitive
+//   size=<min>-<max> disk size range, K/M/G/T suffixes, either bound may be omitted
+//   part=<n>        partition number as shown in the menu
+//   type=<text>     substring of partition type as reported by Windows
+//   action=<ignore|bare|mount|open>
+//
+// File is parsed once and compiled into a decision table. Model and type
+// are upper-cased on load. Rules with serial number are chained into
+// buckets by serial hash, the rest by one three character gram of their
+// model, or type when there is no model, the least used gram is taken.
+// Rules with neither form a short generic chain. A disk collects
+// candidates from its serial bucket, the gram chains of its upper-cased
+// model and partition types and the generic chain, and only those are
+// checked in file order. Cost depends on the length of model and types,
+// not on the number of rules.
+
+#define RULES_FILE L"wsldskmnt.rules"
+#define RULE_TEXT 64
+#define RULE_BUCKETS 64 // must be power of two
+#define RULE_GRAMS 1024 // must be power of two
+#define RULE_GRAM 3 // characters in a gram
+#define RULE_FOLD 256 // longer models are matched by their beginning
+#define MAX_CONFIG_FILE (1 << 20)
+
+enum {
+    RULE_MODEL  = 1 << 0,
+    RULE_SERIAL = 1 << 1,
+    RULE_SIZE   = 1 << 2,
+    RULE_PART   = 1 << 3,
+    RULE_TYPE   = 1 << 4,
+    RULE_PART_FLAGS = RULE_PART | RULE_TYPE,
+};
+
+typedef struct rule {
+    DWORD flags;
+    rule_action action;
+    DWORD part;
+    ULONG serialHash;
+    ULONGLONG minSize;
+    ULONGLONG maxSize;
+    WORD next; // 1-based index of next rule in the same chain, 0 terminates
+    WCHAR gram[RULE_GRAM]; // which part of model or type it is chained by
+    WCHAR model[RULE_TEXT]; // upper case
+    WCHAR serial[RULE_TEXT];
+    WCHAR type[MAX_PART_TYPE]; // upper case
+} rule;
+
+struct rules {
+    DWORD n_rules;
+    WORD bucket[RULE_BUCKETS]; // 1-based index of first rule with given serial hash
+    WORD gram[RULE_GRAMS];     // first rule without serial keyed by gram
+    WORD generic;              // first rule without serial and gram
+    rule rule[MAX_RULES];
+};
+
+// Disk as seen by rules: upper-cased text and candidate rules
+typedef struct rule_subject {
+    WCHAR model[RULE_FOLD];
+    WCHAR type[MAX_PARTS][MAX_PART_TYPE];
+    DWORD seen[RULE_GRAMS / 32]; // grams already collected
+    DWORD cand[MAX_RULES / 32]; // bit n - 1 for rule n
+} rule_subject;
+
+ULONG hashText(ULONG h, PCWCH s)
+{
+    if (!s)
+        return h;
+
+    for (; *s; ++s) {
+        // CharUpperW converts single character if high word is zero
+        const WCHAR c = (WCHAR)(ULONG_PTR)CharUpperW((LPWSTR)(ULONG_PTR)*s);
+        h ^= c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static ULONG hashSerial(PCWCH s)
+{
+    return hashText(2166136261u, s);
+}
+
+static void foldText(PWCHAR s)
+{
+    CharUpperBuffW(s, lstrlenW(s));
+}
+
+static DWORD gramIndex(PCWCH s)
+{
+    ULONG h = 2166136261u;
+    for (DWORD i = 0; i < RULE_GRAM; ++i) {
+        h ^= s[i];
+        h *= 16777619u;
+    }
+    return (h ^ (h >> 16)) & (RULE_GRAMS - 1);
+}
+
+static BOOL hasGram(PCWCH s)
+{
+    for (DWORD i = 0; i < RULE_GRAM; ++i)
+        if (!s[i])
+            return FALSE;
+    return TRUE;
+}
+
+static BOOL sameGram(PCWCH a, PCWCH b)
+{
+    for (DWORD i = 0; i < RULE_GRAM; ++i)
+        if (a[i] != b[i])
+            return FALSE;
+    return TRUE;
+}
+
+// Substring search, both are upper case already
+static BOOL hasText(PCWCH s, PCWCH needle)
+{
+    for (;; ++s) {
+        DWORD i = 0;
+        while (needle[i] && s[i] == needle[i])
+            ++i;
+        if (!needle[i])
+            return TRUE;
+        if (!*s)
+            return FALSE;
+    }
+}
+
+static DWORD ruleError(err_desc* e, DWORD line, PCWCH what)
+{
+    // report only the first problem
+    if (e->error)
+        return e->error;
+
+    static const DWORD cch = 128;
+    e->title = L"Failed to load auto-mount rules";
+    e->error = ERROR_INVALID_DATA;
+    e->text = LocalAlloc(0, cch * sizeof(WCHAR));
+    if (e->text)
+        wnsprintfW(e->text, cch, L"%s line %u: %s", RULES_FILE, line, what);
+    return e->error;
+}
+
+static BOOL isBlank(WCHAR c)
+{
+    return c == L' ' || c == L'\t';
+}
+
+static BOOL parseSize(PCWCH s, PCWCH end, ULONGLONG* size)
+{
+    ULONGLONG r = 0;
+    if (s == end)
+        return FALSE;
+
+    for (; s < end && *s >= L'0' && *s <= L'9'; ++s)
+        r = r * 10 + (*s - L'0');
+
+    if (s < end) {
+        switch (*s++) {
+        case L'T': case L't': r <<= 10; // fallthrough
+        case L'G': case L'g': r <<= 10; // fallthrough
+        case L'M': case L'm': r <<= 10; // fallthrough
+        case L'K': case L'k': r <<= 10; break;
+        default:
+            return FALSE;
+        }
+    }
+    *size = r;
+    return s == end;
+}
+
+static BOOL parseRange(PCWCH s, PCWCH end, rule* r)
+{
+    PCWCH dash = s;
+    while (dash < end && *dash != L'-')
+        ++dash;
+
+    r->minSize = 0;
+    r->maxSize = ~0ull;
+    if (dash > s && !parseSize(s, dash, &r->minSize))
+        return FALSE;
+    if (dash == end)
+        return s != end;
+    if (dash + 1 < end && !parseSize(dash + 1, end, &r->maxSize))
+        return FALSE;
+    return r->minSize <= r->maxSize;
+}
+
+static BOOL copyValue(PWCHAR dst, DWORD cch, PCWCH s, PCWCH end)
+{
+    const DWORD n = (DWORD)(end - s);
+    if (!n || n >= cch)
+        return FALSE;
+    StringCchCopyNW(dst, cch, s, n);
+    return TRUE;
+}
+
+static BOOL isKey(PCWCH s, PCWCH end, PCWCH key)
+{
+    const int n = (int)(end - s);
+    return n == lstrlenW(key) && StrCmpNIW(s, key, n) == 0;
+}
+
+static BOOL parseAction(PCWCH s, PCWCH end, rule* r)
+{
+    static const struct {
+        PCWCH name;
+        rule_action action;
+    } actions[] = {
+        {L"ignore", RULE_IGNORE},
+        {L"bare",   RULE_BARE},
+        {L"mount",  RULE_MOUNT},
+        {L"open",   RULE_OPEN},
+    };
+    for (DWORD i = 0; i < ARRAYSIZE(actions); ++i) {
+        if (isKey(s, end, actions[i].name)) {
+            r->action = actions[i].action;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Parse one key=value token, return error description or NULL
+static PCWCH parseToken(rule* r, PCWCH key, PCWCH eq, PCWCH s, PCWCH end)
+{
+    if (isKey(key, eq, L"model")) {
+        r->flags |= RULE_MODEL;
+        if (!copyValue(r->model, ARRAYSIZE(r->model), s, end))
+            return L"bad model";
+        foldText(r->model);
+        return NULL;
+    }
+    if (isKey(key, eq, L"serial")) {
+        r->flags |= RULE_SERIAL;
+        if (!copyValue(r->serial, ARRAYSIZE(r->serial), s, end))
+            return L"bad serial";
+        r->serialHash = hashSerial(r->serial);
+        return NULL;
+    }
+    if (isKey(key, eq, L"size")) {
+        r->flags |= RULE_SIZE;
+        return parseRange(s, end, r) ? NULL : L"bad size range";
+    }
+    if (isKey(key, eq, L"part")) {
+        ULONGLONG n;
+        r->flags |= RULE_PART;
+        if (!parseSize(s, end, &n) || n >= MAX_PARTS)
+            return L"bad partition number";
+        r->part = (DWORD)n;
+        return NULL;
+    }
+    if (isKey(key, eq, L"type")) {
+        r->flags |= RULE_TYPE;
+        if (!copyValue(r->type, ARRAYSIZE(r->type), s, end))
+            return L"bad type";
+        foldText(r->type);
+        return NULL;
+    }
+    if (isKey(key, eq, L"action"))
+        return parseAction(s, end, r) ? NULL : L"unknown action";
+
+    return L"unknown key";
+}
+
+// Parse single line into r. Returns error description or NULL.
+// Empty lines leave r->action as RULE_NONE.
+static PCWCH parseLine(rule* r, PCWCH s, PCWCH end)
+{
+    for (;;) {
+        while (s < end && isBlank(*s))
+            ++s;
+        if (s == end || *s == L'#')
+            break;
+
+        PCWCH key = s;
+        while (s < end && *s != L'=' && !isBlank(*s))
+            ++s;
+        if (s == end || *s != L'=')
+            return L"expected key=value";
+        PCWCH eq = s++;
+
+        PCWCH value = s;
+        if (s < end && *s == L'"') {
+            value = ++s;
+            while (s < end && *s != L'"')
+                ++s;
+            if (s == end)
+                return L"unterminated quote";
+        }
+        else {
+            while (s < end && !isBlank(*s))
+                ++s;
+        }
+        PCWCH err = parseToken(r, key, eq, value, s);
+        if (err)
+            return err;
+        if (s < end && *s == L'"')
+            ++s;
+    }
+
+    if (!r->flags && r->action == RULE_NONE)
+        return NULL;
+    if (r->action == RULE_NONE)
+        return L"missing action";
+    return NULL;
+}
+
+static void linkRule(WORD* head, rules* rs, WORD n)
+{
+    while (*head)
+        head = &rs->rule[*head - 1].next;
+    *head = n;
+}
+
+static DWORD chainLength(const rules* rs, WORD n)
+{
+    DWORD len = 0;
+    for (; n; n = rs->rule[n - 1].next)
+        ++len;
+    return len;
+}
+
+// Every gram of a matching model or type is present in the disk,
+// so any of them works as a key. The least used one keeps chains short.
+static void indexRule(rules* rs, WORD n)
+{
+    const rule* r = &rs->rule[n - 1];
+    if (r->flags & RULE_SERIAL) {
+        linkRule(&rs->bucket[r->serialHash & (RULE_BUCKETS - 1)], rs, n);
+        return;
+    }
+
+    PCWCH key = L"";
+    if ((r->flags & RULE_MODEL) && hasGram(r->model))
+        key = r->model;
+    else if ((r->flags & RULE_TYPE) && hasGram(r->type))
+        key = r->type;
+
+    WORD* head = &rs->generic;
+    PCWCH gram = NULL;
+    DWORD best = ~0u;
+    for (; hasGram(key); ++key) {
+        WORD* h = &rs->gram[gramIndex(key)];
+        const DWORD len = chainLength(rs, *h);
+        if (len < best) {
+            best = len;
+            head = h;
+            gram = key;
+        }
+    }
+    for (DWORD i = 0; gram && i < RULE_GRAM; ++i)
+        rs->rule[n - 1].gram[i] = gram[i];
+    linkRule(head, rs, n);
+}
+
+PWCHAR readConfigFile(PCWCH name, PCWCH title, err_desc* e)
+{
+    WCHAR path[MAX_PATH];
+    if (!GetModuleFileNameW(NULL, path, ARRAYSIZE(path))) {
+        setError(e, L"GetModuleFileName failed");
+        return NULL;
+    }
+    PathRemoveFileSpecW(path);
+    PathAppendW(path, name);
+
+    HANDLE h = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    PWCHAR text = NULL;
+    char* buf = NULL;
+    LARGE_INTEGER size;
+    DWORD n = 0;
+    if (!GetFileSizeEx(h, &size) || size.QuadPart > MAX_CONFIG_FILE) {
+        setErrorCode(e, title, ERROR_FILE_TOO_LARGE);
+        goto out;
+    }
+    buf = LocalAlloc(0, (SIZE_T)size.QuadPart + 1);
+    if (!buf || !ReadFile(h, buf, size.LowPart, &n, NULL)) {
+        setError(e, title);
+        goto out;
+    }
+
+    // expected to be UTF-8, optionally with BOM
+    char* p = buf;
+    if (n >= 3 && (BYTE)p[0] == 0xEF && (BYTE)p[1] == 0xBB && (BYTE)p[2] == 0xBF) {
+        p += 3;
+        n -= 3;
+    }
+    const int cch = n ? MultiByteToWideChar(CP_UTF8, 0, p, n, NULL, 0) : 0;
+    text = LocalAlloc(0, (cch + 1) * sizeof(WCHAR));
+    if (!text) {
+        setError(e, title);
+        goto out;
+    }
+    if (cch)
+        MultiByteToWideChar(CP_UTF8, 0, p, n, text, cch);
+    text[cch] = 0;
+
+out:
+    LocalFree(buf);
+    CloseHandle(h);
+    return text;
+}
+
+static void compileRules(rules* rs, PCWCH s, err_desc* e)
+{
+    for (DWORD line = 1; *s; ++line) {
+        PCWCH end = s;
+        while (*end && *end != L'\r' && *end != L'\n')
+            ++end;
+
+        if (rs->n_rules == MAX_RULES) {
+            ruleError(e, line, L"too many rules");
+            break;
+        }
+
+        rule* r = &rs->rule[rs->n_rules];
+        PCWCH err = parseLine(r, s, end);
+        if (err) {
+            ruleError(e, line, err);
+            *r = (rule){ 0 };
+        }
+        else if (r->action != RULE_NONE) {
+            indexRule(rs, (WORD)++rs->n_rules);
+        }
+
+        // CRLF counts as one line end
+        if (*end == L'\r')
+            ++end;
+        if (*end == L'\n')
+            ++end;
+        s = end;
+    }
+}
+
+DWORD loadRules(state* st)
+{
+    freeRules(st);
+
+    PWCHAR text = readConfigFile(RULES_FILE, L"Failed to read auto-mount rules", st->e_rules);
+    if (!text)
+        return st->e_rules->error;
+
+    rules* rs = LocalAlloc(LMEM_ZEROINIT, sizeof(*rs));
+    if (!rs) {
+        LocalFree(text);
+        return setError(st->e_rules, L"Failed to load auto-mount rules");
+    }
+
+    compileRules(rs, text, st->e_rules);
+    LocalFree(text);
+    st->rules = rs;
+    return st->e_rules->error;
+}
+
+void freeRules(state* st)
+{
+    st->rules = LocalFree(st->rules);
+    resetErr(st->e_rules);
+}
+
+static BOOL matchDisk(const rule* r, const disk_info* disk, const rule_subject* sub,
+    ULONG serialHash)
+{
+    if (r->flags & RULE_SERIAL) {
+        if (r->serialHash != serialHash || !disk->serial ||
+            lstrcmpiW(r->serial, disk->serial))
+            return FALSE;
+    }
+    if (r->flags & RULE_SIZE) {
+        if (disk->size < r->minSize || disk->size > r->maxSize)
+            return FALSE;
+    }
+    if (r->flags & RULE_MODEL) {
+        if (!disk->model || !hasText(sub->model, r->model))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL matchPart(const rule* r, const part_info* part, PCWCH type)
+{
+    if ((r->flags & RULE_PART) && part->index != r->part)
+        return FALSE;
+    if ((r->flags & RULE_TYPE) && !hasText(type, r->type))
+        return FALSE;
+    return TRUE;
+}
+
+static DWORD matchParts(const rule* r, const disk_info* disk, const rule_subject* sub)
+{
+    DWORD parts = 0;
+    if (disk->e_parts->error)
+        return 0;
+
+    for (DWORD j = 0; j < disk->n_parts && j < MAX_PARTS; ++j)
+        if (matchPart(r, &disk->part[j], sub->type[j]))
+            parts |= 1u << j;
+    return parts;
+}
+
+static rule_action matchRule(const rule* r, const disk_info* disk,
+    const rule_subject* sub, ULONG serialHash, DWORD* parts)
+{
+    if (!matchDisk(r, disk, sub, serialHash))
+        return RULE_NONE;
+
+    *parts = 0;
+    switch (r->action) {
+    case RULE_MOUNT:
+    case RULE_OPEN:
+        *parts = matchParts(r, disk, sub);
+        return *parts ? r->action : RULE_NONE;
+    default:
+        // whole disk actions may still require some partition to match
+        if ((r->flags & RULE_PART_FLAGS) && !matchParts(r, disk, sub))
+            return RULE_NONE;
+        return r->action;
+    }
+}
+
+static void addRule(rule_subject* sub, WORD n)
+{
+    sub->cand[(n - 1) / 32] |= 1u << ((n - 1) % 32);
+}
+
+static void addGrams(const rules* rs, PCWCH s, rule_subject* sub)
+{
+    for (; hasGram(s); ++s) {
+        const DWORD g = gramIndex(s);
+        const DWORD bit = 1u << (g % 32);
+        if (sub->seen[g / 32] & bit)
+            continue;
+        sub->seen[g / 32] |= bit;
+        // grams of other rules may share the chain
+        for (WORD n = rs->gram[g]; n; n = rs->rule[n - 1].next) {
+            const rule* r = &rs->rule[n - 1];
+            if (sameGram(r->gram, s))
+                addRule(sub, n);
+        }
+    }
+}
+
+static void foldCopy(PWCHAR dst, DWORD cch, PCWCH s)
+{
+    StringCchCopyW(dst, cch, s ? s : L"");
+    foldText(dst);
+}
+
+// Same as matchRules, *tried receives number of rules checked
+static rule_action matchCounted(const rules* rs, const disk_info* disk, DWORD* parts,
+    DWORD* tried)
+{
+    *tried = 0;
+    if (!rs || disk->e->error)
+        return RULE_NONE;
+
+    rule_subject sub[1];
+    ZeroMemory(sub->seen, sizeof(sub->seen));
+    ZeroMemory(sub->cand, sizeof(sub->cand));
+
+    const ULONG serialHash = hashSerial(disk->serial);
+    for (WORD n = rs->bucket[serialHash & (RULE_BUCKETS - 1)]; n; n = rs->rule[n - 1].next)
+        if (rs->rule[n - 1].serialHash == serialHash)
+            addRule(sub, n);
+    for (WORD n = rs->generic; n; n = rs->rule[n - 1].next)
+        addRule(sub, n);
+
+    foldCopy(sub->model, ARRAYSIZE(sub->model), disk->model);
+    addGrams(rs, sub->model, sub);
+    // type rules can't match without partitions
+    if (!disk->e_parts->error) {
+        for (DWORD j = 0; j < disk->n_parts && j < MAX_PARTS; ++j) {
+            foldCopy(sub->type[j], ARRAYSIZE(sub->type[j]), disk->part[j].type);
+            addGrams(rs, sub->type[j], sub);
+        }
+    }
+
+    // rules are numbered in file order, lowest bit first keeps it
+    for (DWORD w = 0; w < ARRAYSIZE(sub->cand); ++w) {
+        for (DWORD m = sub->cand[w]; m; m &= m - 1) {
+            unsigned long bit;
+            _BitScanForward(&bit, m);
+            ++*tried;
+            const rule_action action = matchRule(&rs->rule[w * 32 + bit], disk, sub,
+                serialHash, parts);
+            if (action != RULE_NONE)
+                return action;
+        }
+    }
+    return RULE_NONE;
+}
+
+rule_action matchRules(const rules* rs, const disk_info* disk, DWORD* parts)
+{
+    DWORD tried;
+    return matchCounted(rs, disk, parts, &tried);
+}
+
+#define BENCH_DISKS 32
+#define BENCH_PARTS 4
+
+typedef struct rules_bench {
+    rules rs;
+    disk_info disk[BENCH_DISKS];
+    WCHAR model[BENCH_DISKS][32];
+    WCHAR serial[BENCH_DISKS][16];
+    WCHAR text[MAX_RULES * 48];
+} rules_bench;
+
+// Ruleset of n rules of every kind, only the last one matches the disks
+static void benchText(PWCHAR text, DWORD cch, DWORD n)
+{
+    DWORD len = 0;
+    for (DWORD i = 0; i + 1 < n; ++i) {
+        PWCHAR line = text + len;
+        const DWORD left = cch - len;
+        switch (i % 4) {
+        case 0: wnsprintfW(line, left, L"serial=SN%05u action=bare\n", i); break;
+        case 1: wnsprintfW(line, left, L"model=\"Vendor%03u SSD\" part=1 action=mount\n", i); break;
+        case 2: wnsprintfW(line, left, L"model=USB%03u size=1G-2T action=open\n", i); break;
+        default: wnsprintfW(line, left, L"type=\"Type%03u\" action=mount\n", i); break;
+        }
+        len += lstrlenW(line);
+    }
+    wnsprintfW(text + len, cch - len, L"model=\"Generic Disk\" action=ignore\n");
+}
+
+DWORD benchRules(json* j, DWORD rounds, err_desc* e)
+{
+    static const DWORD sizes[] = { 16, 64, 128, MAX_RULES };
+
+    rules_bench* b = LocalAlloc(LMEM_ZEROINIT, sizeof(*b));
+    if (!b)
+        return setError(e, L"Failed to allocate benchmark");
+
+    for (DWORD i = 0; i < BENCH_DISKS; ++i) {
+        disk_info* disk = &b->disk[i];
+        wnsprintfW(b->model[i], ARRAYSIZE(b->model[i]), L"Generic Disk %u USB Device", i);
+        wnsprintfW(b->serial[i], ARRAYSIZE(b->serial[i]), L"DS%05u", i);
+        disk->index = i;
+        disk->model = b->model[i];
+        disk->serial = b->serial[i];
+        disk->size = (ULONGLONG)(i + 1) << 30;
+        disk->n_parts = BENCH_PARTS;
+        for (DWORD p = 0; p < BENCH_PARTS; ++p) {
+            disk->part[p].index = p + 1;
+            StringCchCopyW(disk->part[p].type, MAX_PART_TYPE, L"GPT: Basic Data");
+        }
+    }
+
+    DWORD code = 0;
+    for (DWORD s = 0; s < ARRAYSIZE(sizes) && !code; ++s) {
+        ZeroMemory(&b->rs, sizeof(b->rs));
+        benchText(b->text, ARRAYSIZE(b->text), sizes[s]);
+        compileRules(&b->rs, b->text, e);
+        if (e->error)
+            break;
+
+        ULONGLONG tried = 0;
+        const ULONGLONG start = nowUs();
+        for (DWORD r = 0; r < rounds && !code; ++r) {
+            for (DWORD i = 0; i < BENCH_DISKS; ++i) {
+                DWORD parts, n;
+                if (matchCounted(&b->rs, &b->disk[i], &parts, &n) != RULE_IGNORE) {
+                    code = setErrorCode(e, L"Benchmark rule didn't match", ERROR_INVALID_DATA);
+                    break;
+                }
+                tried += n;
+            }
+        }
+        if (code)
+            break;
+        const ULONGLONG elapsed = nowUs() - start;
+        const ULONGLONG matches = (ULONGLONG)rounds * BENCH_DISKS;
+
+        jsonBegin(j, NULL);
+        jsonString(j, "bench", L"rules");
+        jsonNumber(j, "rules", b->rs.n_rules);
+        jsonNumber(j, "matches", matches);
+        jsonNumber(j, "elapsed_us", elapsed);
+        jsonNumber(j, "ns_per_disk", elapsed * 1000 / matches);
+        // rules checked per disk, times 100
+        jsonNumber(j, "tried_x100", tried * 100 / matches);
+        jsonEnd(j);
+    }
+
+    LocalFree(b);
+    return code ? code : e->error;
+}
@@ -1,59 +1,134 @@
 #pragma once
 
+#include "core.h"
+
 #include <windows.h>
 #include <WbemCli.h>
 
-// Dynamic allocations are good if we need lots of memory.
-// But this a simple program. It has simple needs.
-#define MAX_DISKS 32
-#define MAX_PARTS 16
-#define MAX_PART_TYPE 64
-#define MAX_DRIVE_PATH 24
-
-// Container for readable error message with a title
-typedef struct err_desc {
-    PCWCH title;
-    PWCHAR text;
-    DWORD error; // windows error code
-} err_desc;
-
-#define ERRINIT() { .text = L"" }
-
-typedef struct part_info {
-    DWORD index;
-    ULONGLONG size;
-    WCHAR letter;
-} part_info;
-
-typedef struct disk_info {
-    err_desc e[1];
-    DWORD index;
-    PWCHAR model;
-    WCHAR path[MAX_DRIVE_PATH];
-    DWORD n_parts;
-    err_desc e_parts[1];
-    part_info part[MAX_PARTS];
-} disk_info;
+static const WCHAR* WSL_PATH = L"C:\\Windows\\System32\\wsl.exe";
+static const UINT DISK_POLL_MS = 500;
+static const UINT IO_SAMPLE_MS = 1000;
+static const UINT USAGE_TTL_MS = 10000;
+static const UINT DISK_PARTS_MS = 5000; // per disk, e.g. USB HDD spinning up
+static const UINT WMI_SLICE_MS = 250; // WMI waits check for exit this often
+
+// Device paths or image files of disks attached to WSL
+typedef struct mount_list {
+    DWORD n;
+    WCHAR path[MAX_DISKS][MAX_PATH];
+} mount_list;
+
+// What to do with a disk matched by auto-mount rule
+typedef enum rule_action {
+    RULE_NONE,   // no rule matched
+    RULE_IGNORE, // matched, but leave it alone
+    RULE_BARE,   // wsl --mount <disk> --bare
+    RULE_MOUNT,  // wsl --mount <disk> --partition <n>
+    RULE_OPEN,   // same as RULE_MOUNT, then open mount point in explorer
+} rule_action;
+
+// Compiled auto-mount rules, see rules.c
+typedef struct rules rules;
+
+// Tray window messages and menu commands, see main.c
+#define MAX_CMD (MAX_DISKS * MAX_PARTS)
+
+enum {
+    APP_NOTIFY = WM_APP + 1, // Tray icon notification callback message
+    APP_TASK_DONE = WM_APP + 2, // Worker finished a task, see pool.c
+    MENU_EXIT = 40001,
+    MENU_TRACE = 40002,
+    MENU_STATS = 40003,
+    MENU_EJECT = 40004,
+    MENU_COPY = 41000,
+    MENU_MOUNT = 42000,
+    MENU_UNMOUNT = 43000,
+    MENU_PART = 44000,
+    MENU_IOSTAT = 45000, // disabled labels with I/O rates
+    MENU_BENCH = 46000,
+    MENU_BENCH_PART = 47000,
+    IO_TIMER = 1, // disk poll timer uses state pointer as id
+};
 
 // Global program state
 typedef struct state {
     HINSTANCE hinst;
     HWND hwnd;
     HMENU menu;
+    HMENU diag; // diagnostics submenu
     HBITMAP shield;
     UINT_PTR timer;
 
     IWbemLocator* locator;
     IWbemServices* services;
     IEnumWbemClassObject* events;
+    // replaces WMI when set, e.g. synthetic disks for benchmarks
+    const struct disk_backend* backend;
+    // replaces wsl.exe and desktop when set, see sim.c
+    const struct shell_backend* shell;
+    // when the oldest unprocessed change event happened, nowUs() time
+    ULONGLONG event_us;
+    BOOL refreshing; // enumeration task is running
+    BOOL refresh_again; // change event came while it was running
+    ULONGLONG refresh_us; // when it was started
+    DWORD generation; // bumped on every new disk list, stale partitions are dropped
+    DWORD n_loading; // disks still waiting for partitions
 
     WCHAR dist[256]; // default wsl distribution name
+    BOOL dist_ready; // wsl --list has finished, successfully or not
+
+    rules* rules;
+    err_desc e_rules[1]; // if rules file could not be loaded
+    DWORD n_seen;
+    ULONG seen[MAX_DISKS]; // ids of disks already checked against rules
+
+    // disks attached to WSL by this program, unmounted on shutdown
+    mount_list mounted[1];
+    struct eject_task* eject; // Unmount all running on a worker, see main.c
+
+    // output of df for mounted partitions, refreshed at most every USAGE_TTL_MS
+    ULONGLONG usage_us; // when it was taken, 0 if never
+    DWORD n_usage;
+    fs_usage usage[MAX_USAGE];
+
+    // disk list published for other programs, see snapshot.h
+    HANDLE shm_lock; // owned while this instance publishes
+    HANDLE shm_map;
+    HANDLE shm_events[4]; // SNAPSHOT_EVENTS
+    struct snapshot* shm;
 
     err_desc e[1]; // if there was a problem to enumerate disks
     DWORD n_disks;
     disk_info disk[MAX_DISKS];
 } state;
 
+// Source of disk list and change events
+typedef struct disk_backend {
+    BOOL (*poll)(state* st);
+    // Fill disk list, disks are left loading
+    HRESULT (*drives)(state* st);
+    // List partitions of one loading disk, give up after timeout_ms
+    HRESULT (*parts)(state* st, disk_info* disk, DWORD timeout_ms);
+    // Drive letters of all partitions, may be NULL
+    DWORD (*letters)(state* st, part_letter* map, DWORD max);
+} disk_backend;
+
+// Everything tray commands do outside of the program
+typedef struct shell_backend {
+    // ShellExecuteEx, waits for the program if exitCode is not NULL.
+    // Returns 0 or error code, ERROR_CANCELLED if elevation was declined.
+    DWORD (*execute)(HWND hwnd, PCWCH verb, PCWCH file, PCWCH args, DWORD* exitCode);
+    // wsl.exe with args, n characters of its output are left in text,
+    // cut is set if it may have had more. Returns 0 or error code of starting it.
+    DWORD (*wsl)(PCWCH args, PWCHAR text, DWORD cch, DWORD* n, BOOL* cut, DWORD* exitCode);
+    // Same as ejectAll
+    DWORD (*eject)(mount_list* m, DWORD timeout_ms, PWCHAR report, DWORD cch);
+    BOOL (*exists)(PCWCH dir);
+    BOOL (*notify)(HWND hwnd, PCWCH text, PCWCH title, DWORD niif);
+    // Show popup menu, returns when it is closed
+    void (*popup)(HWND hwnd, HMENU menu);
+} shell_backend;
+
 // Free resources used by error
 void resetErr(err_desc* e);
 
@@ -64,18 +139,306 @@ DWORD setErrorCode(err_desc* e, PCWCH title, DWORD code);
 HRESULT initDisks(state* st);
 void deinitDisks(state* st);
 
-// Enumerate physical disks and fill disk_info array.
+// Enumerate physical disks and image files, fill disk_info array. Partitions
+// are listed per disk later with listDriveParts.
 // Returns 0 on success and GetLastError() on failure.
-HRESULT listDisks(state* st);
+HRESULT listDrives(state* st);
+HRESULT listDriveParts(state* st, disk_info* disk, DWORD timeout_ms);
 void resetDisks(state* st);
-// Return TRUE if there was a disk added/removed
+// Move disk list enumerated into another state, st must be reset
+void adoptDisks(state* st, state* from);
+// Move partitions listed into a copy of the disk, with size of image
+void adoptParts(disk_info* disk, disk_info* from);
+// Drive letters of all partitions in one query, NO_LETTERS on failure
+DWORD listLetters(state* st, part_letter* map, DWORD max);
+// Copy partitions of loading disks whose fingerprint is the same in old list,
+// drop cached blocks of the rest. Returns number of disks which need no listing.
+DWORD reuseParts(state* st, const state* old);
+// Set letters of listed partitions from map
+void applyLetters(state* st, const part_letter* map, DWORD n);
+// Return TRUE if there was a disk added/removed. Cached blocks of disks
+// whose letters the events name are dropped, see cache.c.
 BOOL pollDisks(state* st);
+// Same as pollDisks/listDrives/listDriveParts, but respect st->backend
+BOOL backendPoll(state* st);
+HRESULT backendDrives(state* st);
+HRESULT backendParts(state* st, disk_info* disk, DWORD timeout_ms);
+DWORD backendLetters(state* st, part_letter* map, DWORD max);
+// Disks with all their partitions, one disk after another
+HRESULT backendList(state* st);
+// Rebuild disk list and menu after change event, see main.c
+void refreshDisks(state* st);
+// Replace WMI with synthetic disks. Arrivals and removals are
+// injected by synthInject, each call is a burst of change events.
+// Every eighth disk takes slow_ms to list its partitions.
+// Same seed gives the same arrivals and removals, 0 is the default one.
+void synthStart(state* st, DWORD disks, DWORD slow_ms, ULONG seed);
+void synthInject(state* st, DWORD events);
+// Sleep, or spend virtual time when simulation is running
+void simSleep(DWORD ms);
+
+// Identity of a disk which survives re-enumeration
+ULONG diskId(const disk_info* disk);
+// Mount point of partition under /mnt/wsl: wsl.exe names it after the
+// device, PHYSICALDRIVE<n>p<partition>, images are given the same kind
+// of name. disk is device path or image name.
+void partMountName(PCWCH disk, DWORD partition, PWCHAR name, DWORD cch);
+
+// Create named shared memory for disk snapshot. Returns
+// ERROR_ALREADY_EXISTS if another instance publishes it.
+DWORD openSnapshot(state* st);
+void closeSnapshot(state* st);
+// Copy current disk list into shared memory and signal readers
+void publishSnapshot(state* st);
+
+// Read UTF-8 text file located next to executable. Returns NULL if it is
+// missing, or on error set in e with title. Free with LocalFree.
+PWCHAR readConfigFile(PCWCH name, PCWCH title, err_desc* e);
+// Load rules file located next to executable.
+// Missing file is not an error: st->rules stays NULL.
+DWORD loadRules(state* st);
+void freeRules(state* st);
+// Find first rule matching the disk.
+// For partition actions *parts receives bitmask of matching partitions.
+rule_action matchRules(const rules* r, const disk_info* disk, DWORD* parts);
+// Case insensitive FNV-1a hash of a string, chained through h
+ULONG hashText(ULONG h, PCWCH s);
+
+// Streaming JSON writer, one line per top-level value
+typedef struct json {
+    HANDLE out;
+    DWORD error; // set when output is gone, e.g. pipe closed
+    DWORD depth;
+    BOOL comma; // next value needs separator
+    DWORD n;
+    char buf[512];
+} json;
+
+void jsonBegin(json* j, PCSTR key);
+void jsonEnd(json* j);
+void jsonBeginArray(json* j, PCSTR key);
+void jsonEndArray(json* j);
+void jsonString(json* j, PCSTR key, PCWCH s);
+void jsonNumber(json* j, PCSTR key, ULONGLONG v);
+void jsonBool(json* j, PCSTR key, BOOL v);
+
+// Per-thread trace of begin/end events, see trace.c
+void initTrace(void);
+void traceEvent(PCWCH name, WCHAR phase);
+// Write Chrome trace event JSON. Returns 0 or error code.
+DWORD dumpTrace(PCWCH path);
+// Microseconds since initTrace()
+ULONGLONG nowUs(void);
+// Make nowUs return us, simulation runs on its own clock. 0 restores real time.
+void setVirtualClock(ULONGLONG us);
+ULONGLONG ticksToUs(LONGLONG ticks);
+
+#define TRACE_BEGIN(name) traceEvent(L##name, L'B')
+#define TRACE_END(name) traceEvent(L##name, L'E')
+
+// Always-on statistics, see stats.c
+typedef enum stat_counter {
+    STAT_REFRESHES,
+    STAT_QUERIES,
+    STAT_EVENTS,
+    STAT_EVENTS_COALESCED,
+    STAT_MOUNT_OK,
+    STAT_MOUNT_FAILED,
+    STAT_UNMOUNT_OK,
+    STAT_UNMOUNT_FAILED,
+    STAT_EJECT_TIMEOUT,
+    STAT_TASKS,
+    STAT_TASKS_STOLEN,
+    STAT_PARTS_TIMEOUT,
+    STAT_PARTS_REUSED,
+    STAT_PARTS_LISTED,
+    STAT_CACHE_HITS,
+    STAT_CACHE_MISSES,
+    STAT_CACHE_COALESCED,
+    STAT_CACHE_READS,
+    STAT_COUNTERS
+} stat_counter;
+
+typedef enum stat_hist {
+    HIST_ENUM,
+    HIST_QUERIES,
+    HIST_WSL_SPAWN,
+    HIST_WSL_EXIT,
+    HIST_WSL_RUNAS,
+    HIST_EVENT_TO_MENU,
+    HIST_IO_SAMPLE,
+    HIST_BENCH,
+    HIST_EJECT,
+    HIST_TASK_WAIT,
+    HIST_DISK_READY,
+    HIST_CACHE_READ,
+    HIST_COUNT
+} stat_hist;
+
+void statAdd(stat_counter c, LONG64 n);
+LONG64 statGet(stat_counter c);
+void statRecord(stat_hist h, ULONGLONG v);
+ULONGLONG statPercentile(stat_hist h, DWORD pct);
+ULONGLONG statCount(stat_hist h);
+// Forget recorded values, only safe when nobody records concurrently
+void statReset(stat_hist h);
+void formatHist(stat_hist h, PWCHAR text, DWORD cch);
+void formatCounter(stat_counter c, PWCHAR text, DWORD cch);
+// Write all statistics as JSON. Returns 0 or error code.
+DWORD exportStats(PCWCH path);
+
+// Live disk I/O rates, see iostat.c
+typedef struct io_rate {
+    ULONGLONG read_bps;
+    ULONGLONG write_bps;
+    ULONGLONG read_iops;
+    ULONGLONG write_iops;
+} io_rate;
+
+// Read I/O counters of all disks in one pass
+void sampleIo(state* st);
+// Returns FALSE if there are not enough samples yet
+BOOL getIoRate(const disk_info* disk, io_rate* r);
+void formatIoRate(const io_rate* r, PWCHAR text, DWORD cch);
+
+// Remember disks we attached, see eject.c
+BOOL isMounted(const mount_list* m, PCWCH path);
+void trackMount(mount_list* m, PCWCH path);
+void untrackMount(mount_list* m, PCWCH path);
+// Sync and unmount all listed disks in parallel within timeout.
+// Detached disks are removed from the list. The rest is listed
+// in report, one per line. Returns their number.
+DWORD ejectAll(mount_list* m, DWORD timeout_ms, PWCHAR report, DWORD cch);
+
+// Work-stealing executor for blocking operations, see pool.c
+typedef enum task_priority {
+    TASK_HIGH, // user is waiting, e.g. mount clicked
+    TASK_LOW,  // background refresh
+    TASK_PRIORITIES
+} task_priority;
+
+typedef void (*task_fn)(void* arg);
+
+// Completed tasks are posted to hwnd as msg, pass lparam to completeTask
+DWORD initPool(HWND hwnd, UINT msg);
+// Stop workers. Returns FALSE if some are still running a task after
+// a while: whatever tasks use must then stay alive until process exit.
+BOOL deinitPool(void);
+// TRUE once deinitPool started: long waits in tasks should give up
+BOOL poolStopping(void);
+// Run fn(arg) on a worker and then done(arg) on UI thread.
+// Without workers both run right away on the calling thread.
+void submitTask(task_priority prio, task_fn fn, task_fn done, void* arg);
+void completeTask(LPARAM lparam);
+// Hand all tasks to sink instead of workers, NULL restores workers
+typedef void (*task_sink)(task_priority prio, task_fn fn, task_fn done, void* arg);
+void setTaskSink(task_sink sink);
+
+// Cached metadata reads from a disk or image file, see cache.c.
+// Any offset and size; fails with last error set if the range is not all there.
+BOOL cacheRead(PCWCH path, ULONGLONG offset, void* buf, DWORD size);
+// Forget cached blocks of path, or of all devices if path is NULL
+void cacheInvalidate(PCWCH path);
+// Forget cached blocks of file path unless they were read while it had
+// the same stamp, e.g. write time mixed with size
+void cacheValidate(PCWCH path, ULONGLONG stamp);
+
+// Partition table fingerprint of a disk or image file mixed with its size,
+// 0 if it can't be read. With raw the table itself is read when partition
+// manager doesn't know it, which may wait for a sleeping disk. See layout.c
+ULONGLONG diskFingerprint(PCWCH path, ULONGLONG size, BOOL raw);
+
+// Disk image files listed in wsldskmnt.images, see image.c.
+// Appended to disk list after physical disks, left loading.
+void listImages(state* st);
+// Size and partitions of image disk, read from the file without attaching it
+HRESULT listImageParts(disk_info* disk);
+// Name of image file, MAX_DRIVE_PATH: the one it has in the image list,
+// or made of its file name the same way. Lists images if st has no disks.
+void imageMountName(state* st, PCWCH image, PWCHAR name);
+// Print format, block map and partitions of image file, with timings.
+// Returns 0 or error code set in e.
+DWORD inspectImage(json* j, PCWCH path, err_desc* e);
+
+// Read-only benchmark of a disk, or its partition if partition is not 0.
+// Prints one JSON line per test. Returns 0 or error code set in e.
+DWORD benchDisk(json* j, PCWCH path, DWORD partition, err_desc* e);
+// Publish synthetic disks to a private snapshot every interval_us while
+// reader threads copy and verify it, see snapshot.c. Returns 0, or error
+// code set in e, also when a reader saw a torn copy.
+DWORD benchSnapshot(json* j, DWORD readers, DWORD rounds, DWORD interval_us, err_desc* e);
+// Run the same random task graph of tasks on 1 to all pool workers,
+// see pool.c. Prints one JSON line per worker count with throughput and
+// steals. Returns 0 or error code set in e.
+DWORD benchPool(json* j, DWORD tasks, err_desc* e);
+// Sort, format and parse synthetic layouts of 1 to max_disks disks with
+// core.c helpers, not limited by MAX_DISKS, see synth.c. Prints one JSON
+// line per size. Returns 0 or error code set in e.
+#define CORE_BENCH_DISKS 10000
+DWORD benchCore(json* j, DWORD max_disks, err_desc* e);
+// Match synthetic disks against generated rulesets of growing size,
+// see rules.c. Prints one JSON line per ruleset.
+// Returns 0 or error code set in e.
+DWORD benchRules(json* j, DWORD rounds, err_desc* e);
+
+// Drive the tray with synthetic disks, fake wsl.exe and a user clicking
+// its menu for hours of virtual time. Prints one JSON line per simulated
+// interval and a summary. Returns 0 or error code set in e, also when
+// a benchmark menu item passed arguments bench-disk rejects. See sim.c
+DWORD runSimulation(state* st, json* j, DWORD hours, DWORD disks, ULONG seed, err_desc* e);
+
+// Tray without icon, timers, WMI or workers, for simulation.
+// Events are delivered with dispatchTray. See main.c
+DWORD startHeadlessTray(HWND hwnd, state* st);
+void stopHeadlessTray(state* st);
+LRESULT dispatchTray(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam);
+
+// Self checks, see check.c
+typedef struct check {
+    json* j;
+    PCWCH group;
+    PCWCH fixtures; // directory with sample images, see fixtures/make.py
+    DWORD passed;
+    DWORD failed;
+} check;
+
+// Count expectation, print it if it failed. Return ok.
+BOOL expect(check* c, BOOL ok, PCWCH what);
+BOOL expectNumber(check* c, ULONGLONG got, ULONGLONG want, PCWCH what);
+BOOL expectText(check* c, PCWCH got, PCWCH want, PCWCH what);
+// Path of sample image name in fixtures directory. Missing one is a failure.
+BOOL fixturePath(check* c, PCWCH name, PWCHAR path);
+// Check groups which need internals of their module
+void checkTrace(check* c);
+void checkStats(check* c);
+void checkIostat(check* c);
+void checkMounts(check* c);
+void checkLayout(check* c);
+void checkCache(check* c);
+void checkImages(check* c);
+void checkPool(check* c);
+// Run all check groups, or the one named. Prints one JSON line per group
+// and per failure. Returns FALSE if there is no such group.
+BOOL runChecks(json* j, PCWCH group, PCWCH fixtures, DWORD* failed);
+
+// Arguments of bench-disk after the verb: <disk> [partition].
+// Partition is 0 for the whole disk. Returns FALSE if CLI rejects them.
+BOOL parseBenchArgs(int argc, PWSTR* argv, DWORD* partition);
+// Headless mode, argv doesn't include program name.
+// Returns process exit code.
+int runCli(state* st, int argc, PWSTR* argv);
 
 static __inline disk_info* getDisk(state* st, DWORD i)
 {
     return &st->disk[i];
 }
 
+// What wsl.exe knows the disk by: device path or image file
+static __inline PCWCH diskDevice(const disk_info* disk)
+{
+    return disk->image[0] ? disk->image : disk->path;
+}
+
 static __inline part_info* getPart(disk_info* disk, DWORD i)
 {
     return &disk->part[i];
@@ -0,0 +1,621 @@
+#include "shared.h"
+
+#include <windows.h>
+#include <psapi.h>
+#include <Shlwapi.h>
+
+// Deterministic simulation of the tray event loop.
+// Handlers in main.c run as they are, everything around them is fake:
+// time is virtual, disks come from synth.c, worker pool is a queue of
+// events, wsl.exe and the desktop are replaced by a model of their own.
+// A run depends on the seed only, hours of hotplug churn and thousands
+// of menu commands take seconds.
+//
+// User opens the menu now and then and clicks an item a few seconds
+// later. The menu may be rebuilt meanwhile, just like a real one which
+// stays open during refresh, so the click may land on a stale item.
+// Items which touch clipboard or files or end the program are never
+// clicked.
+//
+// Time spent by tasks delays their completion, time spent by handlers
+// on UI thread (sleep eject) delays everything after them.
+
+#define SIM_EVENTS 64 // one per kind, and one per busy worker
+#define SIM_QUEUE 256 // tasks waiting for a worker, per priority
+#define SIM_WORKERS 4 // same as in pool.c
+#define SIM_CHOICES 1024 // clickable items of the menu
+#define SIM_SLOW_MS 2000 // every eighth disk, see synth.c
+
+static const ULONGLONG SIM_START_US = 1000000; // 0 is "never" for timestamps in state
+static const ULONGLONG SIM_TASK_US = 200; // least time a task takes
+static const ULONGLONG SIM_REPORT_US = 600 * 1000000ull;
+
+typedef enum sim_kind {
+    SIM_TICK,    // disk poll timer
+    SIM_HOTPLUG, // burst of arrivals and removals
+    SIM_OPEN,    // user opens tray menu
+    SIM_CLICK,   // and picks an item of it
+    SIM_SUSPEND, // system goes to sleep
+    SIM_REPORT,
+    SIM_DONE,    // worker finished a task
+} sim_kind;
+
+typedef struct sim_task {
+    task_fn fn;
+    task_fn done;
+    void* arg;
+    ULONGLONG queued_us;
+} sim_task;
+
+typedef struct sim_event {
+    ULONGLONG at;
+    ULONGLONG seq; // events due at the same time keep their order
+    sim_kind kind;
+    sim_task task; // of SIM_DONE
+} sim_event;
+
+typedef struct task_queue {
+    DWORD head;
+    DWORD n;
+    sim_task t[SIM_QUEUE];
+} task_queue;
+
+typedef struct sim {
+    state* st;
+    HWND hwnd;
+    ULONGLONG now;
+    ULONGLONG end; // no more user and hotplug events after that
+    ULONGLONG seq;
+    ULONG rnd;
+    ULONGLONG cost; // virtual time spent by running task or handler
+    DWORD busy; // workers running a task
+    DWORD in_flight; // tasks submitted and not done yet
+    task_queue queue[TASK_PRIORITIES];
+    DWORD n_events;
+    sim_event heap[SIM_EVENTS];
+    BOOL menu_open; // click is coming
+    DWORD n_choices;
+    UINT choice[SIM_CHOICES]; // items of menu when it was opened
+
+    // WSL side: attached disks and mounted partitions by drive number
+    ULONG attached;
+    ULONG mounted[MAX_DISKS];
+
+    ULONGLONG events;
+    ULONGLONG clicks;
+    ULONGLONG notices;
+    ULONGLONG benches; // benchmark consoles started
+    ULONGLONG bench_rejected; // with arguments CLI doesn't accept
+    ULONGLONG peak_private;
+} sim;
+
+static sim g_sim[1];
+
+static ULONG simRandom(sim* s)
+{
+    // xorshift32, same as synth.c
+    ULONG x = s->rnd;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return s->rnd = x;
+}
+
+static ULONG simBetween(sim* s, ULONG lo, ULONG hi)
+{
+    return lo + simRandom(s) % (hi - lo + 1);
+}
+
+static BOOL simChance(sim* s, ULONG percent)
+{
+    return simRandom(s) % 100 < percent;
+}
+
+static BOOL eventBefore(const sim_event* a, const sim_event* b)
+{
+    return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+static void swapEvents(sim_event* a, sim_event* b)
+{
+    const sim_event t = *a;
+    *a = *b;
+    *b = t;
+}
+
+static void pushEvent(sim* s, ULONGLONG at, sim_kind kind, const sim_task* task)
+{
+    if (s->n_events == SIM_EVENTS)
+        return; // can't happen, every kind is pending once at most
+
+    DWORD i = s->n_events++;
+    sim_event* e = &s->heap[i];
+    e->at = at;
+    e->seq = s->seq++;
+    e->kind = kind;
+    if (task)
+        e->task = *task;
+    while (i && eventBefore(&s->heap[i], &s->heap[(i - 1) / 2])) {
+        swapEvents(&s->heap[i], &s->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+}
+
+static void popEvent(sim* s, sim_event* e)
+{
+    *e = s->heap[0];
+    s->heap[0] = s->heap[--s->n_events];
+    for (DWORD i = 0;;) {
+        DWORD min = i;
+        const DWORD l = 2 * i + 1;
+        const DWORD r = l + 1;
+        if (l < s->n_events && eventBefore(&s->heap[l], &s->heap[min]))
+            min = l;
+        if (r < s->n_events && eventBefore(&s->heap[r], &s->heap[min]))
+            min = r;
+        if (min == i)
+            break;
+        swapEvents(&s->heap[i], &s->heap[min]);
+        i = min;
+    }
+}
+
+static void setNow(sim* s, ULONGLONG now)
+{
+    s->now = now;
+    setVirtualClock(now);
+}
+
+void simSleep(DWORD ms)
+{
+    sim* s = g_sim;
+    if (s->hwnd)
+        s->cost += ms * 1000ull;
+    else
+        Sleep(ms);
+}
+
+static void simSubmit(task_priority prio, task_fn fn, task_fn done, void* arg)
+{
+    sim* s = g_sim;
+    task_queue* q = &s->queue[prio];
+    if (q->n == SIM_QUEUE) {
+        // like pool.c when deque is full
+        fn(arg);
+        if (done)
+            done(arg);
+        return;
+    }
+    sim_task* t = &q->t[(q->head + q->n++) % SIM_QUEUE];
+    t->fn = fn;
+    t->done = done;
+    t->arg = arg;
+    t->queued_us = s->now;
+    s->in_flight++;
+}
+
+// Idle workers take queued tasks, high priority first.
+// Task runs right away, its result is delivered when its time is spent.
+static void startTasks(sim* s)
+{
+    for (DWORD prio = 0; prio < TASK_PRIORITIES && s->busy < SIM_WORKERS;) {
+        task_queue* q = &s->queue[prio];
+        if (!q->n) {
+            prio++;
+            continue;
+        }
+        const sim_task t = q->t[q->head];
+        q->head = (q->head + 1) % SIM_QUEUE;
+        q->n--;
+
+        statRecord(HIST_TASK_WAIT, s->now - t.queued_us);
+        statAdd(STAT_TASKS, 1);
+        s->cost = SIM_TASK_US;
+        t.fn(t.arg);
+        s->busy++;
+        pushEvent(s, s->now + s->cost, SIM_DONE, &t);
+    }
+}
+
+// Drive number and partition of \\.\PHYSICALDRIVE<n> or its mount point
+// PHYSICALDRIVE<n>p<part>. Returns MAX_DISKS if there is none.
+static DWORD parseDrive(PCWCH s, DWORD* part)
+{
+    static const WCHAR prefix[] = L"PHYSICALDRIVE";
+    *part = 0;
+    PCWCH p = StrStrIW(s, prefix);
+    if (!p)
+        return MAX_DISKS;
+    p += ARRAYSIZE(prefix) - 1;
+
+    DWORD n = 0;
+    for (; *p >= L'0' && *p <= L'9' && n < MAX_DISKS; p++)
+        n = n * 10 + (*p - L'0');
+    if (*p == L'p')
+        StrToIntExW(p + 1, STIF_DEFAULT, (int*)part);
+
+    // wsl --mount <disk> --partition <part>
+    PCWCH option = StrStrIW(s, L"--partition ");
+    if (option)
+        StrToIntExW(option + 12, STIF_DEFAULT, (int*)part);
+    return min(n, MAX_DISKS);
+}
+
+static DWORD simMount(sim* s, PCWCH args)
+{
+    DWORD part;
+    const DWORD d = parseDrive(args, &part);
+    // attaching takes a while, now and then it fails
+    s->cost += simBetween(s, 500, 2000) * 1000ull;
+    if (d >= MAX_DISKS || part > MAX_PARTS || simChance(s, 5))
+        return 1;
+
+    if (part) {
+        if (s->mounted[d] & (1u << (part - 1)))
+            return 1; // already mounted
+        s->mounted[d] |= 1u << (part - 1);
+    }
+    s->attached |= 1u << d;
+    return 0;
+}
+
+static void simDetach(sim* s, DWORD d)
+{
+    s->attached &= ~(1u << d);
+    s->mounted[d] = 0;
+}
+
+// Benchmark console: cmd /k ""<exe>" bench-disk <disk> [partition]".
+// Its arguments are checked the way the elevated CLI would parse them.
+static void simBench(sim* s, PCWCH args)
+{
+    WCHAR line[MAX_PATH + 64];
+    PWSTR argv[4];
+    int argc = 0;
+    DWORD part;
+    s->benches++;
+
+    PCWCH p = StrStrIW(args, L"\" bench-disk ");
+    if (p) {
+        StringCchCopyW(line, ARRAYSIZE(line), p + 13);
+        // split at spaces up to closing quote of cmd /k
+        PWSTR t = line;
+        while (*t && *t != L'"' && argc < (int)ARRAYSIZE(argv)) {
+            argv[argc++] = t;
+            while (*t && *t != L' ' && *t != L'"')
+                t++;
+            if (*t == L' ')
+                *t++ = 0;
+        }
+        *t = 0;
+    }
+    if (!p || !parseBenchArgs(argc, argv, &part))
+        s->bench_rejected++;
+}
+
+static DWORD simExecute(HWND hwnd, PCWCH verb, PCWCH file, PCWCH args, DWORD* exitCode)
+{
+    UNREFERENCED_PARAMETER(hwnd);
+    sim* s = g_sim;
+    if (lstrcmpiW(verb, L"runas")) {
+        s->cost += 50 * 1000ull; // explorer window
+        return 0;
+    }
+
+    // user takes a moment to answer UAC prompt, sometimes says no
+    s->cost += simBetween(s, 300, 3000) * 1000ull;
+    if (simChance(s, 5))
+        return ERROR_CANCELLED;
+    // benchmark console is not waited for
+    if (!lstrcmpiW(file, L"cmd.exe"))
+        simBench(s, args);
+    if (exitCode)
+        *exitCode = simMount(s, args);
+    return 0;
+}
+
+static DWORD appendText(PWCHAR text, DWORD cch, DWORD n, PCWCH line)
+{
+    wnsprintfW(text + n, cch - n, L"%s\r\n", line);
+    return n + lstrlenW(text + n);
+}
+
+static DWORD simWsl(PCWCH args, PWCHAR text, DWORD cch, DWORD* n, BOOL* cut, DWORD* exitCode)
+{
+    sim* s = g_sim;
+    // VM is up most of the time, sometimes it has to start
+    s->cost += (simChance(s, 10) ? simBetween(s, 2000, 6000) : simBetween(s, 100, 400)) * 1000ull;
+    *n = 0;
+    *exitCode = 0;
+
+    DWORD part;
+    if (StrStrIW(args, L"--list")) {
+        *n = appendText(text, cch, *n, L"  NAME      STATE           VERSION");
+        *n = appendText(text, cch, *n, L"* Ubuntu    Running         2");
+    }
+    else if (StrStrIW(args, L"--unmount")) {
+        DWORD d = parseDrive(args, &part);
+        if (d < MAX_DISKS && !(s->attached & (1u << d))) {
+            *n = appendText(text, cch, *n, L"The disk is not attached.");
+            *exitCode = 1;
+        }
+        else if (d < MAX_DISKS)
+            simDetach(s, d);
+        else
+            for (d = 0; d < MAX_DISKS; d++)
+                simDetach(s, d);
+    }
+    else if (StrStrIW(args, L"df ")) {
+        *n = appendText(text, cch, *n, L"Filesystem 1024-blocks Used Available Capacity Mounted on");
+        for (DWORD d = 0; d < MAX_DISKS; d++)
+            for (DWORD p = 0; p < MAX_PARTS; p++) {
+                if (!(s->mounted[d] & (1u << p)))
+                    continue;
+                WCHAR line[128];
+                wnsprintfW(line, ARRAYSIZE(line), L"/dev/sd%c%u 1048576 %u %u 50%% /mnt/wsl/PHYSICALDRIVE%up%u",
+                    L'c' + d % 24, p + 1, 1024 * (d + 1), 1048576 - 1024 * (d + 1), d, p + 1);
+                *n = appendText(text, cch, *n, line);
+            }
+    }
+    else
+        *exitCode = 1;
+    *cut = *n + 1 >= cch;
+    return 0;
+}
+
+static DWORD simEject(mount_list* m, DWORD timeout_ms, PWCHAR report, DWORD cch)
+{
+    UNREFERENCED_PARAMETER(timeout_ms);
+    sim* s = g_sim;
+    report[0] = 0;
+    if (!m->n)
+        return 0;
+
+    // sync, then all disks detach at once
+    const ULONGLONG before = s->cost;
+    s->cost += simBetween(s, 100, 1000) * 1000ull + simBetween(s, 300, 1500) * 1000ull;
+    DWORD failed = 0;
+    for (DWORD i = m->n; i-- > 0;) {
+        DWORD part;
+        const DWORD d = parseDrive(m->path[i], &part);
+        if (simChance(s, 5)) {
+            const DWORD n = lstrlenW(report);
+            wnsprintfW(report + n, cch - n, L"%s%s: timed out", n ? L"\n" : L"", m->path[i]);
+            statAdd(STAT_EJECT_TIMEOUT, 1);
+            failed++;
+            continue;
+        }
+        if (d < MAX_DISKS)
+            simDetach(s, d);
+        statAdd(STAT_UNMOUNT_OK, 1);
+        untrackMount(m, m->path[i]);
+    }
+    statRecord(HIST_EJECT, s->cost - before);
+    return failed;
+}
+
+static BOOL simExists(PCWCH dir)
+{
+    sim* s = g_sim;
+    s->cost += 5 * 1000ull; // \\wsl$ probe
+    DWORD part;
+    const DWORD d = parseDrive(dir, &part);
+    return d < MAX_DISKS && part && part <= MAX_PARTS && (s->mounted[d] & (1u << (part - 1)));
+}
+
+static BOOL simNotify(HWND hwnd, PCWCH text, PCWCH title, DWORD niif)
+{
+    UNREFERENCED_PARAMETER(hwnd);
+    UNREFERENCED_PARAMETER(text);
+    UNREFERENCED_PARAMETER(title);
+    UNREFERENCED_PARAMETER(niif);
+    g_sim->notices++;
+    return TRUE;
+}
+
+static BOOL isClickable(UINT id)
+{
+    static const UINT ranges[] = { MENU_MOUNT, MENU_UNMOUNT, MENU_PART, MENU_BENCH, MENU_BENCH_PART };
+    if (id == MENU_EJECT)
+        return TRUE;
+    for (DWORD i = 0; i < ARRAYSIZE(ranges); i++)
+        if (id >= ranges[i] && id < ranges[i] + MAX_CMD)
+            return TRUE;
+    return FALSE;
+}
+
+static void listChoices(sim* s, HMENU menu)
+{
+    const int n = GetMenuItemCount(menu);
+    for (int i = 0; i < n; i++) {
+        MENUITEMINFOW mii = {
+            .cbSize = sizeof(mii),
+            .fMask = MIIM_ID | MIIM_STATE | MIIM_SUBMENU,
+        };
+        if (!GetMenuItemInfoW(menu, i, TRUE, &mii))
+            continue;
+        if (mii.hSubMenu)
+            listChoices(s, mii.hSubMenu);
+        else if (!(mii.fState & MFS_DISABLED) && isClickable(mii.wID) && s->n_choices < SIM_CHOICES)
+            s->choice[s->n_choices++] = mii.wID;
+    }
+}
+
+static void simPopup(HWND hwnd, HMENU menu)
+{
+    UNREFERENCED_PARAMETER(hwnd);
+    sim* s = g_sim;
+    s->n_choices = 0;
+    listChoices(s, menu);
+    // menu is often closed without clicking anything
+    s->menu_open = s->n_choices && simChance(s, 80);
+    if (s->menu_open)
+        pushEvent(s, s->now + simBetween(s, 1000, 8000) * 1000ull, SIM_CLICK, NULL);
+}
+
+static const shell_backend simShell = {
+    .execute = simExecute,
+    .wsl = simWsl,
+    .eject = simEject,
+    .exists = simExists,
+    .notify = simNotify,
+    .popup = simPopup,
+};
+
+static void simReport(sim* s, json* j)
+{
+    PROCESS_MEMORY_COUNTERS_EX pmc = { .cb = sizeof(pmc), };
+    GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&pmc, sizeof(pmc));
+    s->peak_private = max(s->peak_private, pmc.PrivateUsage);
+
+    jsonBegin(j, NULL);
+    jsonNumber(j, "sim_s", (s->now - SIM_START_US) / 1000000);
+    jsonNumber(j, "events", s->events);
+    jsonNumber(j, "clicks", s->clicks);
+    jsonNumber(j, "refreshes", statGet(STAT_REFRESHES));
+    jsonNumber(j, "disks", s->st->n_disks);
+    jsonNumber(j, "mounted", s->st->mounted->n);
+    jsonNumber(j, "tasks_in_flight", s->in_flight);
+    jsonNumber(j, "event_to_menu_p50_us", statPercentile(HIST_EVENT_TO_MENU, 50));
+    jsonNumber(j, "event_to_menu_p99_us", statPercentile(HIST_EVENT_TO_MENU, 99));
+    jsonNumber(j, "disk_ready_p99_us", statPercentile(HIST_DISK_READY, 99));
+    jsonNumber(j, "task_wait_p99_us", statPercentile(HIST_TASK_WAIT, 99));
+    jsonNumber(j, "private_kb", pmc.PrivateUsage >> 10);
+    jsonNumber(j, "user_objects", GetGuiResources(GetCurrentProcess(), GR_USEROBJECTS));
+    jsonNumber(j, "gdi_objects", GetGuiResources(GetCurrentProcess(), GR_GDIOBJECTS));
+    jsonEnd(j);
+
+    // latency is reported per interval
+    statReset(HIST_EVENT_TO_MENU);
+    statReset(HIST_DISK_READY);
+    statReset(HIST_TASK_WAIT);
+}
+
+static void simEvent(sim* s, json* j, const sim_event* e)
+{
+    state* st = s->st;
+    HWND hwnd = s->hwnd;
+    switch (e->kind) {
+    case SIM_TICK:
+        dispatchTray(hwnd, WM_TIMER, (WPARAM)st, 0);
+        pushEvent(s, s->now + DISK_POLL_MS * 1000ull, SIM_TICK, NULL);
+        break;
+    case SIM_HOTPLUG:
+        synthInject(st, simBetween(s, 1, 4));
+        pushEvent(s, s->now + simBetween(s, 5, 120) * 1000000ull, SIM_HOTPLUG, NULL);
+        break;
+    case SIM_OPEN:
+        // popup menu is modal, it can't be opened twice
+        if (!s->menu_open)
+            dispatchTray(hwnd, APP_NOTIFY, 0, WM_RBUTTONUP);
+        pushEvent(s, s->now + simBetween(s, 2, 20) * 1000000ull, SIM_OPEN, NULL);
+        break;
+    case SIM_CLICK:
+        s->menu_open = FALSE;
+        s->clicks++;
+        dispatchTray(hwnd, WM_COMMAND, s->choice[simRandom(s) % s->n_choices], 0);
+        break;
+    case SIM_SUSPEND:
+        dispatchTray(hwnd, WM_POWERBROADCAST, PBT_APMSUSPEND, 0);
+        pushEvent(s, s->now + simBetween(s, 30, 120) * 60000000ull, SIM_SUSPEND, NULL);
+        break;
+    case SIM_REPORT:
+        simReport(s, j);
+        pushEvent(s, s->now + SIM_REPORT_US, SIM_REPORT, NULL);
+        break;
+    case SIM_DONE:
+        s->busy--;
+        s->in_flight--;
+        if (e->task.done)
+            e->task.done(e->task.arg);
+        break;
+    }
+}
+
+static void simRun(sim* s, json* j)
+{
+    for (;;) {
+        startTasks(s);
+        if (!s->n_events)
+            break;
+
+        sim_event e[1];
+        popEvent(s, e);
+        // once the time is up only tasks are finished
+        if (e->kind != SIM_DONE && e->at >= s->end)
+            continue;
+
+        setNow(s, max(s->now, e->at));
+        s->events++;
+        s->cost = 0;
+        simEvent(s, j, e);
+        // UI thread was busy, everything else waited
+        if (s->cost)
+            setNow(s, s->now + s->cost);
+    }
+}
+
+DWORD runSimulation(state* st, json* j, DWORD hours, DWORD disks, ULONG seed, err_desc* e)
+{
+    sim* s = g_sim;
+    const ULONGLONG wall = nowUs();
+
+    // message-only window, it only holds state for handlers
+    HWND hwnd = CreateWindowExW(0, L"STATIC", NULL, 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, NULL, NULL);
+    if (!hwnd)
+        return setError(e, L"Failed to create window");
+
+    s->st = st;
+    s->hwnd = hwnd;
+    s->rnd = seed * 2654435761u | 1;
+    setNow(s, SIM_START_US);
+    s->end = s->now + hours * 3600 * 1000000ull;
+
+    synthStart(st, disks, SIM_SLOW_MS, seed);
+    st->shell = &simShell;
+    setTaskSink(simSubmit);
+
+    const DWORD code = startHeadlessTray(hwnd, st);
+    if (code)
+        setErrorCode(e, L"Failed to create menu", code);
+    else {
+        pushEvent(s, s->now + DISK_POLL_MS * 1000ull, SIM_TICK, NULL);
+        pushEvent(s, s->now + simBetween(s, 5, 120) * 1000000ull, SIM_HOTPLUG, NULL);
+        pushEvent(s, s->now + simBetween(s, 2, 20) * 1000000ull, SIM_OPEN, NULL);
+        pushEvent(s, s->now + simBetween(s, 30, 120) * 60000000ull, SIM_SUSPEND, NULL);
+        pushEvent(s, s->now + SIM_REPORT_US, SIM_REPORT, NULL);
+        simRun(s, j);
+        simReport(s, j);
+    }
+
+    stopHeadlessTray(st);
+    setTaskSink(NULL);
+    st->shell = NULL;
+    st->backend = NULL;
+    const ULONGLONG sim_s = (s->now - SIM_START_US) / 1000000;
+    setVirtualClock(0);
+
+    if (!code) {
+        jsonBegin(j, NULL);
+        jsonString(j, "simulation", L"done");
+        jsonNumber(j, "seed", seed);
+        jsonNumber(j, "sim_s", sim_s);
+        jsonNumber(j, "wall_us", nowUs() - wall);
+        jsonNumber(j, "events", s->events);
+        jsonNumber(j, "clicks", s->clicks);
+        jsonNumber(j, "notifications", s->notices);
+        jsonNumber(j, "benchmarks", s->benches);
+        jsonNumber(j, "bench_rejected", s->bench_rejected);
+        jsonNumber(j, "tasks", statGet(STAT_TASKS));
+        // every task must have been completed after the drain
+        jsonNumber(j, "tasks_leaked", s->in_flight);
+        jsonNumber(j, "peak_private_kb", s->peak_private >> 10);
+        jsonEnd(j);
+    }
+    DestroyWindow(hwnd);
+    s->hwnd = NULL;
+    if (!code && s->bench_rejected)
+        return setErrorCode(e, L"Benchmark menu item passed arguments CLI rejects",
+            ERROR_INVALID_PARAMETER);
+    return code;
+}
@@ -0,0 +1,306 @@
+#include "shared.h"
+#include "snapshot.h"
+
+#include <windows.h>
+#include <strsafe.h>
+
+C_ASSERT(SNAPSHOT_DISKS >= MAX_DISKS);
+C_ASSERT(SNAPSHOT_PARTS >= MAX_PARTS);
+C_ASSERT(SNAPSHOT_PATH >= MAX_DRIVE_PATH);
+C_ASSERT(SNAPSHOT_IMAGE >= MAX_PATH);
+
+C_ASSERT(SNAPSHOT_EVENTS == ARRAYSIZE(((state*)0)->shm_events));
+
+// Map snapshot and create its update events: named ones other programs
+// can open, or private ones for benchmark
+static DWORD mapSnapshot(state* st, BOOL named)
+{
+    st->shm_map = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+        0, sizeof(snapshot), named ? SNAPSHOT_NAME : NULL);
+    if (!st->shm_map)
+        return GetLastError();
+
+    st->shm = MapViewOfFile(st->shm_map, FILE_MAP_WRITE, 0, 0, sizeof(snapshot));
+    for (DWORD i = 0; st->shm && i < SNAPSHOT_EVENTS; i++) {
+        st->shm_events[i] = CreateEventW(NULL, TRUE, FALSE,
+            named ? SNAPSHOT_EVENT_NAMES[i] : NULL);
+        if (!st->shm_events[i])
+            break;
+        // may be left set by previous publisher
+        ResetEvent(st->shm_events[i]);
+    }
+    if (!st->shm || !st->shm_events[SNAPSHOT_EVENTS - 1]) {
+        const DWORD code = GetLastError();
+        closeSnapshot(st);
+        return code;
+    }
+
+    // Mapping may be left from previous instance which died while
+    // writing it. Nobody else writes it now, so seq can be fixed.
+    snapshot* shm = st->shm;
+    shm->seq &= ~1;
+    shm->size = sizeof(*shm);
+    shm->version = SNAPSHOT_VERSION;
+    MemoryBarrier();
+    shm->magic = SNAPSHOT_MAGIC;
+    return 0;
+}
+
+DWORD openSnapshot(state* st)
+{
+    // Two publishers would break the seqlock, so only the instance which
+    // owns the mutex publishes. Mutex of a dead one is abandoned and
+    // can be taken over.
+    st->shm_lock = CreateMutexW(NULL, FALSE, SNAPSHOT_PUBLISHER);
+    if (!st->shm_lock)
+        return GetLastError();
+
+    switch (WaitForSingleObject(st->shm_lock, 0)) {
+    case WAIT_OBJECT_0:
+    case WAIT_ABANDONED:
+        return mapSnapshot(st, TRUE);
+    default:
+        CloseHandle(st->shm_lock);
+        st->shm_lock = NULL;
+        return ERROR_ALREADY_EXISTS;
+    }
+}
+
+void closeSnapshot(state* st)
+{
+    if (st->shm)
+        UnmapViewOfFile(st->shm);
+    st->shm = NULL;
+    if (st->shm_map)
+        CloseHandle(st->shm_map);
+    st->shm_map = NULL;
+    for (DWORD i = 0; i < SNAPSHOT_EVENTS; i++) {
+        if (st->shm_events[i])
+            CloseHandle(st->shm_events[i]);
+        st->shm_events[i] = NULL;
+    }
+    if (st->shm_lock) {
+        ReleaseMutex(st->shm_lock);
+        CloseHandle(st->shm_lock);
+    }
+    st->shm_lock = NULL;
+}
+
+static void copyText(PWCHAR dst, DWORD cch, PCWCH src)
+{
+    if (src)
+        StringCchCopyW(dst, cch, src);
+    else
+        dst[0] = 0;
+}
+
+static void copyDisk(snapshot_disk* dst, const disk_info* disk)
+{
+    dst->size = disk->size;
+    dst->index = disk->index;
+    dst->error = disk->e->error ? disk->e->error : disk->e_parts->error;
+    dst->n_parts = dst->error ? 0 : min(disk->n_parts, MAX_PARTS);
+    copyText(dst->path, ARRAYSIZE(dst->path), disk->path);
+    copyText(dst->image, ARRAYSIZE(dst->image), disk->image);
+    copyText(dst->model, ARRAYSIZE(dst->model), disk->model);
+    copyText(dst->serial, ARRAYSIZE(dst->serial), disk->serial);
+
+    for (DWORD j = 0; j < dst->n_parts; j++) {
+        const part_info* part = &disk->part[j];
+        snapshot_part* p = &dst->part[j];
+        p->size = part->size;
+        p->index = part->index;
+        p->letter = part->letter;
+        copyText(p->type, ARRAYSIZE(p->type), part->type);
+    }
+}
+
+void publishSnapshot(state* st)
+{
+    snapshot* shm = st->shm;
+    if (!shm)
+        return;
+
+    // Readers of generation g - 1 wait for events of g and g + 1,
+    // event of g + 2 must not be set any more once g is visible
+    const ULONGLONG g = shm->data.generation + 1;
+    ResetEvent(st->shm_events[(g + 2) % SNAPSHOT_EVENTS]);
+
+    // interlocked operations are full barriers
+    InterlockedIncrement(&shm->seq);
+
+    snapshot_data* data = &shm->data;
+    data->error = st->e->error;
+    data->n_disks = st->n_disks;
+    for (DWORD i = 0; i < st->n_disks; i++)
+        copyDisk(&data->disk[i], getDisk(st, i));
+    data->generation = g;
+
+    InterlockedIncrement(&shm->seq);
+
+    SetEvent(st->shm_events[g % SNAPSHOT_EVENTS]);
+}
+
+typedef struct snapshot_bench {
+    const snapshot* shm;
+    const HANDLE* events;
+    volatile LONG stop;
+} snapshot_bench;
+
+typedef struct reader_counts {
+    ULONGLONG reads;
+    ULONGLONG torn; // copy doesn't match its generation
+    ULONGLONG failed; // snapshotRead gave up
+    ULONGLONG wakeups;
+    ULONGLONG timeouts; // update was missed
+} reader_counts;
+
+typedef struct snapshot_reader {
+    snapshot_bench* b;
+    reader_counts n;
+    snapshot_data data;
+} snapshot_reader;
+
+// Every generation has its own disk count, sizes and partitions,
+// so a copy mixed from two generations doesn't add up
+static void fillBench(state* st, ULONGLONG g)
+{
+    st->n_disks = 1 + (DWORD)(g % MAX_DISKS);
+    for (DWORD i = 0; i < st->n_disks; i++) {
+        disk_info* disk = getDisk(st, i);
+        disk->index = i;
+        disk->size = g * 1000 + i;
+        disk->n_parts = (DWORD)((g + i) % (MAX_PARTS + 1));
+        for (DWORD j = 0; j < disk->n_parts; j++) {
+            disk->part[j].index = j;
+            disk->part[j].size = g + i + j;
+        }
+    }
+}
+
+static BOOL checkBench(const snapshot_data* data)
+{
+    const ULONGLONG g = data->generation;
+    if (data->n_disks != 1 + g % MAX_DISKS)
+        return FALSE;
+
+    for (DWORD i = 0; i < data->n_disks; i++) {
+        const snapshot_disk* disk = &data->disk[i];
+        if (disk->index != i || disk->size != g * 1000 + i ||
+            disk->n_parts != (g + i) % (MAX_PARTS + 1))
+            return FALSE;
+        for (DWORD j = 0; j < disk->n_parts; j++)
+            if (disk->part[j].index != j || disk->part[j].size != g + i + j)
+                return FALSE;
+    }
+    return TRUE;
+}
+
+static DWORD WINAPI benchReader(LPVOID param)
+{
+    snapshot_reader* r = param;
+    const snapshot_bench* b = r->b;
+    ULONGLONG seen = 0;
+    while (!b->stop) {
+        if (snapshotRead(b->shm, &r->data)) {
+            r->n.reads++;
+            if (!checkBench(&r->data))
+                r->n.torn++;
+            seen = r->data.generation;
+        }
+        else {
+            r->n.failed++;
+        }
+
+        if (snapshotWait(b->shm, b->events, seen, 1000))
+            r->n.wakeups++;
+        else
+            r->n.timeouts++;
+    }
+    return 0;
+}
+
+DWORD benchSnapshot(json* j, DWORD readers, DWORD rounds, DWORD interval_us, err_desc* e)
+{
+    const PCWCH title = L"Snapshot benchmark failed";
+    state* st = LocalAlloc(LMEM_ZEROINIT, sizeof(*st));
+    snapshot_reader* r = LocalAlloc(LMEM_ZEROINIT, readers * sizeof(*r));
+    HANDLE* threads = LocalAlloc(LMEM_ZEROINIT, readers * sizeof(*threads));
+    DWORD code = 0;
+    if (!st || !r || !threads) {
+        code = setError(e, title);
+        goto out;
+    }
+
+    code = mapSnapshot(st, FALSE);
+    if (code) {
+        setErrorCode(e, title, code);
+        goto out;
+    }
+    fillBench(st, 1);
+    publishSnapshot(st);
+
+    snapshot_bench b = { .shm = st->shm, .events = st->shm_events };
+    DWORD n = 0;
+    for (; n < readers; n++) {
+        r[n].b = &b;
+        threads[n] = CreateThread(NULL, 0, benchReader, &r[n], 0, NULL);
+        if (!threads[n]) {
+            code = setError(e, L"CreateThread failed");
+            break;
+        }
+    }
+
+    const ULONGLONG start = nowUs();
+    for (DWORD round = 0; round < rounds && !code; round++) {
+        const ULONGLONG next = nowUs() + interval_us;
+        fillBench(st, st->shm->data.generation + 1);
+        publishSnapshot(st);
+        while (nowUs() < next)
+            YieldProcessor();
+    }
+    const ULONGLONG elapsed = nowUs() - start;
+
+    // last update wakes everybody up to see stop
+    InterlockedExchange(&b.stop, TRUE);
+    fillBench(st, st->shm->data.generation + 1);
+    publishSnapshot(st);
+    if (n)
+        WaitForMultipleObjects(n, threads, TRUE, INFINITE);
+
+    reader_counts total = { 0 };
+    for (DWORD i = 0; i < n; i++) {
+        CloseHandle(threads[i]);
+        total.reads += r[i].n.reads;
+        total.torn += r[i].n.torn;
+        total.failed += r[i].n.failed;
+        total.wakeups += r[i].n.wakeups;
+        total.timeouts += r[i].n.timeouts;
+    }
+    if (code)
+        goto out;
+
+    jsonBegin(j, NULL);
+    jsonString(j, "bench", L"snapshot");
+    jsonNumber(j, "readers", readers);
+    jsonNumber(j, "rounds", rounds);
+    jsonNumber(j, "interval_us", interval_us);
+    jsonNumber(j, "elapsed_us", elapsed);
+    jsonNumber(j, "reads", total.reads);
+    jsonNumber(j, "torn", total.torn);
+    jsonNumber(j, "failed", total.failed);
+    jsonNumber(j, "wakeups", total.wakeups);
+    jsonNumber(j, "timeouts", total.timeouts);
+    jsonEnd(j);
+
+    if (total.torn)
+        code = setErrorCode(e, L"Torn snapshot read", ERROR_INVALID_DATA);
+
+out:
+    if (st)
+        closeSnapshot(st);
+    LocalFree(threads);
+    LocalFree(r);
+    LocalFree(st);
+    return code;
+}
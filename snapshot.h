@@ -0,0 +1,151 @@
+#pragma once
+
+#include <windows.h>
+
+// Disk snapshot published by wsldskmnt in named shared memory.
+// This header is self-contained so other tools can include it as is.
+//
+// Reader:
+//   HANDLE map = OpenFileMappingW(FILE_MAP_READ, FALSE, SNAPSHOT_NAME);
+//   const snapshot* shm = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+//   HANDLE events[SNAPSHOT_EVENTS];
+//   snapshotOpenEvents(events);
+//   while (snapshotRead(shm, &data))
+//       snapshotWait(shm, events, data.generation, 1000);
+//
+// Publisher bumps seq to odd value before it starts writing and back
+// to even value when it's done, so a reader retries until it sees the
+// same even value before and after the copy. Readers never block publisher.
+// A reader gives up after about 100 ms of odd seq, e.g. publisher died.
+// Only one process publishes: it owns SNAPSHOT_PUBLISHER mutex.
+//
+// Updates are signaled by a ring of manual-reset events: publishing
+// generation g resets event (g + 2) % SNAPSHOT_EVENTS before it starts
+// and sets event g % SNAPSHOT_EVENTS when it's done. A reader which has
+// seen generation g waits for either of the next two, and one of them
+// stays set until g + 4 is published. An update is only missed if the
+// publisher gets four generations ahead between the reader's check and
+// its wait, waiters should still use a timeout.
+
+#define SNAPSHOT_NAME L"Local\\wsldskmnt.snapshot"
+#define SNAPSHOT_PUBLISHER L"Local\\wsldskmnt.snapshot.publisher"
+#define SNAPSHOT_EVENT L"Local\\wsldskmnt.snapshot.updated"
+#define SNAPSHOT_EVENTS 4
+#define SNAPSHOT_MAGIC 0x6b736477 // "wdsk"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_SPINS 1000 // reader yields that many times,
+#define SNAPSHOT_SLEEPS 100 // then sleeps before giving up
+#define SNAPSHOT_DISKS 32
+#define SNAPSHOT_PARTS 16
+#define SNAPSHOT_PATH 24
+#define SNAPSHOT_IMAGE 260
+#define SNAPSHOT_TEXT 64
+
+typedef struct snapshot_part {
+    ULONGLONG size;
+    DWORD index;
+    WCHAR letter;
+    WCHAR type[SNAPSHOT_TEXT];
+} snapshot_part;
+
+typedef struct snapshot_disk {
+    ULONGLONG size;
+    DWORD index;
+    DWORD error; // nonzero if disk or its partitions failed to enumerate
+    DWORD n_parts;
+    WCHAR path[SNAPSHOT_PATH]; // device path, or mount name of image
+    WCHAR image[SNAPSHOT_IMAGE]; // image file, empty for physical disks
+    WCHAR model[SNAPSHOT_TEXT];
+    WCHAR serial[SNAPSHOT_TEXT];
+    snapshot_part part[SNAPSHOT_PARTS];
+} snapshot_disk;
+
+typedef struct snapshot_data {
+    ULONGLONG generation; // incremented on every update
+    DWORD error;          // nonzero if enumeration failed
+    DWORD n_disks;
+    snapshot_disk disk[SNAPSHOT_DISKS];
+} snapshot_data;
+
+typedef struct snapshot {
+    DWORD magic;
+    DWORD version;
+    DWORD size; // sizeof(snapshot)
+    volatile LONG seq;
+    snapshot_data data;
+} snapshot;
+
+static __inline BOOL snapshotValid(const snapshot* shm)
+{
+    return shm->magic == SNAPSHOT_MAGIC &&
+        shm->version == SNAPSHOT_VERSION &&
+        shm->size == sizeof(*shm);
+}
+
+static const WCHAR* const SNAPSHOT_EVENT_NAMES[SNAPSHOT_EVENTS] = {
+    SNAPSHOT_EVENT L".0",
+    SNAPSHOT_EVENT L".1",
+    SNAPSHOT_EVENT L".2",
+    SNAPSHOT_EVENT L".3",
+};
+
+// Copy consistent view of shared snapshot. Returns FALSE if layout
+// is not recognized, or publisher didn't finish writing in time.
+static __inline BOOL snapshotRead(const snapshot* shm, snapshot_data* out)
+{
+    if (!snapshotValid(shm))
+        return FALSE;
+
+    for (DWORD i = 0; i < SNAPSHOT_SPINS + SNAPSHOT_SLEEPS; i++) {
+        const LONG seq = shm->seq;
+        if (seq & 1) {
+            if (i < SNAPSHOT_SPINS)
+                YieldProcessor();
+            else
+                Sleep(1);
+            continue;
+        }
+        MemoryBarrier();
+        CopyMemory(out, (const void*)&shm->data, sizeof(*out));
+        MemoryBarrier();
+        if (shm->seq == seq)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// Cheap check if snapshot changed since last read
+static __inline ULONGLONG snapshotGeneration(const snapshot* shm)
+{
+    return *(volatile const ULONGLONG*)&shm->data.generation;
+}
+
+// Open update events of running publisher. Returns FALSE if there is none.
+static __inline BOOL snapshotOpenEvents(HANDLE* events)
+{
+    for (DWORD i = 0; i < SNAPSHOT_EVENTS; i++) {
+        events[i] = OpenEventW(SYNCHRONIZE, FALSE, SNAPSHOT_EVENT_NAMES[i]);
+        if (!events[i]) {
+            while (i)
+                CloseHandle(events[--i]);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Wait until generation is not the seen one any more.
+// Returns FALSE on timeout.
+static __inline BOOL snapshotWait(const snapshot* shm, const HANDLE* events,
+    ULONGLONG seen, DWORD timeout_ms)
+{
+    if (snapshotGeneration(shm) != seen)
+        return TRUE;
+
+    const HANDLE next[2] = {
+        events[(seen + 1) % SNAPSHOT_EVENTS],
+        events[(seen + 2) % SNAPSHOT_EVENTS],
+    };
+    WaitForMultipleObjects(ARRAYSIZE(next), next, FALSE, timeout_ms);
+    return snapshotGeneration(shm) != seen;
+}
@@ -0,0 +1,326 @@
+#include "shared.h"
+
+#include <windows.h>
+#include <intrin.h>
+#include <Shlwapi.h>
+
+// Always-on counters and latency histograms.
+// Recording is a single interlocked increment into static arrays,
+// nothing is allocated after start.
+//
+// Histogram buckets are log-linear like in HdrHistogram: values below 16
+// get own bucket, above that every power of two is split into 8 buckets,
+// which keeps relative error under 12.5% for any 64-bit value.
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct histogram {
+    volatile LONG64 count;
+    volatile LONG64 sum;
+    volatile LONG64 bucket[HIST_BUCKETS];
+} histogram;
+
+static volatile LONG64 g_counters[STAT_COUNTERS];
+static histogram g_hists[HIST_COUNT];
+
+static const struct {
+    PCSTR key;
+    PCWCH label;
+} counters[STAT_COUNTERS] = {
+    [STAT_REFRESHES]        = {"refreshes",         L"Refreshes"},
+    [STAT_QUERIES]          = {"queries",           L"WMI queries"},
+    [STAT_EVENTS]           = {"events",            L"Events received"},
+    [STAT_EVENTS_COALESCED] = {"events_coalesced",  L"Events coalesced"},
+    [STAT_MOUNT_OK]         = {"mount_ok",          L"Mounts succeeded"},
+    [STAT_MOUNT_FAILED]     = {"mount_failed",      L"Mounts failed"},
+    [STAT_UNMOUNT_OK]       = {"unmount_ok",        L"Unmounts succeeded"},
+    [STAT_UNMOUNT_FAILED]   = {"unmount_failed",    L"Unmounts failed"},
+    [STAT_EJECT_TIMEOUT]    = {"eject_timeout",     L"Unmounts timed out"},
+    [STAT_TASKS]            = {"tasks",             L"Tasks run"},
+    [STAT_TASKS_STOLEN]     = {"tasks_stolen",      L"Tasks stolen"},
+    [STAT_PARTS_TIMEOUT]    = {"parts_timeout",     L"Partition listings timed out"},
+    [STAT_PARTS_REUSED]     = {"parts_reused",      L"Partition lists reused"},
+    [STAT_PARTS_LISTED]     = {"parts_listed",      L"Partition lists read"},
+    [STAT_CACHE_HITS]       = {"cache_hits",        L"Block cache hits"},
+    [STAT_CACHE_MISSES]     = {"cache_misses",      L"Block cache misses"},
+    [STAT_CACHE_COALESCED]  = {"cache_coalesced",   L"Block reads shared"},
+    [STAT_CACHE_READS]      = {"cache_reads",       L"Block cache reads"},
+};
+
+static const struct {
+    PCSTR key;
+    PCWCH label;
+    BOOL us; // values are microseconds
+} hists[HIST_COUNT] = {
+    [HIST_ENUM]         = {"enumeration_us",    L"Enumeration",         TRUE},
+    [HIST_QUERIES]      = {"queries_per_refresh", L"Queries per refresh", FALSE},
+    [HIST_WSL_SPAWN]    = {"wsl_spawn_us",      L"wsl.exe spawn",       TRUE},
+    [HIST_WSL_EXIT]     = {"wsl_exit_us",       L"wsl.exe exit",        TRUE},
+    [HIST_WSL_RUNAS]    = {"wsl_runas_us",      L"wsl.exe elevated",    TRUE},
+    [HIST_EVENT_TO_MENU] = {"event_to_menu_us", L"Event to menu ready", TRUE},
+    [HIST_IO_SAMPLE]    = {"io_sample_us",      L"I/O sampling",        TRUE},
+    [HIST_BENCH]        = {"bench_read_us",     L"Benchmark reads",     TRUE},
+    [HIST_EJECT]        = {"eject_us",          L"Unmount all",         TRUE},
+    [HIST_TASK_WAIT]    = {"task_wait_us",      L"Task queue wait",     TRUE},
+    [HIST_DISK_READY]   = {"disk_ready_us",     L"Refresh to disk ready", TRUE},
+    [HIST_CACHE_READ]   = {"cache_read_us",     L"Block cache reads",   TRUE},
+};
+
+static DWORD bucketIndex(ULONGLONG v)
+{
+    if (v < 2 * HIST_SUB)
+        return (DWORD)v;
+
+    unsigned long msb;
+    _BitScanReverse64(&msb, v);
+    const DWORD shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (DWORD)((v >> shift) & (HIST_SUB - 1));
+}
+
+// Middle of the bucket's value range
+static ULONGLONG bucketValue(DWORD i)
+{
+    if (i < 2 * HIST_SUB)
+        return i;
+
+    const DWORD shift = i / HIST_SUB - 1;
+    const ULONGLONG low = (ULONGLONG)(HIST_SUB + i % HIST_SUB) << shift;
+    return low + ((1ull << shift) >> 1);
+}
+
+void statAdd(stat_counter c, LONG64 n)
+{
+    InterlockedAdd64(&g_counters[c], n);
+}
+
+LONG64 statGet(stat_counter c)
+{
+    return g_counters[c];
+}
+
+void statRecord(stat_hist h, ULONGLONG v)
+{
+    histogram* hist = &g_hists[h];
+    InterlockedIncrement64(&hist->bucket[bucketIndex(v)]);
+    InterlockedIncrement64(&hist->count);
+    InterlockedAdd64(&hist->sum, (LONG64)v);
+}
+
+ULONGLONG statPercentile(stat_hist h, DWORD pct)
+{
+    const histogram* hist = &g_hists[h];
+    const ULONGLONG count = hist->count;
+    if (!count)
+        return 0;
+
+    // rank of the sample, rounded up
+    const ULONGLONG rank = (count * pct + 99) / 100;
+    ULONGLONG seen = 0;
+    for (DWORD i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->bucket[i];
+        if (seen >= rank)
+            return bucketValue(i);
+    }
+    // concurrent update moved count ahead of buckets
+    return bucketValue(HIST_BUCKETS - 1);
+}
+
+ULONGLONG statCount(stat_hist h)
+{
+    return g_hists[h].count;
+}
+
+void statReset(stat_hist h)
+{
+    histogram* hist = &g_hists[h];
+    hist->count = 0;
+    hist->sum = 0;
+    for (DWORD i = 0; i < HIST_BUCKETS; i++)
+        hist->bucket[i] = 0;
+}
+
+static void formatValue(PWCHAR text, DWORD cch, ULONGLONG v, BOOL us)
+{
+    if (!us)
+        wnsprintfW(text, cch, L"%llu", v);
+    else if (v < 1000)
+        wnsprintfW(text, cch, L"%llu us", v);
+    else if (v < 10000000)
+        wnsprintfW(text, cch, L"%llu.%llu ms", v / 1000, v % 1000 / 100);
+    else
+        wnsprintfW(text, cch, L"%llu s", v / 1000000);
+}
+
+void formatHist(stat_hist h, PWCHAR text, DWORD cch)
+{
+    WCHAR p50[32], p99[32];
+    formatValue(p50, ARRAYSIZE(p50), statPercentile(h, 50), hists[h].us);
+    formatValue(p99, ARRAYSIZE(p99), statPercentile(h, 99), hists[h].us);
+    wnsprintfW(text, cch, L"%s: p50 %s, p99 %s (n=%llu)",
+        hists[h].label, p50, p99, statCount(h));
+}
+
+void formatCounter(stat_counter c, PWCHAR text, DWORD cch)
+{
+    wnsprintfW(text, cch, L"%s: %lld", counters[c].label, statGet(c));
+}
+
+static void exportHist(json* j, stat_hist h)
+{
+    const histogram* hist = &g_hists[h];
+    jsonBegin(j, hists[h].key);
+    jsonNumber(j, "count", hist->count);
+    jsonNumber(j, "sum", hist->sum);
+    jsonNumber(j, "p50", statPercentile(h, 50));
+    jsonNumber(j, "p90", statPercentile(h, 90));
+    jsonNumber(j, "p99", statPercentile(h, 99));
+    jsonNumber(j, "max", statPercentile(h, 100));
+
+    // only non-empty buckets as [value, count] pairs
+    jsonBeginArray(j, "buckets");
+    for (DWORD i = 0; i < HIST_BUCKETS; i++) {
+        if (!hist->bucket[i])
+            continue;
+        jsonBeginArray(j, NULL);
+        jsonNumber(j, NULL, bucketValue(i));
+        jsonNumber(j, NULL, hist->bucket[i]);
+        jsonEndArray(j);
+    }
+    jsonEndArray(j);
+    jsonEnd(j);
+}
+
+DWORD exportStats(PCWCH path)
+{
+    HANDLE h = CreateFileW(path, GENERIC_WRITE, 0, NULL,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+        return GetLastError();
+
+    json j[1] = { {.out = h, } };
+    jsonBegin(j, NULL);
+    jsonBegin(j, "counters");
+    for (DWORD c = 0; c < STAT_COUNTERS; c++)
+        jsonNumber(j, counters[c].key, statGet(c));
+    jsonEnd(j);
+    jsonBegin(j, "histograms");
+    for (DWORD i = 0; i < HIST_COUNT; i++)
+        exportHist(j, i);
+    jsonEnd(j);
+    jsonEnd(j);
+
+    CloseHandle(h);
+    return j->error;
+}
+
+#define CHECK_THREADS 4
+#define CHECK_RECORDS 100000
+
+static DWORD WINAPI checkRecorder(LPVOID param)
+{
+    UNREFERENCED_PARAMETER(param);
+    for (DWORD i = 0; i < CHECK_RECORDS; i++)
+        statRecord(HIST_BENCH, i);
+    return 0;
+}
+
+// Distance of v from middle of its bucket, in 1/16 of v
+static BOOL bucketFits(ULONGLONG v)
+{
+    const ULONGLONG mid = bucketValue(bucketIndex(v));
+    const ULONGLONG d = mid > v ? mid - v : v - mid;
+    return v < 2 * HIST_SUB ? d == 0 : d <= v / 16;
+}
+
+static void checkBuckets(check* c)
+{
+    DWORD bad = 0;
+    DWORD prev = 0;
+    for (ULONGLONG v = 0; v < 100000; v++) {
+        const DWORD i = bucketIndex(v);
+        bad += !bucketFits(v) || i < prev;
+        prev = i;
+    }
+    for (DWORD bit = 4; bit < 64; bit++) {
+        const ULONGLONG v = 1ull << bit;
+        bad += !bucketFits(v - 1) + !bucketFits(v) + !bucketFits(v + 1);
+    }
+    expectNumber(c, bad, 0, L"values are within 1/16 of their bucket");
+    expectNumber(c, bucketIndex(~0ull), HIST_BUCKETS - 1, L"largest value in last bucket");
+    expect(c, bucketFits(~0ull), L"largest value fits");
+}
+
+static void checkPercentiles(check* c)
+{
+    statReset(HIST_BENCH);
+    expectNumber(c, statPercentile(HIST_BENCH, 50), 0, L"empty histogram");
+
+    for (ULONGLONG v = 1; v <= 1000; v++)
+        statRecord(HIST_BENCH, v);
+    expectNumber(c, statCount(HIST_BENCH), 1000, L"count");
+    expect(c, bucketIndex(statPercentile(HIST_BENCH, 50)) == bucketIndex(500), L"p50 of 1..1000");
+    expect(c, bucketIndex(statPercentile(HIST_BENCH, 99)) == bucketIndex(990), L"p99 of 1..1000");
+    expect(c, bucketIndex(statPercentile(HIST_BENCH, 100)) == bucketIndex(1000), L"max of 1..1000");
+
+    // recording is lock-free, nothing may get lost
+    statReset(HIST_BENCH);
+    HANDLE threads[CHECK_THREADS];
+    DWORD n = 0;
+    for (; n < CHECK_THREADS; n++) {
+        threads[n] = CreateThread(NULL, 0, checkRecorder, NULL, 0, NULL);
+        if (!expect(c, threads[n] != NULL, L"CreateThread"))
+            break;
+    }
+    if (n)
+        WaitForMultipleObjects(n, threads, TRUE, INFINITE);
+    for (DWORD i = 0; i < n; i++)
+        CloseHandle(threads[i]);
+
+    ULONGLONG total = 0;
+    for (DWORD i = 0; i < HIST_BUCKETS; i++)
+        total += g_hists[HIST_BENCH].bucket[i];
+    expectNumber(c, statCount(HIST_BENCH), n * CHECK_RECORDS, L"concurrent count");
+    expectNumber(c, total, n * CHECK_RECORDS, L"concurrent bucket total");
+    expectNumber(c, g_hists[HIST_BENCH].sum,
+        n * ((ULONGLONG)CHECK_RECORDS * (CHECK_RECORDS - 1) / 2), L"concurrent sum");
+}
+
+static void checkFormat(check* c)
+{
+    WCHAR text[128];
+
+    statReset(HIST_BENCH);
+    statRecord(HIST_BENCH, 1500);
+    formatHist(HIST_BENCH, text, ARRAYSIZE(text));
+    expectText(c, text, L"Benchmark reads: p50 1.4 ms, p99 1.4 ms (n=1)", L"milliseconds");
+
+    statReset(HIST_BENCH);
+    for (DWORD i = 0; i < 98; i++)
+        statRecord(HIST_BENCH, 5);
+    statRecord(HIST_BENCH, 20000000);
+    statRecord(HIST_BENCH, 20000000);
+    formatHist(HIST_BENCH, text, ARRAYSIZE(text));
+    expectText(c, text, L"Benchmark reads: p50 5 us, p99 19 s (n=100)", L"microseconds and seconds");
+    statReset(HIST_BENCH);
+
+    statReset(HIST_QUERIES);
+    statRecord(HIST_QUERIES, 7);
+    formatHist(HIST_QUERIES, text, ARRAYSIZE(text));
+    expectText(c, text, L"Queries per refresh: p50 7, p99 7 (n=1)", L"plain numbers");
+    statReset(HIST_QUERIES);
+
+    const LONG64 before = statGet(STAT_TASKS);
+    statAdd(STAT_TASKS, 3);
+    expectNumber(c, statGet(STAT_TASKS) - before, 3, L"counter");
+    statAdd(STAT_TASKS, -3);
+}
+
+// Uses HIST_BENCH and HIST_QUERIES, which nothing records in headless mode
+void checkStats(check* c)
+{
+    checkBuckets(c);
+    checkPercentiles(c);
+    checkFormat(c);
+}
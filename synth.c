@@ -0,0 +1,273 @@
+#include "shared.h"
+
+#include <windows.h>
+#include <Shlwapi.h>
+
+// Synthetic disk backend.
+// Pretends to be WMI for the refresh path: a fixed pool of fake disks
+// which randomly arrive and leave, with change events injected by caller.
+// Every fourth disk is removable and every eighth one is slow to list
+// its partitions, like a sleeping USB drive.
+
+typedef struct synth {
+    DWORD disks;    // size of the pool
+    DWORD pending;  // events not yet seen by poll
+    DWORD slow_ms;  // delay of slow disks
+    ULONG rnd;
+    BOOL present[MAX_DISKS];
+} synth;
+
+static synth g_synth[1];
+
+static ULONG synthRandom(synth* s)
+{
+    // xorshift32, deterministic across runs
+    ULONG x = s->rnd;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return s->rnd = x;
+}
+
+static BOOL synthPoll(state* st)
+{
+    UNREFERENCED_PARAMETER(st);
+    const DWORD n = g_synth->pending;
+    if (!n)
+        return FALSE;
+
+    g_synth->pending = 0;
+    statAdd(STAT_EVENTS, n);
+    statAdd(STAT_EVENTS_COALESCED, n - 1);
+    return TRUE;
+}
+
+static void synthDisk(disk_info* disk, DWORD i)
+{
+    WCHAR model[32];
+    wnsprintfW(model, ARRAYSIZE(model), L"Synthetic disk %u", i);
+    disk->index = i;
+    disk->model = StrDupW(model);
+    disk->size = (ULONGLONG)(i + 1) << 36;
+    wnsprintfW(disk->path, ARRAYSIZE(disk->path), L"\\\\.\\PHYSICALDRIVE%u", i);
+    disk->removable = i % 4 == 3;
+    disk->loading = TRUE;
+
+    // partition count varies per disk to exercise menu building
+    disk->n_parts = 1 + i % MAX_PARTS;
+    // layout never changes, so a disk coming back reuses its partitions
+    disk->fingerprint = hashBytes(disk->size, &i, sizeof(i)) | 1;
+}
+
+static HRESULT synthParts(state* st, disk_info* disk, DWORD timeout_ms)
+{
+    UNREFERENCED_PARAMETER(st);
+    disk->loading = FALSE;
+    const DWORD i = disk->index;
+    if (i % 8 == 7 && g_synth->slow_ms) {
+        simSleep(min(g_synth->slow_ms, timeout_ms));
+        if (g_synth->slow_ms >= timeout_ms) {
+            statAdd(STAT_PARTS_TIMEOUT, 1);
+            return setErrorCode(disk->e_parts, L"Timed out listing partitions", ERROR_TIMEOUT);
+        }
+    }
+
+    for (DWORD j = 0; j < disk->n_parts; j++) {
+        part_info* part = getPart(disk, j);
+        part->index = j;
+        part->size = disk->size / disk->n_parts;
+        part->letter = j == 0 && i < 20 ? (WCHAR)(L'E' + i) : 0;
+        StrCpyNW(part->type, L"GPT: Basic Data", ARRAYSIZE(part->type));
+    }
+    return 0;
+}
+
+static HRESULT synthDrives(state* st)
+{
+    for (DWORD i = 0; i < g_synth->disks; i++) {
+        if (!g_synth->present[i])
+            continue;
+        synthDisk(getDisk(st, st->n_disks), i);
+        st->n_disks++;
+    }
+    return 0;
+}
+
+static const disk_backend synthBackend = {
+    .poll = synthPoll,
+    .drives = synthDrives,
+    .parts = synthParts,
+};
+
+void synthStart(state* st, DWORD disks, DWORD slow_ms, ULONG seed)
+{
+    synth* s = g_synth;
+    s->disks = min(disks, MAX_DISKS);
+    s->pending = 0;
+    s->slow_ms = slow_ms;
+    s->rnd = seed ? seed : 2463534242u; // xorshift is stuck at 0
+    for (DWORD i = 0; i < MAX_DISKS; i++)
+        s->present[i] = i < s->disks;
+
+    st->backend = &synthBackend;
+}
+
+void synthInject(state* st, DWORD events)
+{
+    synth* s = g_synth;
+    if (!s->disks)
+        return;
+
+    // latency is measured from the first event in a burst
+    if (!s->pending && !st->event_us)
+        st->event_us = nowUs();
+
+    for (DWORD i = 0; i < events; i++) {
+        const DWORD d = synthRandom(s) % s->disks;
+        s->present[d] = !s->present[d];
+        s->pending++;
+    }
+}
+
+// Core helpers over synthetic layouts of any size, see benchCore
+#define CORE_BENCH_WORK 100000 // disks processed per size and helper
+
+typedef struct core_bench {
+    disk_info* disk;
+    PWCHAR distros; // wsl --list -v output, default distro last
+    PWCHAR df;      // df -kP output, every disk mounted
+    PWCHAR numbers; // decimal sizes separated by zeros
+    fs_usage* usage;
+} core_bench;
+
+static void* coreAlloc(SIZE_T n, SIZE_T size)
+{
+    return VirtualAlloc(NULL, n * size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+static void coreFree(void* p)
+{
+    if (p)
+        VirtualFree(p, 0, MEM_RELEASE);
+}
+
+static void coreFill(core_bench* b, DWORD n)
+{
+    PWCHAR distros = b->distros;
+    PWCHAR df = b->df;
+    PWCHAR numbers = b->numbers;
+    distros += wnsprintfW(distros, 48, L"  NAME      STATE           VERSION\r\n");
+    df += wnsprintfW(df, 96, L"Filesystem 1024-blocks Used Available Capacity Mounted on\n");
+    for (DWORD i = 0; i < n; i++) {
+        const ULONGLONG size = ((ULONGLONG)i * 2654435761u % 4000 + 1) << 28;
+        b->disk[i].size = size;
+        distros += wnsprintfW(distros, 48, L"%c Distro%u    Running         2\r\n",
+            i + 1 == n ? L'*' : L' ', i);
+        df += wnsprintfW(df, 96, L"/dev/sd%c%u %llu %llu %llu 50%% /mnt/wsl/PHYSICALDRIVE%up1\n",
+            L'a' + i % 26, i, size >> 10, size >> 11, size >> 11, i);
+        numbers += wnsprintfW(numbers, 24, L"%llu", size) + 1;
+    }
+}
+
+// Indexes as WMI lists them: in order, but every sixteenth pair swapped
+static void coreShuffle(disk_info* disk, DWORD n)
+{
+    for (DWORD i = 0; i < n; i++)
+        disk[i].index = i % 16 == 0 && i + 1 < n ? i + 1 : i % 16 == 1 ? i - 1 : i;
+}
+
+static DWORD benchCoreSize(json* j, core_bench* b, DWORD n, err_desc* e)
+{
+    const DWORD rounds = max(CORE_BENCH_WORK / n, 1);
+    const ULONGLONG work = (ULONGLONG)rounds * n;
+    DWORD wrong = 0;
+    coreFill(b, n);
+
+    ULONGLONG sort_us = 0;
+    for (DWORD r = 0; r < rounds; r++) {
+        coreShuffle(b->disk, n);
+        const ULONGLONG start = nowUs();
+        sortDisks(b->disk, n);
+        sort_us += nowUs() - start;
+    }
+    for (DWORD i = 0; i < n; i++)
+        wrong += b->disk[i].index != i;
+    if (wrong)
+        return setErrorCode(e, L"Disks are not sorted", ERROR_INVALID_DATA);
+
+    WCHAR text[32];
+    ULONGLONG start = nowUs();
+    for (DWORD r = 0; r < rounds; r++)
+        for (DWORD i = 0; i < n; i++) {
+            formatSize(b->disk[i].size, text, ARRAYSIZE(text));
+            wrong += !text[0];
+        }
+    const ULONGLONG format_us = nowUs() - start;
+    if (wrong)
+        return setErrorCode(e, L"Size is not formatted", ERROR_INVALID_DATA);
+
+    start = nowUs();
+    for (DWORD r = 0; r < rounds; r++) {
+        PCWCH p = b->numbers;
+        for (DWORD i = 0; i < n; i++) {
+            wrong += wtou64(p) != b->disk[i].size;
+            p += lstrlenW(p) + 1;
+        }
+    }
+    const ULONGLONG number_us = nowUs() - start;
+    if (wrong)
+        return setErrorCode(e, L"Sizes are not parsed back", ERROR_INVALID_DATA);
+
+    // default distro is on the last line, the whole list is scanned
+    start = nowUs();
+    for (DWORD r = 0; r < rounds; r++)
+        wrong += !parseDistroList(b->distros, text, ARRAYSIZE(text));
+    const ULONGLONG distro_us = nowUs() - start;
+    if (wrong)
+        return setErrorCode(e, L"Default distro is not found", ERROR_INVALID_DATA);
+
+    start = nowUs();
+    for (DWORD r = 0; r < rounds; r++)
+        wrong += parseUsage(b->df, b->usage, n) != n;
+    const ULONGLONG usage_us = nowUs() - start;
+    if (wrong)
+        return setErrorCode(e, L"Usage lines are missing", ERROR_INVALID_DATA);
+
+    jsonBegin(j, NULL);
+    jsonString(j, "bench", L"core");
+    jsonNumber(j, "disks", n);
+    jsonNumber(j, "rounds", rounds);
+    jsonNumber(j, "sort_ns_per_disk", sort_us * 1000 / work);
+    jsonNumber(j, "format_ns_per_disk", format_us * 1000 / work);
+    jsonNumber(j, "number_ns_per_disk", number_us * 1000 / work);
+    jsonNumber(j, "distro_ns_per_line", distro_us * 1000 / work);
+    jsonNumber(j, "usage_ns_per_line", usage_us * 1000 / work);
+    jsonEnd(j);
+    return 0;
+}
+
+DWORD benchCore(json* j, DWORD max_disks, err_desc* e)
+{
+    static const DWORD sizes[] = { 1, 10, 100, 1000, 10000 };
+
+    core_bench b[1] = { {
+        .disk = coreAlloc(max_disks, sizeof(disk_info)),
+        .usage = coreAlloc(max_disks, sizeof(fs_usage)),
+        .distros = coreAlloc(max_disks * 48 + 48, sizeof(WCHAR)),
+        .df = coreAlloc(max_disks * 96 + 96, sizeof(WCHAR)),
+        .numbers = coreAlloc(max_disks * 24, sizeof(WCHAR)),
+    } };
+
+    DWORD code = 0;
+    if (!b->disk || !b->usage || !b->distros || !b->df || !b->numbers)
+        code = setError(e, L"Failed to allocate benchmark");
+    for (DWORD s = 0; s < ARRAYSIZE(sizes) && sizes[s] <= max_disks && !code; ++s)
+        code = benchCoreSize(j, b, sizes[s], e);
+
+    coreFree(b->disk);
+    coreFree(b->usage);
+    coreFree(b->distros);
+    coreFree(b->df);
+    coreFree(b->numbers);
+    return code;
+}
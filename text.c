@@ -0,0 +1,333 @@
+#include "core.h"
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define TEXT_SIMD 1
+#endif
+
+// UTF-16 text kernels: scanning for line and field breaks, transcoding
+// wsl.exe output and parsing decimals from WMI strings.
+// x86 builds use SSE2, or AVX2 for scanning when CPU and OS support it.
+// Scalar code is the reference implementation and the fallback.
+//
+// Vector loops only do aligned loads or check that unaligned load
+// doesn't cross a page. They may read past the end of the string,
+// e.g. parseDecimal takes 8 characters at a time past the terminating
+// zero, but never into the next page, so such reads can't fault.
+
+enum { SIMD_NONE, SIMD_SSE2, SIMD_AVX2 };
+
+static int g_simd = -1;
+static DWORD g_simd_limit = SIMD_AVX2;
+
+static int simdLevel(void)
+{
+    if (g_simd >= 0)
+        return g_simd;
+
+    int level = SIMD_NONE;
+#ifdef TEXT_SIMD
+    // SSE2 is baseline for x64
+    level = SIMD_SSE2;
+
+    int r[4];
+    __cpuid(r, 0);
+    if (r[0] >= 7) {
+        __cpuid(r, 1);
+        const BOOL osxsave = (r[2] >> 27) & 1;
+        const BOOL avx = (r[2] >> 28) & 1;
+        // OS must save YMM state too
+        if (osxsave && avx && (_xgetbv(0) & 6) == 6) {
+            __cpuidex(r, 7, 0);
+            if ((r[1] >> 5) & 1)
+                level = SIMD_AVX2;
+        }
+    }
+#endif
+    return g_simd = level;
+}
+
+static BOOL isStop(WCHAR c, WCHAR a, WCHAR b, WCHAR d)
+{
+    return c == 0 || c == a || c == b || c == d;
+}
+
+static PCWCH findStopScalar(PCWCH s, WCHAR a, WCHAR b, WCHAR d)
+{
+    while (!isStop(*s, a, b, d))
+        ++s;
+    return s;
+}
+
+#ifdef TEXT_SIMD
+static PCWCH findStopSse2(PCWCH s, WCHAR a, WCHAR b, WCHAR d)
+{
+    // go scalar until aligned, aligned load never crosses a page
+    for (; (ULONG_PTR)s & 15; ++s)
+        if (isStop(*s, a, b, d))
+            return s;
+
+    const __m128i z = _mm_setzero_si128();
+    const __m128i va = _mm_set1_epi16(a);
+    const __m128i vb = _mm_set1_epi16(b);
+    const __m128i vd = _mm_set1_epi16(d);
+    for (;; s += 8) {
+        const __m128i v = _mm_load_si128((const __m128i*)s);
+        const __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi16(v, z), _mm_cmpeq_epi16(v, va)),
+            _mm_or_si128(_mm_cmpeq_epi16(v, vb), _mm_cmpeq_epi16(v, vd)));
+        const int mask = _mm_movemask_epi8(m);
+        if (mask) {
+            unsigned long bit;
+            _BitScanForward(&bit, mask);
+            return s + bit / 2;
+        }
+    }
+}
+
+static PCWCH findStopAvx2(PCWCH s, WCHAR a, WCHAR b, WCHAR d)
+{
+    for (; (ULONG_PTR)s & 31; ++s)
+        if (isStop(*s, a, b, d))
+            return s;
+
+    const __m256i z = _mm256_setzero_si256();
+    const __m256i va = _mm256_set1_epi16(a);
+    const __m256i vb = _mm256_set1_epi16(b);
+    const __m256i vd = _mm256_set1_epi16(d);
+    for (;; s += 16) {
+        const __m256i v = _mm256_load_si256((const __m256i*)s);
+        const __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi16(v, z), _mm256_cmpeq_epi16(v, va)),
+            _mm256_or_si256(_mm256_cmpeq_epi16(v, vb), _mm256_cmpeq_epi16(v, vd)));
+        const unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if (mask) {
+            unsigned long bit;
+            _BitScanForward(&bit, mask);
+            return s + bit / 2;
+        }
+    }
+}
+#endif
+
+DWORD limitTextKernels(DWORD level)
+{
+    g_simd_limit = level;
+    return simdLevel();
+}
+
+// Find terminating zero or any of three given characters
+static PCWCH findStop(PCWCH s, WCHAR a, WCHAR b, WCHAR d)
+{
+    switch (min((DWORD)simdLevel(), g_simd_limit)) {
+#ifdef TEXT_SIMD
+    case SIMD_AVX2:
+        return findStopAvx2(s, a, b, d);
+    case SIMD_SSE2:
+        return findStopSse2(s, a, b, d);
+#endif
+    default:
+        return findStopScalar(s, a, b, d);
+    }
+}
+
+PCWCH findLineEnd(PCWCH s)
+{
+    return findStop(s, L'\r', L'\n', L'\n');
+}
+
+PCWCH findFieldEnd(PCWCH s)
+{
+    return findStop(s, L'\t', L' ', L'\n');
+}
+
+PCWCH skipLineBreaks(PCWCH s)
+{
+    while (*s == L'\r' || *s == L'\n')
+        ++s;
+    return s;
+}
+
+// Convert one code point. Returns number of bytes written, 0 if there is no room.
+static DWORD utf8Encode(PCWCH src, DWORD n, char* dst, DWORD cap, DWORD* used)
+{
+    DWORD c = src[0];
+    *used = 1;
+    if (IS_HIGH_SURROGATE(c) && n > 1 && IS_LOW_SURROGATE(src[1])) {
+        c = 0x10000 + ((c - 0xD800) << 10) + (src[1] - 0xDC00);
+        *used = 2;
+    }
+    else if (c >= 0xD800 && c <= 0xDFFF) {
+        c = 0xFFFD; // lone surrogate
+    }
+
+    const DWORD bytes = c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+    if (bytes > cap)
+        return 0;
+    switch (bytes) {
+    case 1:
+        dst[0] = (char)c;
+        break;
+    case 2:
+        dst[0] = (char)(0xC0 | (c >> 6));
+        dst[1] = (char)(0x80 | (c & 0x3F));
+        break;
+    case 3:
+        dst[0] = (char)(0xE0 | (c >> 12));
+        dst[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+        dst[2] = (char)(0x80 | (c & 0x3F));
+        break;
+    default:
+        dst[0] = (char)(0xF0 | (c >> 18));
+        dst[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+        dst[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+        dst[3] = (char)(0x80 | (c & 0x3F));
+    }
+    return bytes;
+}
+
+DWORD utf16ToUtf8(PCWCH src, DWORD n, char* dst, DWORD cap)
+{
+    DWORD i = 0, o = 0;
+    while (i < n) {
+#ifdef TEXT_SIMD
+        // ASCII runs are narrowed 8 characters at a time
+        const __m128i high = _mm_set1_epi16((short)0xFF80);
+        const __m128i z = _mm_setzero_si128();
+        while (i + 8 <= n && o + 8 <= cap) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, high), z)) != 0xFFFF)
+                break;
+            _mm_storel_epi64((__m128i*)(dst + o), _mm_packus_epi16(v, v));
+            i += 8;
+            o += 8;
+        }
+        if (i == n)
+            break;
+#endif
+        DWORD used;
+        const DWORD bytes = utf8Encode(src + i, n - i, dst + o, cap - o, &used);
+        if (!bytes)
+            break;
+        i += used;
+        o += bytes;
+    }
+    return o;
+}
+
+// Convert one code point. Returns number of characters written, 0 if there is no room.
+// Invalid sequences are replaced with U+FFFD one byte at a time.
+static DWORD utf8Decode(const char* src, DWORD n, PWCHAR dst, DWORD cap, DWORD* used)
+{
+    const BYTE b = (BYTE)src[0];
+    DWORD c, len;
+    if (b < 0x80)       { c = b;        len = 1; }
+    else if (b >= 0xF8) { c = 0;        len = 0; }
+    else if (b >= 0xF0) { c = b & 0x07; len = 4; }
+    else if (b >= 0xE0) { c = b & 0x0F; len = 3; }
+    else if (b >= 0xC0) { c = b & 0x1F; len = 2; }
+    else                { c = 0;        len = 0; }
+
+    DWORD k = 1;
+    for (; k < len && k < n && ((BYTE)src[k] & 0xC0) == 0x80; ++k)
+        c = (c << 6) | ((BYTE)src[k] & 0x3F);
+    if (!len || k < len) {
+        c = 0xFFFD;
+        k = 1;
+    }
+    else if ((len == 2 && c < 0x80) || (len == 3 && c < 0x800) ||
+        (len == 4 && (c < 0x10000 || c > 0x10FFFF)) || (c >= 0xD800 && c <= 0xDFFF)) {
+        c = 0xFFFD; // overlong or not a scalar value
+    }
+
+    *used = k;
+    if (c < 0x10000) {
+        if (!cap)
+            return 0;
+        dst[0] = (WCHAR)c;
+        return 1;
+    }
+    if (cap < 2)
+        return 0;
+    c -= 0x10000;
+    dst[0] = (WCHAR)(0xD800 + (c >> 10));
+    dst[1] = (WCHAR)(0xDC00 + (c & 0x3FF));
+    return 2;
+}
+
+DWORD utf8ToUtf16(const char* src, DWORD n, PWCHAR dst, DWORD cap)
+{
+    DWORD i = 0, o = 0;
+    while (i < n) {
+#ifdef TEXT_SIMD
+        // ASCII runs are widened 16 bytes at a time
+        const __m128i z = _mm_setzero_si128();
+        while (i + 16 <= n && o + 16 <= cap) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+            if (_mm_movemask_epi8(v))
+                break;
+            _mm_storeu_si128((__m128i*)(dst + o), _mm_unpacklo_epi8(v, z));
+            _mm_storeu_si128((__m128i*)(dst + o + 8), _mm_unpackhi_epi8(v, z));
+            i += 16;
+            o += 16;
+        }
+        if (i == n)
+            break;
+#endif
+        DWORD used;
+        const DWORD chars = utf8Decode(src + i, n - i, dst + o, cap - o, &used);
+        if (!chars)
+            break;
+        i += used;
+        o += chars;
+    }
+    return o;
+}
+
+static BOOL parseDecimalScalar(PCWCH s, ULONGLONG r, ULONGLONG* out)
+{
+    for (;; ++s) {
+        switch (*s) {
+        case 0:
+            *out = r;
+            return TRUE;
+        case L'0': case L'1': case L'2': case L'3': case L'4':
+        case L'5': case L'6': case L'7': case L'8': case L'9':
+            r = r * 10 + (*s - L'0');
+            break;
+        default:
+            *out = 0;
+            return FALSE;
+        }
+    }
+}
+
+BOOL parseDecimal(PCWCH s, ULONGLONG* out)
+{
+    ULONGLONG r = 0;
+#ifdef TEXT_SIMD
+    const __m128i zero = _mm_set1_epi16(L'0');
+    const __m128i nine = _mm_set1_epi16(9);
+    const __m128i neg = _mm_setzero_si128();
+    const __m128i mul10 = _mm_setr_epi16(10, 1, 10, 1, 10, 1, 10, 1);
+    const __m128i mul100 = _mm_setr_epi16(100, 1, 100, 1, 100, 1, 100, 1);
+
+    // 8 digits per step while unaligned load stays within the page
+    while (((ULONG_PTR)s & 4095) <= 4096 - sizeof(__m128i)) {
+        const __m128i d = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)s), zero);
+        const __m128i bad = _mm_or_si128(_mm_cmplt_epi16(d, neg), _mm_cmpgt_epi16(d, nine));
+        if (_mm_movemask_epi8(bad))
+            break;
+
+        // pairs of digits, then pairs of pairs
+        __m128i t = _mm_madd_epi16(d, mul10);
+        t = _mm_packs_epi32(t, t);
+        t = _mm_madd_epi16(t, mul100);
+        const ULONG hi = (ULONG)_mm_cvtsi128_si32(t);
+        const ULONG lo = (ULONG)_mm_cvtsi128_si32(_mm_srli_si128(t, 4));
+        r = r * 100000000 + hi * 10000ull + lo;
+        s += 8;
+    }
+#endif
+    return parseDecimalScalar(s, r, out);
+}
@@ -0,0 +1,279 @@
+#include "shared.h"
+
+#include <windows.h>
+
+// Every thread records begin/end events into its own ring buffer,
+// so recording takes no locks: the owner thread is the only writer
+// and publishes new head with release store. Oldest events are
+// overwritten when ring is full. Dump walks all rings and writes
+// Chrome trace event format, which Perfetto UI opens as well.
+
+#define TRACE_THREADS 16
+#define TRACE_EVENTS 4096 // per thread, must be power of two
+
+typedef struct trace_event {
+    PCWCH name;
+    LONGLONG ticks;
+    WCHAR phase;
+} trace_event;
+
+typedef struct trace_ring {
+    DWORD tid;
+    volatile LONG head; // number of events ever recorded
+    trace_event ev[TRACE_EVENTS];
+} trace_ring;
+
+static DWORD g_tls = TLS_OUT_OF_INDEXES;
+static LARGE_INTEGER g_freq;
+static LARGE_INTEGER g_start;
+static volatile LONG g_n_rings;
+static trace_ring* volatile g_rings[TRACE_THREADS];
+static ULONGLONG g_virtual_us; // set by simulation, trace itself stays in real time
+
+void initTrace(void)
+{
+    g_tls = TlsAlloc();
+    QueryPerformanceFrequency(&g_freq);
+    QueryPerformanceCounter(&g_start);
+}
+
+ULONGLONG ticksToUs(LONGLONG ticks)
+{
+    const ULONGLONG t = (ULONGLONG)ticks;
+    const ULONGLONG f = (ULONGLONG)g_freq.QuadPart;
+    if (!f)
+        return 0;
+    // avoid overflow of t * 1000000
+    return t / f * 1000000 + t % f * 1000000 / f;
+}
+
+void setVirtualClock(ULONGLONG us)
+{
+    g_virtual_us = us;
+}
+
+ULONGLONG nowUs(void)
+{
+    if (g_virtual_us)
+        return g_virtual_us;
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return ticksToUs(t.QuadPart - g_start.QuadPart);
+}
+
+static trace_ring* getRing(void)
+{
+    if (g_tls == TLS_OUT_OF_INDEXES)
+        return NULL;
+
+    trace_ring* r = TlsGetValue(g_tls);
+    if (r)
+        return r;
+
+    const LONG n = InterlockedIncrement(&g_n_rings) - 1;
+    if (n >= TRACE_THREADS)
+        return NULL;
+
+    r = VirtualAlloc(NULL, sizeof(*r), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!r)
+        return NULL;
+
+    r->tid = GetCurrentThreadId();
+    TlsSetValue(g_tls, r);
+    InterlockedExchangePointer((PVOID volatile*)&g_rings[n], r);
+    return r;
+}
+
+void traceEvent(PCWCH name, WCHAR phase)
+{
+    trace_ring* r = getRing();
+    if (!r)
+        return;
+
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+
+    const LONG head = r->head;
+    trace_event* e = &r->ev[head & (TRACE_EVENTS - 1)];
+    e->name = name;
+    e->ticks = t.QuadPart;
+    e->phase = phase;
+    WriteRelease(&r->head, head + 1);
+}
+
+static void dumpRing(json* j, const trace_ring* r, DWORD pid)
+{
+    const LONG head = ReadAcquire(&r->head);
+    const LONG tail = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+
+    for (LONG i = tail; i < head; i++) {
+        const trace_event* e = &r->ev[i & (TRACE_EVENTS - 1)];
+        const WCHAR phase[2] = { e->phase, 0 };
+        jsonBegin(j, NULL);
+        jsonString(j, "name", e->name);
+        jsonString(j, "ph", phase);
+        jsonNumber(j, "ts", ticksToUs(e->ticks - g_start.QuadPart));
+        jsonNumber(j, "pid", pid);
+        jsonNumber(j, "tid", r->tid);
+        jsonEnd(j);
+    }
+}
+
+DWORD dumpTrace(PCWCH path)
+{
+    HANDLE h = CreateFileW(path, GENERIC_WRITE, 0, NULL,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+        return GetLastError();
+
+    json j[1] = { {.out = h, } };
+    const DWORD pid = GetCurrentProcessId();
+    const LONG n = min(ReadAcquire(&g_n_rings), TRACE_THREADS);
+
+    jsonBegin(j, NULL);
+    jsonBeginArray(j, "traceEvents");
+    for (LONG i = 0; i < n; i++) {
+        // slot is reserved before ring is allocated
+        const trace_ring* r = g_rings[i];
+        if (r)
+            dumpRing(j, r, pid);
+    }
+    jsonEndArray(j);
+    jsonString(j, "displayTimeUnit", L"ms");
+    jsonEnd(j);
+
+    CloseHandle(h);
+    return j->error;
+}
+
+#define CHECK_THREADS 4
+#define CHECK_NAMES 8
+#define CHECK_EXTRA 100 // events more than a ring holds
+
+typedef struct trace_check {
+    DWORD index;
+    DWORD tid;
+    volatile LONG* go;
+} trace_check;
+
+// Events are told apart by name pointer, text doesn't matter
+static WCHAR g_check_names[CHECK_THREADS][CHECK_NAMES][2];
+
+static DWORD WINAPI checkThread(LPVOID param)
+{
+    const trace_check* t = param;
+    // record at the same time to catch rings shared by mistake
+    while (!ReadAcquire(t->go))
+        YieldProcessor();
+    for (DWORD i = 0; i < TRACE_EVENTS + CHECK_EXTRA; i++)
+        traceEvent(g_check_names[t->index][i % CHECK_NAMES], i & 1 ? L'E' : L'B');
+    return 0;
+}
+
+static const trace_ring* findRing(DWORD tid)
+{
+    // thread ids are reused, newest ring wins
+    for (LONG i = min(ReadAcquire(&g_n_rings), TRACE_THREADS); i-- > 0;) {
+        const trace_ring* r = g_rings[i];
+        if (r && r->tid == tid)
+            return r;
+    }
+    return NULL;
+}
+
+// Number of events which are not where and what they must be
+static DWORD checkRing(const trace_ring* r, DWORD index)
+{
+    DWORD bad = 0;
+    const LONG head = ReadAcquire(&r->head);
+    LONGLONG ticks = 0;
+    for (LONG seq = head - TRACE_EVENTS; seq < head; seq++) {
+        const trace_event* e = &r->ev[seq & (TRACE_EVENTS - 1)];
+        if (e->name != g_check_names[index][seq % CHECK_NAMES] ||
+            e->phase != (seq & 1 ? L'E' : L'B') || e->ticks < ticks)
+            bad++;
+        ticks = e->ticks;
+    }
+    return bad;
+}
+
+static DWORD countText(const char* s, DWORD n, PCSTR what)
+{
+    const DWORD len = lstrlenA(what);
+    DWORD count = 0;
+    for (DWORD i = 0; i + len <= n; i++) {
+        DWORD k = 0;
+        while (k < len && s[i + k] == what[k])
+            k++;
+        count += k == len;
+    }
+    return count;
+}
+
+static void checkDump(check* c)
+{
+    WCHAR dir[MAX_PATH];
+    WCHAR path[MAX_PATH];
+    if (!expect(c, GetTempPathW(ARRAYSIZE(dir), dir) &&
+        GetTempFileNameW(dir, L"wdt", 0, path), L"temporary file"))
+        return;
+    char* text = NULL;
+    DWORD n = 0;
+    if (expectNumber(c, dumpTrace(path), 0, L"dumpTrace")) {
+        HANDLE h = CreateFileW(path, GENERIC_READ, 0, NULL, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, NULL);
+        if (h != INVALID_HANDLE_VALUE) {
+            const DWORD size = GetFileSize(h, NULL);
+            text = LocalAlloc(0, size + 1);
+            if (text && !ReadFile(h, text, size, &n, NULL))
+                n = 0;
+            CloseHandle(h);
+        }
+    }
+    DeleteFileW(path);
+    if (!expect(c, n > 0, L"read dump")) {
+        LocalFree(text);
+        return;
+    }
+
+    static const char head[] = "{\"traceEvents\":[";
+    static const char tail[] = "],\"displayTimeUnit\":\"ms\"}\n";
+    expectNumber(c, countText(text, min(n, sizeof(head) - 1), head), 1, L"dump starts with events");
+    expectNumber(c, countText(text + n - min(n, sizeof(tail) - 1), min(n, sizeof(tail) - 1), tail),
+        1, L"dump ends with time unit");
+    expect(c, countText(text, n, "\"ph\":\"") >= CHECK_THREADS * TRACE_EVENTS,
+        L"dump has events of all rings");
+    LocalFree(text);
+}
+
+void checkTrace(check* c)
+{
+    if (!expect(c, g_tls != TLS_OUT_OF_INDEXES, L"trace is initialized"))
+        return;
+
+    volatile LONG go = FALSE;
+    trace_check t[CHECK_THREADS];
+    HANDLE threads[CHECK_THREADS];
+    DWORD n = 0;
+    for (; n < CHECK_THREADS; n++) {
+        t[n] = (trace_check){ .index = n, .go = &go };
+        threads[n] = CreateThread(NULL, 0, checkThread, &t[n], 0, &t[n].tid);
+        if (!expect(c, threads[n] != NULL, L"CreateThread"))
+            break;
+    }
+    WriteRelease(&go, TRUE);
+    if (n)
+        WaitForMultipleObjects(n, threads, TRUE, INFINITE);
+
+    for (DWORD i = 0; i < n; i++) {
+        CloseHandle(threads[i]);
+        const trace_ring* r = findRing(t[i].tid);
+        if (!expect(c, r != NULL, L"ring per thread"))
+            continue;
+        expectNumber(c, (ULONGLONG)ReadAcquire(&r->head), TRACE_EVENTS + CHECK_EXTRA,
+            L"events recorded");
+        expectNumber(c, checkRing(r, i), 0, L"ring keeps newest events in order");
+    }
+
+    checkDump(c);
+}